@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+"""
+Generate PyDevice benchmark databases.
+
+Expands pydevbench_<type>.template files for the requested number of
+records of each type. Every record gets a unique index N, which the
+stand-in device uses to match scan of its Start record with completion.
+
+Usage: benchdb.py [options] > bench.db
+"""
+
+import argparse
+import os
+import re
+import sys
+
+TYPES = ("ai", "ao", "waveform", "pycalc")
+
+# Python expressions of increasing cost evaluated by every record
+EXPRESSIONS = {
+    "trivial": "bench.x",
+    "arith":   "(bench.x * 1.5 + 2.0) ** 0.5 / 3.0",
+    "heavy":   "sum(i * i for i in range(100))",
+}
+
+
+def find_templates(top):
+    """Return directory with installed templates, or the source one."""
+    for path in (os.path.join(top, "db"), os.path.join(top, "benchApp", "Db")):
+        if os.path.isfile(os.path.join(path, "pydevbench_ai.template")):
+            return path
+    raise IOError("pydevbench templates not found in %s" % top)
+
+
+def expand(text, macros):
+    return re.sub(r"\$\((\w+)\)", lambda m: str(macros[m.group(1)]), text)
+
+
+def generate(templates, count, types=TYPES, scan="1 second", expr="trivial", nelm=100, prefix="Bench:"):
+    """
+    Return database text with count records of each type.
+
+    @param templates Directory with pydevbench_<type>.template files
+    @param count Number of records of each type
+    @param types Record types to generate
+    @param scan SCAN field of Start records that trigger benchmark records
+    @param expr Name of expression in EXPRESSIONS, or Python expression
+    @param nelm Number of waveform elements
+    @param prefix Record name prefix
+    """
+    db = []
+    n = 0
+    for rtype in types:
+        with open(os.path.join(templates, "pydevbench_%s.template" % rtype)) as f:
+            template = f.read()
+        for _ in range(count):
+            macros = {
+                "P":    prefix,
+                "N":    n,
+                "SCAN": scan,
+                "EXPR": EXPRESSIONS.get(expr, expr),
+                "NELM": nelm,
+            }
+            db.append(expand(template, macros))
+            n += 1
+    return "".join(db)
+
+
+def main():
+    top = os.path.abspath(os.path.join(os.path.dirname(__file__), "..", ".."))
+    parser = argparse.ArgumentParser(description="Generate PyDevice benchmark database")
+    parser.add_argument("--top", default=top, help="PyDevice top directory")
+    parser.add_argument("--count", type=int, default=100, help="Records of each type")
+    parser.add_argument("--types", default=",".join(TYPES), help="Comma separated record types")
+    parser.add_argument("--scan", default="1 second", help="SCAN field of Start records")
+    parser.add_argument("--expr", default="trivial", help="One of %s, or Python expression" % ", ".join(sorted(EXPRESSIONS)))
+    parser.add_argument("--nelm", type=int, default=100, help="Waveform elements")
+    parser.add_argument("--prefix", default="Bench:", help="Record name prefix")
+    args = parser.parse_args()
+
+    types = [t for t in args.types.split(",") if t]
+    for t in types:
+        if t not in TYPES:
+            parser.error("unsupported record type '%s'" % t)
+    sys.stdout.write(generate(find_templates(args.top), args.count, types, args.scan, args.expr, args.nelm, args.prefix))
+
+
+if __name__ == "__main__":
+    main()
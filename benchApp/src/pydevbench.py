@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+"""
+Run PyDevice IOC benchmarks and print results as JSON.
+
+For every combination of worker threads, waveform size and expression
+the driver generates a database with benchdb.py, starts the IOC with
+stand-in device from python/benchdevice.py, lets it warm up, then
+collects throughput, latency percentiles and CPU usage of the IOC
+process over the measurement period.
+
+Results are written as a single JSON document that includes the git
+commit of the PyDevice tree, pass it as --baseline to a later run to
+print relative changes.
+
+Usage: pydevbench.py [options] [--output results.json]
+"""
+
+import argparse
+import itertools
+import json
+import os
+import platform
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import benchdb
+
+
+def int_list(text):
+    return [int(v) for v in text.split(",") if v]
+
+
+def str_list(text):
+    return [v for v in text.split(",") if v]
+
+
+def git_commit(top):
+    try:
+        out = subprocess.check_output(["git", "rev-parse", "HEAD"], cwd=top, stderr=subprocess.STDOUT)
+        return out.decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def find_ioc(top):
+    arch = os.environ.get("EPICS_HOST_ARCH", "")
+    return os.path.join(top, "bin", arch, "pydevioc")
+
+
+def run_ioc(args, threads, nelm, expr):
+    """Run one benchmark configuration and return its results dict."""
+    tmp = tempfile.mkdtemp(prefix="pydevbench")
+    try:
+        db = os.path.join(tmp, "bench.db")
+        out = os.path.join(tmp, "results.json")
+        with open(db, "w") as f:
+            f.write(benchdb.generate(benchdb.find_templates(args.top), args.count, args.types,
+                                     args.scan, expr, nelm))
+
+        env = dict(os.environ)
+        env["PYDEV_NUM_THREADS"] = str(threads)
+        pythonpath = [os.path.join(args.top, "python")]
+        if env.get("PYTHONPATH"):
+            pythonpath.append(env["PYTHONPATH"])
+        env["PYTHONPATH"] = os.pathsep.join(pythonpath)
+
+        log = open(os.path.join(tmp, "ioc.log"), "w")
+        ioc = subprocess.Popen([args.ioc], stdin=subprocess.PIPE, stdout=log, stderr=subprocess.STDOUT,
+                               env=env, cwd=tmp, universal_newlines=True)
+
+        def send(command):
+            ioc.stdin.write(command + "\n")
+            ioc.stdin.flush()
+
+        send('dbLoadDatabase "%s"' % os.path.join(args.top, "dbd", "pydevioc.dbd"))
+        send("pydevioc_registerRecordDeviceDriver pdbbase")
+        send('dbLoadRecords "%s"' % db)
+        send('pydev("import benchdevice")')
+        send('pydev("bench = benchdevice.Device()")')
+        send("iocInit")
+        time.sleep(args.warmup)
+        send('pydev("bench.reset()")')
+        time.sleep(args.duration)
+        send('pydev("bench.dump(\'%s\')")' % out)
+        send("exit")
+        ioc.stdin.close()
+        try:
+            ioc.wait(timeout=args.duration + 60)
+        except subprocess.TimeoutExpired:
+            ioc.kill()
+            ioc.wait()
+        log.close()
+
+        if not os.path.isfile(out):
+            with open(os.path.join(tmp, "ioc.log")) as f:
+                sys.stderr.write(f.read())
+            raise RuntimeError("IOC didn't produce results, see log above")
+        with open(out) as f:
+            return json.load(f)
+    finally:
+        shutil.rmtree(tmp, ignore_errors=True)
+
+
+def key(result):
+    return (result["threads"], result["nelm"], result["expr"])
+
+
+def compare(baseline, results):
+    """Print change of throughput and p99 latency against baseline run."""
+    previous = dict((key(r), r) for r in baseline["results"])
+    sys.stderr.write("Compared to %s\n" % (baseline.get("commit") or "baseline"))
+    sys.stderr.write("threads nelm   expr     rate       p99\n")
+    for r in results:
+        old = previous.get(key(r))
+        if old is None:
+            continue
+        rate = (r["records_per_second"] / old["records_per_second"] - 1.0) * 100 if old["records_per_second"] else 0.0
+        p99 = (r["latency_us"]["p99"] / old["latency_us"]["p99"] - 1.0) * 100 if old["latency_us"]["p99"] else 0.0
+        sys.stderr.write("%-7d %-6d %-8s %+8.1f%% %+8.1f%%\n" % (r["threads"], r["nelm"], r["expr"], rate, p99))
+
+
+def main():
+    top = os.path.abspath(os.path.join(os.path.dirname(__file__), "..", ".."))
+    parser = argparse.ArgumentParser(description="PyDevice IOC benchmark")
+    parser.add_argument("--top", default=top, help="PyDevice top directory")
+    parser.add_argument("--ioc", help="IOC executable, default bin/$EPICS_HOST_ARCH/pydevioc")
+    parser.add_argument("--count", type=int, default=100, help="Records of each type")
+    parser.add_argument("--types", type=str_list, default=list(benchdb.TYPES), help="Comma separated record types")
+    parser.add_argument("--scan", default=".1 second", help="SCAN field of Start records")
+    parser.add_argument("--threads", type=int_list, default=[1, 2, 4], help="Comma separated PYDEV_NUM_THREADS values")
+    parser.add_argument("--nelm", type=int_list, default=[10, 1000], help="Comma separated waveform sizes")
+    parser.add_argument("--expr", type=str_list, default=sorted(benchdb.EXPRESSIONS), help="Comma separated expressions")
+    parser.add_argument("--warmup", type=float, default=2.0, help="Seconds before measuring")
+    parser.add_argument("--duration", type=float, default=10.0, help="Seconds of measurement")
+    parser.add_argument("--output", help="Write results to file instead of stdout")
+    parser.add_argument("--baseline", help="Results of previous run to compare against")
+    args = parser.parse_args()
+    if not args.ioc:
+        args.ioc = find_ioc(args.top)
+
+    results = []
+    for threads, nelm, expr in itertools.product(args.threads, args.nelm, args.expr):
+        sys.stderr.write("threads=%d nelm=%d expr=%s\n" % (threads, nelm, expr))
+        result = run_ioc(args, threads, nelm, expr)
+        result.update({"threads": threads, "nelm": nelm, "expr": expr})
+        results.append(result)
+
+    doc = {
+        "commit":   git_commit(args.top),
+        "host":     platform.node(),
+        "cpus":     os.cpu_count() if hasattr(os, "cpu_count") else None,
+        "date":     time.strftime("%Y-%m-%dT%H:%M:%S"),
+        "count":    args.count,
+        "types":    args.types,
+        "scan":     args.scan,
+        "duration": args.duration,
+        "results":  results,
+    }
+    text = json.dumps(doc, indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        sys.stdout.write(text + "\n")
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            compare(json.load(f), results)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,105 @@
+"""
+Stand-in device for PyDevice benchmarks.
+
+Periodically scanned Start records call start() and FLNK the passive
+benchmark records, which call read(), write() or array(). Their FLNK-ed
+Done record calls done() once the benchmark record has completed
+processing and posted monitors. Time between the two is the record's
+latency, from scan to post, including time spent waiting in PyDevice
+queue. Output records store returned values, so every function returns
+one.
+
+Usage from IOC shell:
+    pydev("import benchdevice")
+    pydev("bench = benchdevice.Device()")
+    ...
+    pydev("bench.reset()")
+    ...
+    pydev("bench.dump('results.json')")
+"""
+
+import array
+import json
+import threading
+import time
+
+_clock = getattr(time, "perf_counter", time.time)
+_cpu = getattr(time, "process_time", time.clock if hasattr(time, "clock") else time.time)
+
+
+def percentile(values, pct):
+    """Return pct percentile of sorted values, nearest rank."""
+    if not values:
+        return 0.0
+    index = int(round(pct / 100.0 * (len(values) - 1)))
+    return values[index]
+
+
+class Device(object):
+    def __init__(self):
+        self.x = 1.0
+        self._lock = threading.Lock()
+        self._arrays = {}
+        self.reset()
+
+    def reset(self):
+        """Discard collected samples and start new measurement period."""
+        with self._lock:
+            self._started = {}
+            self._latencies = []
+            self._writes = 0
+            self._wall0 = _clock()
+            self._cpu0 = _cpu()
+
+    def start(self, n):
+        self._started[n] = _clock()
+        return n
+
+    def read(self, n, value):
+        return value
+
+    def write(self, n, value):
+        with self._lock:
+            self._writes += 1
+        return value
+
+    def array(self, n, nelm):
+        arr = self._arrays.get(nelm)
+        if arr is None:
+            arr = array.array("d", [float(i) for i in range(nelm)])
+            self._arrays[nelm] = arr
+        return arr
+
+    def done(self, n):
+        now = _clock()
+        start = self._started.pop(n, None)
+        if start is not None:
+            with self._lock:
+                self._latencies.append(now - start)
+        return n
+
+    def results(self):
+        """Return dict with throughput, latency percentiles and CPU usage since reset()."""
+        with self._lock:
+            wall = _clock() - self._wall0
+            cpu = _cpu() - self._cpu0
+            latencies = sorted(self._latencies)
+            writes = self._writes
+        processed = len(latencies)
+        return {
+            "seconds":      wall,
+            "processed":    processed,
+            "writes":       writes,
+            "records_per_second": (processed / wall if wall > 0 else 0.0),
+            "cpu_percent":  (100.0 * cpu / wall if wall > 0 else 0.0),
+            "latency_us": {
+                "p50": percentile(latencies, 50) * 1e6,
+                "p90": percentile(latencies, 90) * 1e6,
+                "p99": percentile(latencies, 99) * 1e6,
+                "max": (latencies[-1] * 1e6 if latencies else 0.0),
+            },
+        }
+
+    def dump(self, path):
+        with open(path, "w") as f:
+            json.dump(self.results(), f)
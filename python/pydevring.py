@@ -0,0 +1,173 @@
+"""
+Writer for PyDevice shared memory rings.
+
+Pushes I/O Intr parameter values into an IOC from another process. The
+IOC creates the ring with the pydevRing iocsh command and drains it in a
+native thread, records reading the parameters with pydev.iointr('name')
+then process without running any Python code in the IOC.
+
+Usage:
+    import pydevring
+    ring = pydevring.Ring("myring")
+    ring.push("temperature", 21.5)
+    ring.push("spectrum", numpy.zeros(1024))
+    ring.close()
+
+Protocol is described in src/pydevring.h. Python can't do atomic
+compare-and-swap on shared memory, so a Ring object must be the only
+writer of its ring. Several Python writers can share a ring by passing
+the same multiprocessing.Lock to all of them, but C writers must not be
+mixed with Python ones. Requires Python 3 and POSIX shared memory
+mounted at /dev/shm, like on Linux.
+"""
+
+import array
+import mmap
+import numbers
+import struct
+import sys
+import threading
+
+_MAGIC = 0x50594452
+_VERSION = 1
+_DATA = 192
+_DROPPED = 16
+_TAIL = 64
+_HEAD = 128
+_NAME_MAX = 255
+
+_HEADER = struct.Struct("=IIQ")
+_POS = struct.Struct("=Q")
+_SIZE = struct.Struct("=I")
+_TYPE = struct.Struct("=H")
+_MSG = struct.Struct("=HBBII")      # Message header after the size word
+
+_DOUBLE, _INT64, _STRING, _ARRAY = 1, 2, 3, 4
+
+_DOUBLE_VALUE = struct.Struct("=d")
+_INT64_VALUE = struct.Struct("=q")
+
+# Element type codes by (kind, itemsize), buffer format letters like 'l'
+# have platform dependent size
+_ELEM_TYPES = {
+    ("i", 1): 0, ("u", 1): 1, ("i", 2): 2, ("u", 2): 3, ("i", 4): 4,
+    ("u", 4): 5, ("i", 8): 6, ("u", 8): 7, ("f", 4): 8, ("f", 8): 9,
+}
+_NATIVE = ("@", "=", "<" if sys.byteorder == "little" else ">")
+
+
+def _align(n):
+    return (n + 7) & ~7
+
+
+def _elem_type(view):
+    """Return element type code of 1-D contiguous buffer, None if not supported."""
+    fmt = view.format
+    if fmt and fmt[0] in _NATIVE:
+        fmt = fmt[1:]
+    if len(fmt) != 1:
+        return None
+    kind = "i" if fmt in "bhilqn" else "u" if fmt in "BHILQN" else "f" if fmt in "fd" else None
+    return _ELEM_TYPES.get((kind, view.itemsize))
+
+
+class Ring(object):
+    def __init__(self, name, lock=None):
+        """
+        Attach ring created by the IOC with pydevRing.
+
+        lock is an optional multiprocessing.Lock shared by all Python
+        writers of the ring.
+        """
+        with open("/dev/shm/" + name, "r+b") as f:
+            self._mm = mmap.mmap(f.fileno(), 0)
+        magic, version, size = _HEADER.unpack_from(self._mm, 0)
+        if magic != _MAGIC or version != _VERSION or size < 64 or size & (size - 1) or len(self._mm) < _DATA + size:
+            self._mm.close()
+            raise ValueError("'%s' is not a PyDevice ring" % name)
+        self._size = size
+        self._lock = lock
+        # Acquiring and releasing a lock is a full memory barrier, Python
+        # has no other way to order stores to shared memory
+        self._fence = threading.Lock()
+
+    def _barrier(self):
+        self._fence.acquire()
+        self._fence.release()
+
+    def close(self):
+        self._mm.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    @property
+    def dropped(self):
+        """Number of messages rejected because the ring was full."""
+        return _POS.unpack_from(self._mm, _DROPPED)[0]
+
+    def push(self, param, value):
+        """
+        Push new value of I/O Intr parameter.
+
+        value is int, float, str, a list of numbers or 1-D contiguous
+        object with buffer interface, like array.array or numpy array.
+        Returns False when the ring is full and the value was dropped.
+        """
+        name = param.encode("utf-8")
+        elem_type = 0
+        if isinstance(value, numbers.Integral):
+            msg_type, data, count = _INT64, _INT64_VALUE.pack(int(value)), 1
+        elif isinstance(value, numbers.Real):
+            msg_type, data, count = _DOUBLE, _DOUBLE_VALUE.pack(float(value)), 1
+        elif isinstance(value, str):
+            data = value.encode("utf-8")
+            msg_type, count = _STRING, len(data)
+        else:
+            if isinstance(value, (list, tuple)):
+                value = array.array("d" if any(isinstance(v, float) for v in value) else "q", value)
+            view = memoryview(value)
+            elem_type = _elem_type(view)
+            if view.ndim != 1 or not view.c_contiguous or elem_type is None:
+                raise TypeError("Unsupported array type for PyDevice ring")
+            msg_type, data, count = _ARRAY, view.cast("B"), len(view)
+
+        if not name or len(name) > _NAME_MAX:
+            raise ValueError("Parameter name must be 1 to %d bytes" % _NAME_MAX)
+        need = 16 + _align(len(name)) + _align(len(data))
+        if need > self._size // 2:
+            raise ValueError("Value doesn't fit in the ring")
+
+        if self._lock is not None:
+            with self._lock:
+                return self._write(name, msg_type, elem_type, data, count, need)
+        return self._write(name, msg_type, elem_type, data, count, need)
+
+    def _write(self, name, msg_type, elem_type, data, count, need):
+        mm, size = self._mm, self._size
+        tail = _POS.unpack_from(mm, _TAIL)[0]
+        head = _POS.unpack_from(mm, _HEAD)[0]
+        self._barrier()
+        offset = tail & (size - 1)
+        pad = size - offset if offset + need > size else 0
+        if tail + pad + need - head > size:
+            _POS.pack_into(mm, _DROPPED, self.dropped + 1)
+            return False
+
+        if pad:
+            _TYPE.pack_into(mm, _DATA + offset + 4, 0)
+            self._barrier()
+            _SIZE.pack_into(mm, _DATA + offset, pad)
+
+        pos = _DATA + ((tail + pad) & (size - 1))
+        _MSG.pack_into(mm, pos + 4, msg_type, elem_type, len(name), count, 0)
+        mm[pos + 16:pos + 16 + len(name)] = name
+        start = pos + 16 + _align(len(name))
+        mm[start:start + len(data)] = data
+        self._barrier()
+        _SIZE.pack_into(mm, pos, need)
+        _POS.pack_into(mm, _TAIL, tail + pad + need)
+        return True
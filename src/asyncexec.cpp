@@ -4,118 +4,789 @@
 \*************************************************************************/
 
 #include "asyncexec.h"
+#include "pywrapper.h"
 
+#include <dbAccess.h>
+#include <dbCommon.h>
+#include <dbScan.h>
+#include <dbStaticLib.h>
 #include <epicsEvent.h>
-#include <epicsMutex.h>
 #include <epicsThread.h>
+#include <epicsVersion.h>
 
 #include <atomic>
+#include <chrono>
 #include <cstdio>
-#include <list>
+#include <cstdlib>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <string>
 
-template<typename T>
-class TaskQueue {
+#ifdef VERSION_INT
+#  if EPICS_VERSION_INT >= VERSION_INT(3,15,0,2)
+#    define HAVE_SCAN_PERIOD
+#  endif
+#endif
+
+static bool g_deadlines = false;
+static double g_defaultDeadline = 1.0;
+static int64_t g_starvationTime = 100000000;
+static int64_t g_inlineTime = 50000;
+static std::atomic<uint64_t> g_inlineRuns{0};
+static std::atomic<uint64_t> g_inlineBusy{0};
+
+static int64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Update task's moving average of execution time.
+ *
+ * Task may already be running again in another thread, an occasional
+ * lost update doesn't matter.
+ */
+static void updateCost(AsyncExec::Task& task, int64_t elapsed)
+{
+    int64_t cost = task.cost.load(std::memory_order_relaxed);
+    task.cost.store(cost + (elapsed - cost) / 4, std::memory_order_relaxed);
+}
+
+/**
+ * Queues feeding one or more workers, one lane for each record PRIO.
+ *
+ * With deadline ordering each lane is split into classes of SCAN period.
+ * Picking the earliest deadline from the front of each class gives EDF
+ * order without a heap for standard SCAN periods, which all have a class
+ * of their own. Tasks whose periods share a class run in FIFO order, so
+ * for other periods the order is only approximate.
+ */
+class Lanes {
     private:
-        epicsMutex mutex;
-        epicsEvent event;
-        std::list<T> que;
+        // Upper bounds of period classes, matching default menuScan
+        static constexpr double classPeriods[] = { 0.1, 0.2, 0.5, 1.0, 2.0, 5.0, 10.0 };
+        static const unsigned NUM_CLASSES = sizeof(classPeriods) / sizeof(classPeriods[0]) + 1;
+
+        EventCount event;
+        std::unique_ptr<TaskQueue> queues[AsyncExec::NUM_LANES][NUM_CLASSES];
+        std::atomic<size_t> depths[AsyncExec::NUM_LANES];
+        std::atomic<size_t> sizes[AsyncExec::NUM_LANES][NUM_CLASSES];
+        std::atomic<uint64_t> served[AsyncExec::NUM_LANES];
+        std::atomic<uint64_t> promoted[AsyncExec::NUM_LANES];
+
+        static unsigned periodClass(double period)
+        {
+            if (!g_deadlines) {
+                return 0;
+            }
+            unsigned cls = 0;
+            while (cls < NUM_CLASSES - 1 && (period <= 0.0 || period > classPeriods[cls])) {
+                cls++;
+            }
+            return cls;
+        }
+
+        /**
+         * Find class within lane with the earliest deadline or the oldest task.
+         *
+         * Classes are counted before tasks are queued, so empty ones are
+         * skipped without taking their queue's consumer flag.
+         *
+         * @return Class index or -1 when lane is empty
+         */
+        int front(unsigned lane, bool byDeadline, int64_t& queued)
+        {
+            int found = -1;
+            int64_t best = 0;
+            unsigned numClasses = (g_deadlines ? NUM_CLASSES : 1);
+            for (unsigned cls = 0; cls < numClasses; cls++) {
+                int64_t q, d;
+                if (sizes[lane][cls] != 0 && queues[lane][cls]->peek(q, d)) {
+                    int64_t key = (byDeadline ? d : q);
+                    if (found < 0 || key < best) {
+                        found = cls;
+                        best = key;
+                        queued = q;
+                    }
+                }
+            }
+            return found;
+        }
+
+        AsyncExec::Task* pop(unsigned lane, unsigned cls)
+        {
+            AsyncExec::Task* task = queues[lane][cls]->tryDequeue();
+            if (task != nullptr) {
+                sizes[lane][cls]--;
+                depths[lane]--;
+                served[lane]++;
+            }
+            return task;
+        }
+
+        bool busyAbove(unsigned lane) const
+        {
+            for (unsigned higher = lane + 1; higher < AsyncExec::NUM_LANES; higher++) {
+                if (depths[higher] != 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
 
     public:
-        void enqueue(const T& task)
+        Lanes()
         {
-            mutex.lock();
-            que.emplace_back(task);
-            mutex.unlock();
-            event.signal();
+            for (unsigned lane = 0; lane < AsyncExec::NUM_LANES; lane++) {
+                for (unsigned cls = 0; cls < NUM_CLASSES; cls++) {
+                    queues[lane][cls].reset(new TaskQueue(&event));
+                    sizes[lane][cls] = 0;
+                }
+                depths[lane] = 0;
+                served[lane] = 0;
+                promoted[lane] = 0;
+            }
         }
 
-        bool dequeue(double timeout, T& task)
+        void enqueue(AsyncExec::Task* task, const AsyncExec::Options& options)
         {
-            bool found = false;
-            mutex.lock();
-            if (que.empty()) {
-                mutex.unlock();
-                event.wait(timeout);
-                mutex.lock();
+            unsigned lane = (options.lane < AsyncExec::NUM_LANES ? options.lane : AsyncExec::LOW);
+            // Tasks that are not periodic compete like records scanned
+            // with the default relative deadline
+            double period = (options.period > 0.0 ? options.period : g_defaultDeadline);
+            task->queued = now();
+            task->deadline = task->queued;
+            if (g_deadlines) {
+                task->deadline += static_cast<int64_t>(period * 1e9);
             }
-            if (!que.empty()) {
-                task = std::move(que.front());
-                que.pop_front();
-                found = true;
+            task->budget = static_cast<int64_t>(options.timeout * 1e9);
+            unsigned cls = periodClass(period);
+            depths[lane]++;
+            sizes[lane][cls]++;
+            queues[lane][cls]->enqueue(task);
+        }
+
+        AsyncExec::Task* tryDequeue()
+        {
+            // Starved task from a lower lane goes first when higher lanes are busy
+            int64_t starved = now() - g_starvationTime;
+            for (unsigned lane = AsyncExec::LOW; lane < AsyncExec::HIGH; lane++) {
+                if (depths[lane] == 0 || !busyAbove(lane)) {
+                    continue;
+                }
+                int64_t queued = 0;
+                int cls = front(lane, false, queued);
+                if (cls >= 0 && queued < starved) {
+                    AsyncExec::Task* task = pop(lane, cls);
+                    if (task != nullptr) {
+                        promoted[lane]++;
+                        return task;
+                    }
+                }
+            }
+
+            for (int lane = AsyncExec::HIGH; lane >= AsyncExec::LOW; lane--) {
+                if (depths[lane] == 0) {
+                    continue;
+                }
+                int64_t queued;
+                int cls = (g_deadlines ? front(lane, true, queued) : 0);
+                if (cls >= 0) {
+                    AsyncExec::Task* task = pop(lane, cls);
+                    if (task != nullptr) {
+                        return task;
+                    }
+                }
+            }
+            return nullptr;
+        }
+
+        AsyncExec::Task* dequeue(const std::atomic<bool>& running)
+        {
+            AsyncExec::Task* task = tryDequeue();
+            if (task == nullptr) {
+                uint32_t key = event.prepareWait();
+                task = tryDequeue();
+                if (task != nullptr || !running) {
+                    event.cancelWait();
+                } else {
+                    event.commitWait(key);
+                    task = tryDequeue();
+                }
+            }
+            return task;
+        }
+
+        void wakeAll()
+        {
+            event.notifyAll();
+        }
+
+        size_t depth(unsigned lane) const
+        {
+            return depths[lane];
+        }
+
+        void report(const char* name) const
+        {
+            static const char* names[] = { "LOW", "MEDIUM", "HIGH" };
+            for (int lane = AsyncExec::HIGH; lane >= AsyncExec::LOW; lane--) {
+                printf("%-16s %-6s depth %-6zu served %-10llu starved %llu\n", name, names[lane], depths[lane].load(),
+                       (unsigned long long)served[lane].load(), (unsigned long long)promoted[lane].load());
             }
-            mutex.unlock();
-            return found;
         }
 };
-static TaskQueue<AsyncExec::Callback> g_tasks;
+constexpr double Lanes::classPeriods[];
+
+/**
+ * Interrupts tasks running longer than their budget.
+ *
+ * Running tasks are kept in a hashed timer wheel, arming and disarming
+ * is O(1) regardless of how many tasks are in flight. Watchdog thread
+ * sleeps while nothing is armed, otherwise it advances the wheel every
+ * tick and interrupts Python code of expired tasks.
+ */
+class Watchdog : public epicsThreadRunable {
+    public:
+        struct Entry {
+            Entry* prev{nullptr};
+            Entry* next{nullptr};
+            int64_t expires{0};         // Tick number
+            PyWrapper::ThreadId thread;
+            uint64_t generation{0};     // Incremented when task completes
+            bool armed{false};
+            bool fired{false};
+            bool interrupting{false};
+        };
+
+    private:
+        static const unsigned NUM_SLOTS = 256;
+        static const int64_t TICK = 10000000;   // 10 ms
+
+        epicsThread thread;
+        std::atomic<bool> running{true};
+        epicsEvent wakeup;
+        std::mutex mutex;
+        Entry slots[NUM_SLOTS];     // List heads
+        size_t armed{0};
+        int64_t current{0};         // Last processed tick
+        std::atomic<uint64_t> expired{0};
+
+        void link(Entry& entry)
+        {
+            Entry& head = slots[entry.expires % NUM_SLOTS];
+            entry.prev = &head;
+            entry.next = head.next;
+            head.next->prev = &entry;
+            head.next = &entry;
+            entry.armed = true;
+            armed++;
+        }
+
+        void unlink(Entry& entry)
+        {
+            entry.prev->next = entry.next;
+            entry.next->prev = entry.prev;
+            entry.prev = entry.next = nullptr;
+            entry.armed = false;
+            armed--;
+        }
+
+    public:
+        Watchdog()
+        : thread(*this, "PyDeviceWatchdog", epicsThreadGetStackSize(epicsThreadStackSmall), epicsThreadPriorityHigh)
+        {
+            for (auto& head: slots) {
+                head.prev = head.next = &head;
+            }
+            thread.start();
+        }
+
+        ~Watchdog()
+        {
+            running = false;
+            wakeup.signal();
+            thread.exitWait();
+        }
+
+        void arm(Entry& entry, int64_t budget)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            entry.expires = (now() + budget) / TICK + 1;
+            entry.fired = false;
+            link(entry);
+            if (armed == 1) {
+                wakeup.signal();
+            }
+        }
+
+        /**
+         * @return true when entry expired and its thread may have been interrupted
+         */
+        bool disarm(Entry& entry)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (entry.armed) {
+                unlink(entry);
+            }
+            entry.generation++;
+            // Wait for interrupt in progress, it must not outlive the task
+            while (entry.interrupting) {
+                lock.unlock();
+                std::this_thread::yield();
+                lock.lock();
+            }
+            bool fired = entry.fired;
+            entry.fired = false;
+            return fired;
+        }
+
+        uint64_t numExpired() const
+        {
+            return expired;
+        }
+
+        void run() override
+        {
+            std::vector< std::pair<Entry*, uint64_t> > fired;
+            while (running) {
+                bool idle;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    idle = (armed == 0);
+                }
+                if (idle) {
+                    wakeup.wait();
+                } else {
+                    epicsThreadSleep(TICK * 1e-9);
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    int64_t tick = now() / TICK;
+                    if (armed == 0 || tick - current > NUM_SLOTS) {
+                        current = tick - (armed == 0 ? 0 : NUM_SLOTS);
+                    }
+                    for (; current < tick; ) {
+                        Entry& head = slots[++current % NUM_SLOTS];
+                        for (Entry* entry = head.next; entry != &head; ) {
+                            Entry* next = entry->next;
+                            if (entry->expires <= current) {
+                                unlink(*entry);
+                                entry->fired = true;
+                                fired.emplace_back(entry, entry->generation);
+                            }
+                            entry = next;
+                        }
+                    }
+                }
+
+                for (auto& item: fired) {
+                    Entry* entry = item.first;
+                    uint64_t generation = item.second;
+                    bool interrupted = PyWrapper::interrupt(entry->thread, [this, entry, generation]() {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        entry->interrupting = (entry->generation == generation);
+                        return entry->interrupting;
+                    });
+                    if (interrupted) {
+                        expired++;
+                    }
+                    std::lock_guard<std::mutex> lock(mutex);
+                    entry->interrupting = false;
+                }
+                fired.clear();
+            }
+        }
+};
+static std::unique_ptr<Watchdog> g_watchdog;
+
+static void startWatchdog()
+{
+    if (!g_watchdog) {
+        g_watchdog.reset(new Watchdog);
+    }
+}
 
 class WorkerThread : public epicsThreadRunable {
     public:
+        std::string name;
         epicsThread thread;
         std::atomic<bool> running{true};
+        unsigned batchSize;
+        std::chrono::duration<double> batchTime;
+        bool subInterpreter;
+        Lanes own;          // Tasks pinned to this worker
+        Lanes* tasks;
+        Watchdog::Entry watch;
+        std::atomic<uint64_t> executed{0};
+        std::atomic<uint64_t> busy{0};     // ns
 
-        WorkerThread(const std::string& id)
-        : thread(*this, id.c_str(), epicsThreadGetStackSize(epicsThreadStackMedium))
+        WorkerThread(const std::string& id, Lanes* shared, unsigned batchSize_, double batchTime_, bool subInterpreter_)
+        : name(id)
+        , thread(*this, name.c_str(), epicsThreadGetStackSize(epicsThreadStackMedium))
+        , batchSize(batchSize_)
+        , batchTime(batchTime_)
+        , subInterpreter(subInterpreter_)
+        , tasks(subInterpreter_ ? &own : shared)
         {
             thread.start();
         }
 
         ~WorkerThread()
         {
-            running = false;
+            stop();
             thread.exitWait();
         }
 
         void run() override
         {
+            if (subInterpreter && !PyWrapper::createInterpreter()) {
+                printf("PyDevice: failed to create sub-interpreter in %s, using main interpreter\n", thread.getNameSelf());
+            }
+            watch.thread = PyWrapper::currentThread();
+
             while (running) {
-                AsyncExec::Callback cb;
-                if (g_tasks.dequeue(1.0, cb)) {
-                    cb();
+                AsyncExec::Task* task = tasks->dequeue(running);
+                if (task != nullptr) {
+                    // Compile, eval and destroy share single GIL session,
+                    // keep it for more ready tasks when batching enabled
+                    int64_t waiting = now();
+                    PyWrapper::Session session;
+                    auto start = std::chrono::steady_clock::now();
+                    execute(task, now() - waiting);
+
+                    for (unsigned n = 1; n < batchSize && running; n++) {
+                        if ((std::chrono::steady_clock::now() - start) >= batchTime) {
+                            break;
+                        }
+                        task = tasks->tryDequeue();
+                        if (task == nullptr) {
+                            break;
+                        }
+                        execute(task, 0);
+                    }
+                    busy.fetch_add(now() - waiting, std::memory_order_relaxed);
+                }
+            }
+
+            PyWrapper::destroyInterpreter();
+        }
+
+        void execute(AsyncExec::Task* task, int64_t gilWait)
+        {
+            // Task can be scheduled again by other threads as soon as it runs
+            int64_t budget = task->budget;
+            int64_t start = now();
+            task->started = start;
+            task->gilWait = gilWait;
+            if (budget > 0 && g_watchdog) {
+                g_watchdog->arm(watch, budget);
+                task->run();
+                if (g_watchdog->disarm(watch)) {
+                    // Exception not raised by now would hit the next task
+                    PyWrapper::clearInterrupt();
                 }
+            } else {
+                task->run();
             }
+            updateCost(*task, now() - start);
+            executed.fetch_add(1, std::memory_order_relaxed);
         }
 
         void stop()
         {
             running = false;
+            // Shared queue wakes all workers, any of them may be parked there
+            tasks->wakeAll();
         }
 };
-static std::vector< std::unique_ptr<WorkerThread> > g_workers;
 
-void AsyncExec::init(unsigned numThreads)
+/**
+ * Independent set of workers with their own queue.
+ */
+struct AsyncExec::Pool {
+    std::string name;
+    Lanes tasks;
+    std::vector< std::unique_ptr<WorkerThread> > workers;
+};
+
+static std::vector< std::unique_ptr<AsyncExec::Pool> > g_pools;
+static AsyncExec::Pool* g_default = nullptr;
+static bool g_subInterpreters = false;
+static unsigned g_batchSize = 1;
+static double g_batchTime = 0.001;
+static double g_timeout = 0.0;
+
+static AsyncExec::Pool* createPool(const std::string& name, const std::string& prefix, unsigned numThreads)
 {
+    std::unique_ptr<AsyncExec::Pool> pool(new AsyncExec::Pool);
+    pool->name = name;
     while (numThreads--) {
-        std::string id = "PyDeviceExec_" + std::to_string(numThreads);
-        WorkerThread* worker = new WorkerThread(id);
+        std::string id = prefix + std::to_string(numThreads);
+        WorkerThread* worker = new WorkerThread(id, &pool->tasks, g_batchSize, g_batchTime, g_subInterpreters);
         if (worker) {
-            g_workers.push_back(std::unique_ptr<WorkerThread>(worker));
+            pool->workers.push_back(std::unique_ptr<WorkerThread>(worker));
         }
     }
+    if (pool->workers.empty()) {
+        return nullptr;
+    }
+    g_pools.push_back(std::move(pool));
+    return g_pools.back().get();
+}
 
-    if (g_workers.empty()) {
+static AsyncExec::Pool* findPool(const std::string& name)
+{
+    for (auto& pool: g_pools) {
+        if (pool->name == name) {
+            return pool.get();
+        }
+    }
+    return nullptr;
+}
+
+void AsyncExec::init(unsigned numThreads, unsigned batchSize, double batchTime, bool subInterpreters, bool deadlines, double starvationTime, double timeout, double inlineTime, double defaultDeadline)
+{
+    g_defaultDeadline = (defaultDeadline > 0.0 ? defaultDeadline : 1.0);
+    g_inlineTime = static_cast<int64_t>(inlineTime * 1e9);
+    g_subInterpreters = subInterpreters;
+    g_deadlines = deadlines;
+    g_starvationTime = static_cast<int64_t>(starvationTime * 1e9);
+    g_batchSize = batchSize;
+    g_batchTime = batchTime;
+    g_timeout = timeout;
+    if (g_timeout > 0.0) {
+        startWatchdog();
+    }
+
+    g_default = ::createPool("default", "PyDeviceExec_", numThreads);
+    if (g_default == nullptr) {
         printf("Failed to initialize PyDevice worker threads!");
     }
 }
 
+bool AsyncExec::createPool(const std::string& name, unsigned numThreads)
+{
+    if (name.empty() || numThreads == 0) {
+        printf("PyDevice: pool needs a name and at least one thread\n");
+        return false;
+    }
+    if (findPool(name) != nullptr) {
+        printf("PyDevice: pool '%s' already exists\n", name.c_str());
+        return false;
+    }
+    if (::createPool(name, "PyDevice_" + name + "_", numThreads) == nullptr) {
+        printf("PyDevice: failed to start worker threads for pool '%s'\n", name.c_str());
+        return false;
+    }
+    return true;
+}
+
 void AsyncExec::shutdown()
 {
     // Let all threads know we're going down, so that they can start
     // wrapping up in parallel and not start any new tasks.
-    for (auto& worker: g_workers) {
-        worker->stop();
+    for (auto& pool: g_pools) {
+        for (auto& worker: pool->workers) {
+            worker->stop();
+        }
     }
-    // This is a blocking call that waits for all threads to exit
-    g_workers.clear();
+    // This is a blocking call that waits for all threads to exit,
+    // watchdog keeps running to interrupt the ones that are stuck
+    g_default = nullptr;
+    g_pools.clear();
+    g_watchdog.reset();
 }
 
-bool AsyncExec::schedule(const AsyncExec::Callback& callback)
+bool AsyncExec::schedule(AsyncExec::Task& task, const AsyncExec::Options& options)
 {
-    if (g_workers.empty() || !callback)
+    Pool* pool = (options.pool ? options.pool : g_default);
+    if (pool == nullptr || task.func == nullptr)
         return false;
-    g_tasks.enqueue(callback);
+    if (options.worker >= 0) {
+        pool->workers[options.worker % pool->workers.size()]->tasks->enqueue(&task, options);
+    } else {
+        pool->tasks.enqueue(&task, options);
+    }
     return true;
 }
+
+bool AsyncExec::runInline(AsyncExec::Task& task, const AsyncExec::Options& options)
+{
+    if (options.inlining == INLINE_NEVER || options.worker >= 0 || options.timeout > 0.0) {
+        return false;
+    }
+    if (options.inlining == INLINE_AUTO && task.cost.load(std::memory_order_relaxed) > g_inlineTime) {
+        return false;
+    }
+
+    int64_t waiting = now();
+    PyWrapper::Session session(false);
+    if (!session) {
+        g_inlineBusy++;
+        return false;
+    }
+    int64_t start = now();
+    task.queued = waiting;
+    task.started = start;
+    task.gilWait = start - waiting;
+    task.run();
+    updateCost(task, now() - start);
+    g_inlineRuns++;
+    return true;
+}
+
+static std::string getInfo(const char* recName, const char* name)
+{
+    std::string value;
+    DBENTRY entry;
+    dbInitEntry(pdbbase, &entry);
+    if (dbFindRecord(&entry, recName) == 0 && dbFindInfo(&entry, name) == 0) {
+        value = dbGetInfoString(&entry);
+    }
+    dbFinishEntry(&entry);
+    return value;
+}
+
+AsyncExec::Options AsyncExec::options(dbCommon* rec)
+{
+    Options options;
+    options.lane = rec->prio;
+#ifdef HAVE_SCAN_PERIOD
+    options.period = scanPeriod(rec->scan);
+#endif
+    options.timeout = g_timeout;
+    std::string timeout = getInfo(rec->name, "pydev:timeout");
+    if (!timeout.empty()) {
+        options.timeout = strtod(timeout.c_str(), nullptr);
+    }
+    if (options.timeout > 0.0) {
+        startWatchdog();
+    }
+
+    std::string inlining = getInfo(rec->name, "pydev:inline");
+    if (inlining == "yes" || inlining == "1") {
+        options.inlining = INLINE_ALWAYS;
+    } else if (inlining == "auto") {
+        options.inlining = INLINE_AUTO;
+    } else if (!inlining.empty() && inlining != "no" && inlining != "0") {
+        printf("[%s] Invalid PyDevice inline mode '%s', expecting yes, no or auto\n", rec->name, inlining.c_str());
+    }
+
+    std::string name = getInfo(rec->name, "pydev:pool");
+    if (!name.empty()) {
+        options.pool = findPool(name);
+        if (options.pool == nullptr) {
+            printf("[%s] PyDevice pool '%s' not found, using default pool\n", rec->name, name.c_str());
+        }
+    }
+    Pool* pool = (options.pool ? options.pool : g_default);
+
+    if (g_subInterpreters && pool != nullptr) {
+        std::string interp = getInfo(rec->name, "pydev:interp");
+        if (!interp.empty()) {
+            options.worker = strtoul(interp.c_str(), nullptr, 10) % pool->workers.size();
+        } else {
+            options.worker = std::hash<std::string>()(rec->name) % pool->workers.size();
+        }
+    }
+    return options;
+}
+
+// Task and completion event for each worker, only used by broadcast()
+struct Broadcast {
+    AsyncExec::Task task;
+    const AsyncExec::Callback* callback;
+    epicsEvent done;
+
+    static void run(Broadcast* self)
+    {
+        (*self->callback)();
+        self->done.signal();
+    }
+};
+
+unsigned AsyncExec::broadcast(const AsyncExec::Callback& callback)
+{
+    if (!g_subInterpreters) {
+        return 0;
+    }
+
+    std::vector< std::unique_ptr<Broadcast> > tasks;
+    for (auto& pool: g_pools) {
+        for (auto& worker: pool->workers) {
+            tasks.emplace_back(new Broadcast);
+            Broadcast* bc = tasks.back().get();
+            bc->callback = &callback;
+            bc->task.bind<Broadcast, Broadcast::run>(bc);
+            AsyncExec::Options options;
+            options.lane = AsyncExec::HIGH;
+            worker->own.enqueue(&bc->task, options);
+        }
+    }
+    for (auto& bc: tasks) {
+        bc->done.wait();
+    }
+    return tasks.size();
+}
+
+size_t AsyncExec::depth(AsyncExec::Lane lane)
+{
+    size_t n = 0;
+    for (auto& pool: g_pools) {
+        n += pool->tasks.depth(lane);
+        for (auto& worker: pool->workers) {
+            n += worker->own.depth(lane);
+        }
+    }
+    return n;
+}
+
+std::vector<AsyncExec::PoolStats> AsyncExec::stats()
+{
+    std::vector<PoolStats> all;
+    for (auto& pool: g_pools) {
+        PoolStats stats;
+        stats.name = pool->name;
+        stats.workers = pool->workers.size();
+        stats.depth = 0;
+        stats.executed = 0;
+        stats.busyNs = 0;
+        for (unsigned lane = 0; lane < NUM_LANES; lane++) {
+            stats.depth += pool->tasks.depth(lane);
+            for (auto& worker: pool->workers) {
+                stats.depth += worker->own.depth(lane);
+            }
+        }
+        for (auto& worker: pool->workers) {
+            stats.executed += worker->executed.load(std::memory_order_relaxed);
+            stats.busyNs += worker->busy.load(std::memory_order_relaxed);
+        }
+        all.push_back(stats);
+    }
+    return all;
+}
+
+void AsyncExec::report()
+{
+    printf("Deadline ordering %s, default deadline %.3f s, starvation time %.3f s\n", (g_deadlines ? "enabled" : "disabled"),
+           g_defaultDeadline, g_starvationTime * 1e-9);
+    if (g_watchdog) {
+        printf("Default timeout %.3f s, %llu tasks interrupted\n", g_timeout, (unsigned long long)g_watchdog->numExpired());
+    }
+    printf("Inline time limit %.0f us, %llu tasks run inline, %llu queued due to busy GIL\n", g_inlineTime * 1e-3,
+           (unsigned long long)g_inlineRuns.load(), (unsigned long long)g_inlineBusy.load());
+    for (auto& pool: g_pools) {
+        printf("Pool '%s', %zu workers\n", pool->name.c_str(), pool->workers.size());
+        if (!g_subInterpreters) {
+            pool->tasks.report(pool->name.c_str());
+        } else {
+            for (auto& worker: pool->workers) {
+                worker->own.report(worker->name.c_str());
+            }
+        }
+    }
+}
@@ -6,14 +6,181 @@
 #ifndef ASYNCEXEC_H
 #define ASYNCEXEC_H
 
+#include "taskqueue.h"
+
+#include <cstddef>
 #include <functional>
+#include <string>
+#include <vector>
+
+struct dbCommon;
 
 class AsyncExec {
     public:
         using Callback = std::function<void()>;
-        static void init(unsigned numThreads);
+        using Task = TaskNode;
+
+        struct Pool;
+
+        /**
+         * @brief Per-record scheduling options, resolved once at record init.
+         */
+        struct Options {
+            Pool* pool;         // Worker pool, nullptr for default pool
+            int worker;         // Worker owning record's interpreter, -1 for any
+            unsigned lane;      // Record's PRIO, one of Lane values
+            double period;      // SCAN period in seconds, 0 when not periodic
+            double timeout;     // Max execution time in seconds, 0 for unlimited
+            unsigned inlining;  // When to run in processing thread, one of Inline values
+
+            Options() : pool(nullptr), worker(-1), lane(LOW), period(0.0), timeout(0.0), inlining(INLINE_NEVER) {}
+        };
+
+        /**
+         * @brief Snapshot of pool counters, see stats().
+         */
+        struct PoolStats {
+            std::string name;
+            unsigned workers;   // Number of worker threads
+            size_t depth;       // Tasks currently waiting in all lanes
+            uint64_t executed;  // Tasks run by workers since start
+            uint64_t busyNs;    // Time workers spent waiting for GIL and running tasks
+        };
+
+        /**
+         * @brief Queue lanes, same values as EPICS menuPriority.
+         */
+        enum Lane {
+            LOW = 0,
+            MEDIUM = 1,
+            HIGH = 2,
+            NUM_LANES = 3,
+        };
+
+        /**
+         * @brief When to run task in the processing thread, see runInline().
+         */
+        enum Inline {
+            INLINE_NEVER = 0,   // Always queue to workers
+            INLINE_ALWAYS = 1,  // Whenever GIL is available
+            INLINE_AUTO = 2,    // When GIL is available and task is cheap
+        };
+
+        /**
+         * @brief Start worker threads.
+         *
+         * Each worker holds the GIL while running up to batchSize queued
+         * tasks back-to-back, or until batchTime expires, whichever comes
+         * first. This trades fairness for fewer GIL hand-overs when many
+         * short tasks are queued at once.
+         *
+         * Tasks from the HIGH lane run before MEDIUM and LOW ones. Task
+         * waiting in a lower lane for longer than starvationTime is run
+         * ahead of higher lanes. With deadlines enabled, tasks within a
+         * lane run approximately in order of deadline, which is the time
+         * they were queued plus their SCAN period, or plus defaultDeadline
+         * for tasks that are not periodic. Tasks are grouped in classes by
+         * period, the class with the earliest deadline at its front runs
+         * first and tasks within a class run in FIFO order. Standard SCAN
+         * periods have a class each, so their order is exact.
+         *
+         * Task running longer than its timeout is interrupted by raising
+         * TimeoutError in its Python code, see PyWrapper::interrupt().
+         *
+         * @param numThreads Number of worker threads
+         * @param batchSize Max number of tasks run in one GIL session
+         * @param batchTime Max time in seconds for one GIL session
+         * @param subInterpreters Each worker creates its own Python sub-interpreter
+         * @param deadlines Order tasks within a lane by deadline
+         * @param starvationTime Max time in seconds a task waits behind higher lanes
+         * @param timeout Default max execution time of a task in seconds, 0 for unlimited
+         * @param inlineTime Max average execution time in seconds of INLINE_AUTO tasks run inline
+         * @param defaultDeadline Relative deadline in seconds of tasks that are not periodic
+         */
+        static void init(unsigned numThreads, unsigned batchSize = 1, double batchTime = 0.001, bool subInterpreters = false,
+                         bool deadlines = false, double starvationTime = 0.1, double timeout = 0.0, double inlineTime = 50e-6,
+                         double defaultDeadline = 1.0);
         static void shutdown();
-        static bool schedule(const Callback& callback);
+
+        /**
+         * @brief Start named pool of worker threads with its own queue.
+         *
+         * Records select the pool with info(pydev:pool, "name") tag, so
+         * the pool must be created before iocInit. Pool uses the same
+         * batching and sub-interpreter settings as the default pool.
+         *
+         * @param name Unique pool name
+         * @param numThreads Number of worker threads in pool
+         * @return false when pool already exists or threads couldn't be started
+         */
+        static bool createPool(const std::string& name, unsigned numThreads);
+
+        /**
+         * @brief Queue task to be run by one of the workers.
+         *
+         * Task is linked into the queue as is, nothing is allocated. It must
+         * remain valid and not be scheduled again until it has run.
+         *
+         * @param task Intrusive task node, usually embedded in record's context
+         * @param options Record's scheduling options
+         * @return false when workers are not running
+         */
+        static bool schedule(Task& task, const Options& options = Options());
+
+        /**
+         * @brief Run task in calling thread instead of queueing it.
+         *
+         * Saves the hand-over to a worker thread and back for tasks that
+         * take less time than the hand-over itself. Task only runs when
+         * options allow it and the GIL can be taken without waiting for
+         * workers. Records pinned to a sub-interpreter or with a timeout
+         * are never run inline. INLINE_AUTO tasks only run inline while
+         * their average execution time is below the inline time limit.
+         *
+         * @param task Task to run, must be schedule()-d instead when false is returned
+         * @param options Record's scheduling options
+         * @return true when task ran in calling thread
+         */
+        static bool runInline(Task& task, const Options& options);
+
+        /**
+         * @brief Determine scheduling options for a record.
+         *
+         * Pool is selected by info(pydev:pool, "name") tag, lane by
+         * record's PRIO and period by its SCAN field. Default timeout
+         * can be overridden by info(pydev:timeout, "seconds") tag.
+         * Inline execution is selected by info(pydev:inline, "yes|no|auto")
+         * tag. With sub-interpreters,
+         * record is pinned to the pool worker selected by
+         * info(pydev:interp, "N") tag, or by hash of record name.
+         */
+        static Options options(dbCommon* rec);
+
+        /**
+         * @brief Run callback in every worker owning a sub-interpreter.
+         *
+         * Blocks until all workers have completed the callback.
+         *
+         * @return Number of workers that ran the callback
+         */
+        static unsigned broadcast(const Callback& callback);
+
+        /**
+         * @brief Number of tasks currently waiting in a lane, all pools combined.
+         */
+        static size_t depth(Lane lane);
+
+        /**
+         * @brief Get counters of every pool, default pool first.
+         *
+         * Counters are read from atomics, nothing is locked.
+         */
+        static std::vector<PoolStats> stats();
+
+        /**
+         * @brief Print queue depths and scheduling counters.
+         */
+        static void report();
 };
 
 #endif // ASYNCEXEC_H
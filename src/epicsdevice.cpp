@@ -8,9 +8,14 @@
 #include <iocsh.h>
 
 #include "asyncexec.h"
+#include "profiler.h"
 #include "pywrapper.h"
+#include "ringchannel.h"
+#include "stats.h"
 #include "util.h"
 
+#include <string>
+
 extern "C"
 {
 
@@ -32,8 +37,140 @@ static void pydevCall(const iocshArgBuf * args)
     pydev(args[0].sval);
 }
 
+/**
+ * Execute Python code in main interpreter and in all sub-interpreters.
+ */
+epicsShareFunc int pydevAll(const char *line)
+{
+    pydev(line);
+    std::string code = (line ? line : "");
+    AsyncExec::broadcast([code]() {
+        pydev(code.c_str());
+    });
+    return 0;
+}
+
+static const iocshFuncDef pydevAllDef = { "pydevAll", 1, pydevArgs };
+static void pydevAllCall(const iocshArgBuf * args)
+{
+    pydevAll(args[0].sval);
+}
+
+/**
+ * Create named pool of worker threads, records select it with
+ * info(pydev:pool, "name") tag.
+ */
+epicsShareFunc int pydevPoolCreate(const char *name, int numThreads)
+{
+    if (name == nullptr || numThreads < 1) {
+        printf("Usage: pydevPoolCreate <name> <number of threads>\n");
+        return -1;
+    }
+    return (AsyncExec::createPool(name, numThreads) ? 0 : -1);
+}
+
+static const iocshArg pydevPoolCreateArg0 = { "name", iocshArgString };
+static const iocshArg pydevPoolCreateArg1 = { "numThreads", iocshArgInt };
+static const iocshArg *const pydevPoolCreateArgs[] = { &pydevPoolCreateArg0, &pydevPoolCreateArg1 };
+static const iocshFuncDef pydevPoolCreateDef = { "pydevPoolCreate", 2, pydevPoolCreateArgs };
+static void pydevPoolCreateCall(const iocshArgBuf * args)
+{
+    pydevPoolCreate(args[0].sval, args[1].ival);
+}
+
+static const iocshFuncDef pydevQueuesDef = { "pydevQueues", 0, nullptr };
+static void pydevQueuesCall(const iocshArgBuf*)
+{
+    AsyncExec::report();
+}
+
+epicsShareFunc int pydevStats(int topN, const char *stage)
+{
+    auto sortBy = RecordStats::TOTAL;
+    if (stage != nullptr && stage[0] != 0) {
+        sortBy = RecordStats::findStage(stage);
+        if (sortBy == RecordStats::NUM_STAGES) {
+            printf("Unknown stage '%s', use one of:", stage);
+            for (unsigned s = 0; s < RecordStats::NUM_STAGES; s++) {
+                printf(" %s", RecordStats::stageName(static_cast<RecordStats::Stage>(s)));
+            }
+            printf("\n");
+            return -1;
+        }
+    }
+    RecordStats::print((topN > 0 ? topN : 10), sortBy);
+    return 0;
+}
+
+static const iocshArg pydevStatsArg0 = { "topN", iocshArgInt };
+static const iocshArg pydevStatsArg1 = { "stage", iocshArgString };
+static const iocshArg *const pydevStatsArgs[] = { &pydevStatsArg0, &pydevStatsArg1 };
+static const iocshFuncDef pydevStatsDef = { "pydevStats", 2, pydevStatsArgs };
+static void pydevStatsCall(const iocshArgBuf * args)
+{
+    pydevStats(args[0].ival, args[1].sval);
+}
+
+static const iocshFuncDef pydevStatsResetDef = { "pydevStatsReset", 0, nullptr };
+static void pydevStatsResetCall(const iocshArgBuf*)
+{
+    RecordStats::reset();
+}
+
+epicsShareFunc int pydevProfile(const char *command, const char *file)
+{
+    std::string cmd = (command ? command : "");
+    if (cmd == "start") {
+        Profiler::start();
+        return 0;
+    } else if (cmd == "stop") {
+        Profiler::stop();
+        return 0;
+    } else if (cmd == "dump" && file != nullptr && file[0] != 0) {
+        return (Profiler::dump(file) ? 0 : -1);
+    }
+    printf("Usage: pydevProfile start|stop|dump <file>\n");
+    return -1;
+}
+
+static const iocshArg pydevProfileArg0 = { "start|stop|dump", iocshArgString };
+static const iocshArg pydevProfileArg1 = { "file", iocshArgString };
+static const iocshArg *const pydevProfileArgs[] = { &pydevProfileArg0, &pydevProfileArg1 };
+static const iocshFuncDef pydevProfileDef = { "pydevProfile", 2, pydevProfileArgs };
+static void pydevProfileCall(const iocshArgBuf * args)
+{
+    pydevProfile(args[0].sval, args[1].sval);
+}
+
+/**
+ * Create or attach shared memory ring through which external processes
+ * push I/O Intr values, without arguments print state of all rings.
+ */
+epicsShareFunc int pydevRing(const char *name, int sizeKB, int pollUs)
+{
+    if (name == nullptr || name[0] == 0) {
+        RingChannel::report();
+        return 0;
+    }
+    size_t size = (sizeKB > 0 ? sizeKB : 1024) * 1024UL;
+    double poll = (pollUs > 0 ? pollUs : 100) * 1e-6;
+    return (RingChannel::open(name, size, poll) ? 0 : -1);
+}
+
+static const iocshArg pydevRingArg0 = { "name", iocshArgString };
+static const iocshArg pydevRingArg1 = { "sizeKB", iocshArgInt };
+static const iocshArg pydevRingArg2 = { "pollUs", iocshArgInt };
+static const iocshArg *const pydevRingArgs[] = { &pydevRingArg0, &pydevRingArg1, &pydevRingArg2 };
+static const iocshFuncDef pydevRingDef = { "pydevRing", 3, pydevRingArgs };
+static void pydevRingCall(const iocshArgBuf * args)
+{
+    pydevRing(args[0].sval, args[1].ival, args[2].ival);
+}
+
 static void pydevUnregister(void*)
 {
+    // Drain threads notify records, stop them before the workers
+    RingChannel::shutdown();
     AsyncExec::shutdown();
     PyWrapper::shutdown();
 }
@@ -47,9 +184,26 @@ static void pydevRegister(void)
         if (numThreads < 1)
             numThreads = 3;
 
+        auto batchSize = Util::getEnvConfig("PYDEV_GIL_BATCH", 1);
+        auto batchTime = Util::getEnvConfig("PYDEV_GIL_BATCH_US", 1000);
+        auto subInterpreters = Util::getEnvConfig("PYDEV_SUBINTERPRETERS", 0);
+        auto deadlines = Util::getEnvConfig("PYDEV_DEADLINES", 0);
+        auto defaultDeadline = Util::getEnvConfig("PYDEV_DEADLINE_MS", 1000);
+        auto starvationTime = Util::getEnvConfig("PYDEV_STARVATION_MS", 100);
+        auto timeout = Util::getEnvConfig("PYDEV_TIMEOUT_MS", 0);
+        auto inlineTime = Util::getEnvConfig("PYDEV_INLINE_US", 50);
+
         PyWrapper::init();
-        AsyncExec::init(numThreads);
+        AsyncExec::init(numThreads, batchSize, batchTime * 1e-6, (subInterpreters > 0), (deadlines > 0), starvationTime * 1e-3, timeout * 1e-3, inlineTime * 1e-6,
+                        defaultDeadline * 1e-3);
         iocshRegister(&pydevDef, pydevCall);
+        iocshRegister(&pydevAllDef, pydevAllCall);
+        iocshRegister(&pydevPoolCreateDef, pydevPoolCreateCall);
+        iocshRegister(&pydevQueuesDef, pydevQueuesCall);
+        iocshRegister(&pydevStatsDef, pydevStatsCall);
+        iocshRegister(&pydevStatsResetDef, pydevStatsResetCall);
+        iocshRegister(&pydevProfileDef, pydevProfileCall);
+        iocshRegister(&pydevRingDef, pydevRingCall);
         epicsAtExit(pydevUnregister, 0);
     }
 }
@@ -0,0 +1,149 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#include "fieldbinding.h"
+#include "util.h"
+
+#include <dbAccess.h>
+#include <epicsVersion.h>
+
+#include <cstring>
+
+#ifdef VERSION_INT
+#  if EPICS_VERSION_INT >= VERSION_INT(3,16,0,2)
+#    define HAVE_EPICS_INT64
+#  endif
+#endif
+
+template <typename T>
+static Variant toArray(const void* pfield, size_t count)
+{
+    // Python gets read-only view of the record's memory, no copying
+    return Variant::view(reinterpret_cast<const T*>(pfield), count);
+}
+
+static Variant toVariant(const FieldBinding::Field& field)
+{
+    if (field.count != nullptr) {
+        size_t count = *field.count;
+        if      (field.type == DBF_CHAR)   return toArray<epicsInt8>   (field.pfield, count);
+        else if (field.type == DBF_UCHAR)  return toArray<epicsUInt8>  (field.pfield, count);
+        else if (field.type == DBF_SHORT)  return toArray<epicsInt16>  (field.pfield, count);
+        else if (field.type == DBF_USHORT) return toArray<epicsUInt16> (field.pfield, count);
+        else if (field.type == DBF_LONG)   return toArray<epicsInt32>  (field.pfield, count);
+        else if (field.type == DBF_ULONG)  return toArray<epicsUInt32> (field.pfield, count);
+#ifdef HAVE_EPICS_INT64
+        else if (field.type == DBF_INT64)  return toArray<epicsInt64>  (field.pfield, count);
+        else if (field.type == DBF_UINT64) return toArray<epicsUInt64> (field.pfield, count);
+#endif
+        else if (field.type == DBF_FLOAT)  return toArray<epicsFloat32>(field.pfield, count);
+        else if (field.type == DBF_DOUBLE) return toArray<epicsFloat64>(field.pfield, count);
+        else if (field.type == DBF_STRING) {
+            std::vector<std::string> vals;
+            const char* ptr = reinterpret_cast<const char*>(field.pfield);
+            for (size_t i = 0; i < count; i++, ptr += field.size) {
+                vals.emplace_back(ptr, strnlen(ptr, field.size));
+            }
+            return Variant(std::move(vals));
+        }
+        return Variant();
+    }
+
+    if      (field.type == DBF_CHAR)   return Variant(*reinterpret_cast<const epicsInt8*>   (field.pfield));
+    else if (field.type == DBF_UCHAR)  return Variant(*reinterpret_cast<const epicsUInt8*>  (field.pfield));
+    else if (field.type == DBF_SHORT)  return Variant(*reinterpret_cast<const epicsInt16*>  (field.pfield));
+    else if (field.type == DBF_USHORT) return Variant(*reinterpret_cast<const epicsUInt16*> (field.pfield));
+    else if (field.type == DBF_LONG)   return Variant(*reinterpret_cast<const epicsInt32*>  (field.pfield));
+    else if (field.type == DBF_ULONG)  return Variant(*reinterpret_cast<const epicsUInt32*> (field.pfield));
+#ifdef HAVE_EPICS_INT64
+    else if (field.type == DBF_INT64)  return Variant(*reinterpret_cast<const epicsInt64*>  (field.pfield));
+    else if (field.type == DBF_UINT64) return Variant(*reinterpret_cast<const epicsUInt64*> (field.pfield));
+#endif
+    else if (field.type == DBF_FLOAT)  return Variant(*reinterpret_cast<const epicsFloat32*>(field.pfield));
+    else if (field.type == DBF_DOUBLE) return Variant(*reinterpret_cast<const epicsFloat64*>(field.pfield));
+    else if (field.type == DBF_ENUM || field.type == DBF_MENU || field.type == DBF_DEVICE) {
+        return Variant(*reinterpret_cast<const epicsEnum16*>(field.pfield));
+    } else if (field.type == DBF_STRING) {
+        const char* ptr = reinterpret_cast<const char*>(field.pfield);
+        return Variant(std::string(ptr, strnlen(ptr, field.size)));
+    }
+    return Variant();
+}
+
+bool FieldBinding::elementType(short dbfType, Variant::ElementType& type)
+{
+    if      (dbfType == DBF_CHAR)   type = Variant::ElementType::INT8;
+    else if (dbfType == DBF_UCHAR)  type = Variant::ElementType::UINT8;
+    else if (dbfType == DBF_SHORT)  type = Variant::ElementType::INT16;
+    else if (dbfType == DBF_USHORT) type = Variant::ElementType::UINT16;
+    else if (dbfType == DBF_LONG)   type = Variant::ElementType::INT32;
+    else if (dbfType == DBF_ULONG)  type = Variant::ElementType::UINT32;
+#ifdef HAVE_EPICS_INT64
+    else if (dbfType == DBF_INT64)  type = Variant::ElementType::INT64;
+    else if (dbfType == DBF_UINT64) type = Variant::ElementType::UINT64;
+#endif
+    else if (dbfType == DBF_FLOAT)  type = Variant::ElementType::FLOAT;
+    else if (dbfType == DBF_DOUBLE) type = Variant::ElementType::DOUBLE;
+    else return false;
+    return true;
+}
+
+void FieldBinding::init(dbCommon* record, const std::vector<std::string>& fieldNames, const std::map<std::string, const epicsUInt32*>& arrayFields)
+{
+    rec = record;
+    supported = fieldNames;
+    arrays = arrayFields;
+    planned = false;
+    link.clear();
+    code.clear();
+    fields.clear();
+    args.clear();
+    params.clear();
+}
+
+bool FieldBinding::update(const char* text)
+{
+    if (planned && link == text) {
+        return false;
+    }
+
+    std::vector<std::string> bound;
+    planned = true;
+    link = text;
+    code = Util::bindMacros(link, supported, bound);
+    fields.clear();
+    args.clear();
+
+    for (auto& name: bound) {
+        DBADDR addr;
+        std::string pvname = std::string(rec->name) + "." + name;
+        if (dbNameToAddr(pvname.c_str(), &addr) != 0) {
+            continue;
+        }
+
+        Field field;
+        field.name   = name;
+        field.pfield = addr.pfield;
+        field.type   = addr.field_type;
+        field.size   = addr.field_size;
+        auto it = arrays.find(name);
+        field.count  = (it != arrays.end() ? it->second : nullptr);
+        field.arg    = &args["pydev" + name];
+        fields.push_back(field);
+    }
+
+    params.clear();
+    for (auto& arg: args) {
+        params.push_back(arg.first);
+    }
+    return true;
+}
+
+void FieldBinding::collect()
+{
+    for (auto& field: fields) {
+        *field.arg = toVariant(field);
+    }
+}
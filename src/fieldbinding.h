@@ -0,0 +1,85 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#ifndef FIELDBINDING_H
+#define FIELDBINDING_H
+
+#include "variant.h"
+
+#include <epicsTypes.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+struct dbCommon;
+
+/**
+ * @brief Pre-computed plan for passing record fields to Python code.
+ *
+ * Record link text is analyzed only once for field macros. Macros are
+ * replaced with Python variable names and referenced fields are resolved
+ * to their memory location and type. When record processes, only the
+ * field values need to be collected. The plan is rebuilt automatically
+ * when the link text changes.
+ */
+struct FieldBinding {
+    struct Field {
+        std::string name;           // Record field name, ie. VAL
+        void* pfield;               // Field memory location
+        short type;                 // DBF_* type of field or array element
+        size_t size;                // Size of single element
+        const epicsUInt32* count;   // Number of array elements, nullptr for scalars
+        Variant* arg;               // Slot in args for this field
+    };
+
+    dbCommon* rec{nullptr};
+    std::vector<std::string> supported;
+    std::map<std::string, const epicsUInt32*> arrays;
+
+    bool planned{false};
+    std::string link;               // Link text the plan was built for
+    std::string code;               // Python code with macros replaced
+    std::vector<Field> fields;
+    std::map<std::string, Variant> args;
+    std::vector<std::string> params;  // Names of args in their iteration order
+
+    FieldBinding() = default;
+    FieldBinding(const FieldBinding&) = delete;
+    FieldBinding& operator=(const FieldBinding&) = delete;
+
+    /**
+     * @brief Associate binding with a record and select supported fields.
+     *
+     * @param rec Record whose fields will be passed to Python
+     * @param supported List of field names that can be used as macros
+     * @param arrays Fields that are arrays, with pointer to number of elements
+     */
+    void init(dbCommon* rec, const std::vector<std::string>& supported, const std::map<std::string, const epicsUInt32*>& arrays = {});
+
+    /**
+     * @brief Rebuild the plan if the link text has changed.
+     *
+     * @param link Current record link text
+     * @return true when the plan was rebuilt and code needs to be recompiled
+     */
+    bool update(const char* link);
+
+    /**
+     * @brief Refresh args with current values of bound record fields.
+     */
+    void collect();
+
+    /**
+     * @brief Determine native array element type for DBF_* or menuFtype type.
+     *
+     * @param dbfType Field type, ie. waveform's FTVL
+     * @param type Element type, only set when numeric type
+     * @return true when field type is numeric
+     */
+    static bool elementType(short dbfType, Variant::ElementType& type);
+};
+
+#endif // FIELDBINDING_H
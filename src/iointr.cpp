@@ -0,0 +1,82 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#include "iointr.h"
+#include "pywrapper.h"
+
+#include <epicsVersion.h>
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+static std::mutex mutex;
+static std::unordered_map<std::string, IOSCANPVT> scanLists;
+static std::unordered_map<std::string, std::unique_ptr<IoIntr::Slot>> slots;
+
+static void scanCallback(IOSCANPVT scan)
+{
+#ifdef VERSION_INT
+#  if EPICS_VERSION_INT < VERSION_INT(3,16,0,0)
+    scanIoRequest(scan);
+#  else
+    scanIoImmediate(scan, priorityHigh);
+    scanIoImmediate(scan, priorityMedium);
+    scanIoImmediate(scan, priorityLow);
+#  endif
+#else
+    scanIoRequest(scan);
+#endif
+}
+
+bool IoIntr::parse(const std::string& addr, std::string& param)
+{
+    // This could be better checked with regex
+    if (addr.size() > 16 && addr.find("pydev.iointr('") == 0 && addr.substr(addr.size()-2) == "')") {
+        param = addr.substr(14, addr.size()-16);
+        return true;
+    }
+    return false;
+}
+
+IOSCANPVT IoIntr::scanList(const std::string& param)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = scanLists.find(param);
+    if (it == scanLists.end()) {
+        IOSCANPVT scan;
+        scanIoInit(&scan);
+        PyWrapper::registerIoIntr(param, std::bind(scanCallback, scan));
+        it = scanLists.emplace(param, scan).first;
+    }
+    return it->second;
+}
+
+IoIntr::Slot* IoIntr::slot(const std::string& param)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = slots.find(param);
+    if (it == slots.end()) {
+        Slot* slot = new Slot;
+        PyWrapper::registerIoIntrValue(param, [slot](const PyWrapper::IoIntrValue& value) { slot->set(value); });
+        it = slots.emplace(param, std::unique_ptr<Slot>(slot)).first;
+    }
+    return it->second.get();
+}
+
+PyWrapper::IoIntrValue IoIntr::Slot::get() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return value;
+}
+
+void IoIntr::Slot::set(const PyWrapper::IoIntrValue& v)
+{
+    // Previous value is released after unlocking
+    PyWrapper::IoIntrValue old;
+    std::lock_guard<std::mutex> lock(mutex);
+    old.swap(value);
+    value = v;
+}
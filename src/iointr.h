@@ -0,0 +1,66 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#ifndef IOINTR_H
+#define IOINTR_H
+
+#include <dbScan.h>
+
+#include <mutex>
+#include <string>
+
+#include "pywrapper.h"
+
+/**
+ * @brief I/O Intr scan lists shared by records of all types.
+ *
+ * Every parameter pushed with pydev.iointr() has a single scan list,
+ * records of different types that use the same parameter are all in it.
+ */
+class IoIntr {
+    public:
+        /**
+         * @brief Latest value of parameter pushed from main interpreter, converted to native type.
+         */
+        class Slot {
+            public:
+                /**
+                 * @return Converted value, nullptr when record must run Python to read it
+                 */
+                PyWrapper::IoIntrValue get() const;
+                void set(const PyWrapper::IoIntrValue& value);
+
+            private:
+                mutable std::mutex mutex;
+                PyWrapper::IoIntrValue value;
+        };
+
+        /**
+         * @brief Extract parameter name from record link.
+         *
+         * @param addr Record's INP or OUT string
+         * @param param Set to parameter name when addr is exactly pydev.iointr('name')
+         * @return false when addr is any other Python code
+         */
+        static bool parse(const std::string& addr, std::string& param);
+
+        /**
+         * @brief Get scan list of parameter, create and register it on first use.
+         *
+         * Safe to call from concurrent threads.
+         */
+        static IOSCANPVT scanList(const std::string& param);
+
+        /**
+         * @brief Get value slot of parameter, create and register it on first use.
+         *
+         * Values pushed to parameter are converted only after its slot was
+         * created, records processing before the first push run Python.
+         * Safe to call from concurrent threads, slots are never destroyed.
+         */
+        static Slot* slot(const std::string& param);
+};
+
+#endif // IOINTR_H
@@ -0,0 +1,367 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#include "profiler.h"
+#include "pywrapper.h"
+
+#include <Python.h>
+#if PY_VERSION_HEX < 0x03090000
+#include <frameobject.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * Call path node, children are called from this node's function.
+ *
+ * Nodes of code objects and types hold a reference to them, otherwise a
+ * recompiled record could get a code object at the same address and
+ * inherit the node. Nodes with a reference are only destroyed by their
+ * own thread holding its interpreter's GIL, when the thread is profiled
+ * again after Profiler::start().
+ */
+struct Node {
+    const void* key;        // Code object, type or C function definition
+    PyObject* ref;          // Owned reference to key, if it's an object
+    std::string label;
+    uint64_t calls;
+    int64_t totalNs;
+    std::vector<std::unique_ptr<Node>> children;
+
+    Node(const void* key_ = nullptr, const std::string& label_ = "", PyObject* ref_ = nullptr)
+    : key(key_), ref(ref_), label(label_), calls(0), totalNs(0)
+    {
+        Py_XINCREF(ref);
+    }
+    Node(const Node&) = delete;
+    Node& operator=(const Node&) = delete;
+
+    ~Node()
+    {
+        Py_XDECREF(ref);
+    }
+
+    Node* find(const void* k)
+    {
+        for (auto& child: children) {
+            if (child->key == k) {
+                return child.get();
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * Find C function node, definitions of unloaded extension modules
+     * may be reused so the name must match too.
+     */
+    Node* find(const void* k, const char* name)
+    {
+        static const size_t prefix = sizeof("builtin:") - 1;
+        for (auto& child: children) {
+            if (child->key == k && child->label.compare(prefix, std::string::npos, name) == 0) {
+                return child.get();
+            }
+        }
+        return nullptr;
+    }
+
+    Node* find(const std::string& l)
+    {
+        for (auto& child: children) {
+            if (child->label == l) {
+                return child.get();
+            }
+        }
+        return nullptr;
+    }
+
+    Node* add(const void* k, const std::string& l, PyObject* ref = nullptr)
+    {
+        children.emplace_back(new Node(k, l, ref));
+        return children.back().get();
+    }
+
+    int64_t selfNs() const
+    {
+        int64_t ns = totalNs;
+        for (auto& child: children) {
+            ns -= child->totalNs;
+        }
+        return (ns > 0 ? ns : 0);
+    }
+};
+
+/**
+ * Call tree of one thread. Only touched by its own thread, except by
+ * dump(), mutex is practically never contended.
+ */
+struct ThreadProfile {
+    struct Frame {
+        Node* node;
+        int64_t start;
+    };
+
+    std::mutex mutex;
+    unsigned generation;
+    Node root;
+    std::vector<Frame> stack;
+
+    ThreadProfile() : generation(0) {}
+};
+
+static std::atomic<bool> running{false};
+static std::atomic<bool> used{false};
+static std::atomic<unsigned> generation{0};
+
+// Profiles outlive their threads so that dump() can still read them
+static std::mutex threadsMutex;
+static std::vector<ThreadProfile*> threads;
+static thread_local ThreadProfile* threadProfile = nullptr;
+
+static int64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string toString(PyObject* obj)
+{
+#if PY_MAJOR_VERSION < 3
+    if (obj != nullptr && PyString_Check(obj)) {
+        return PyString_AsString(obj);
+    }
+#else
+    if (obj != nullptr && PyUnicode_Check(obj)) {
+        const char* str = PyUnicode_AsUTF8(obj);
+        if (str != nullptr) {
+            return str;
+        }
+        PyErr_Clear();
+    }
+#endif
+    return "?";
+}
+
+/**
+ * Record code is a function named pydevFunction in a file named after
+ * the record, use just the record name then. Other frames are labeled
+ * with file base name and function name.
+ */
+static std::string codeLabel(PyCodeObject* code)
+{
+    std::string file = toString(code->co_filename);
+    std::string func = toString(code->co_name);
+    if (func == "pydevFunction") {
+        return file;
+    }
+    auto slash = file.find_last_of("/\\");
+    if (slash != std::string::npos) {
+        file = file.substr(slash + 1);
+    }
+    return file + ":" + func;
+}
+
+static Node* top(ThreadProfile* profile)
+{
+    return (profile->stack.empty() ? &profile->root : profile->stack.back().node);
+}
+
+static int profileCallback(PyObject* /*obj*/, PyFrameObject* frame, int what, PyObject* arg)
+{
+    if (!running.load(std::memory_order_relaxed)) {
+        return 0;
+    }
+    int64_t t = now();
+
+    if (threadProfile == nullptr) {
+        threadProfile = new ThreadProfile;
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        threads.push_back(threadProfile);
+    }
+    ThreadProfile* profile = threadProfile;
+    std::lock_guard<std::mutex> lock(profile->mutex);
+    unsigned gen = generation.load(std::memory_order_relaxed);
+    if (profile->generation != gen) {
+        profile->generation = gen;
+        profile->root.children.clear();
+        profile->stack.clear();
+    }
+
+    switch (what) {
+        case PyTrace_CALL:
+        {
+#if PY_VERSION_HEX >= 0x03090000
+            PyCodeObject* code = PyFrame_GetCode(frame);
+            Py_DECREF(code); // Frame keeps it alive
+#else
+            PyCodeObject* code = frame->f_code;
+#endif
+            Node* node = top(profile)->find(code);
+            if (node == nullptr) {
+                node = top(profile)->add(code, codeLabel(code), reinterpret_cast<PyObject*>(code));
+            }
+            profile->stack.push_back({node, t});
+            break;
+        }
+        case PyTrace_C_CALL:
+        {
+            // Bound builtin methods are new objects on every call, their
+            // definitions are not
+            const void* key = Py_TYPE(arg);
+            const char* name = Py_TYPE(arg)->tp_name;
+            PyObject* ref = reinterpret_cast<PyObject*>(Py_TYPE(arg));
+            if (PyCFunction_Check(arg)) {
+                key = reinterpret_cast<PyCFunctionObject*>(arg)->m_ml;
+                name = reinterpret_cast<PyCFunctionObject*>(arg)->m_ml->ml_name;
+                ref = nullptr;
+            }
+            Node* node = top(profile)->find(key, name);
+            if (node == nullptr) {
+                node = top(profile)->add(key, std::string("builtin:") + name, ref);
+            }
+            profile->stack.push_back({node, t});
+            break;
+        }
+        case PyTrace_RETURN:
+        case PyTrace_C_RETURN:
+        case PyTrace_C_EXCEPTION:
+            // Calls that started before profiling have no frame
+            if (!profile->stack.empty()) {
+                auto& last = profile->stack.back();
+                last.node->calls++;
+                last.node->totalNs += t - last.start;
+                profile->stack.pop_back();
+            }
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+void Profiler::attach()
+{
+    bool enabled = running.load(std::memory_order_relaxed);
+    if (!enabled && !used.load(std::memory_order_relaxed)) {
+        return;
+    }
+    PyThreadState* tstate = PyThreadState_Get();
+    if (enabled != (tstate->c_profilefunc == profileCallback)) {
+        PyEval_SetProfile(enabled ? profileCallback : nullptr, nullptr);
+    }
+}
+
+void Profiler::start()
+{
+    PyWrapper::Session session;
+    generation++;
+    used = true;
+    running = true;
+#if PY_VERSION_HEX >= 0x030C0000
+    PyEval_SetProfileAllThreads(profileCallback, nullptr);
+#else
+    attach();
+#endif
+}
+
+void Profiler::stop()
+{
+    PyWrapper::Session session;
+    running = false;
+#if PY_VERSION_HEX >= 0x030C0000
+    PyEval_SetProfileAllThreads(nullptr, nullptr);
+#else
+    attach();
+#endif
+}
+
+static void merge(Node& into, const Node& from)
+{
+    into.calls += from.calls;
+    into.totalNs += from.totalNs;
+    for (auto& child: from.children) {
+        Node* node = into.find(child->label);
+        if (node == nullptr) {
+            node = into.add(nullptr, child->label);
+        }
+        merge(*node, *child);
+    }
+}
+
+static void writeStacks(FILE* file, const Node& node, const std::string& path)
+{
+    for (auto& child: node.children) {
+        std::string stack = (path.empty() ? child->label : path + ";" + child->label);
+        long long us = child->selfNs() / 1000;
+        if (us > 0) {
+            fprintf(file, "%s %lld\n", stack.c_str(), us);
+        }
+        writeStacks(file, *child, stack);
+    }
+}
+
+static void collectFunctions(const Node& node, std::map<std::string, std::pair<int64_t, uint64_t>>& functions)
+{
+    for (auto& child: node.children) {
+        auto& entry = functions[child->label];
+        entry.first += child->selfNs();
+        entry.second += child->calls;
+        collectFunctions(*child, functions);
+    }
+}
+
+bool Profiler::dump(const std::string& path)
+{
+    Node root;
+    {
+        unsigned gen = generation.load();
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        for (auto profile: threads) {
+            std::lock_guard<std::mutex> plock(profile->mutex);
+            if (profile->generation == gen) {
+                merge(root, profile->root);
+            }
+        }
+    }
+
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        printf("Failed to open '%s' for writing\n", path.c_str());
+        return false;
+    }
+    writeStacks(file, root, "");
+    fclose(file);
+
+    const size_t topN = 10;
+    std::vector<const Node*> records;
+    for (auto& child: root.children) {
+        records.push_back(child.get());
+    }
+    std::sort(records.begin(), records.end(), [](const Node* a, const Node* b) { return a->totalNs > b->totalNs; });
+    printf("%-40s %-10s %s\n", "Record", "calls", "total ms");
+    for (size_t i = 0; i < records.size() && i < topN; i++) {
+        printf("%-40s %-10llu %.3f\n", records[i]->label.c_str(), (unsigned long long)records[i]->calls, records[i]->totalNs * 1e-6);
+    }
+
+    std::map<std::string, std::pair<int64_t, uint64_t>> functions;
+    collectFunctions(root, functions);
+    std::vector<std::pair<std::string, std::pair<int64_t, uint64_t>>> sorted(functions.begin(), functions.end());
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, std::pair<int64_t, uint64_t>>& a,
+                                               const std::pair<std::string, std::pair<int64_t, uint64_t>>& b) {
+        return a.second.first > b.second.first;
+    });
+    printf("\n%-40s %-10s %s\n", "Function", "calls", "own ms");
+    for (size_t i = 0; i < sorted.size() && i < topN; i++) {
+        printf("%-40s %-10llu %.3f\n", sorted[i].first.c_str(), (unsigned long long)sorted[i].second.second, sorted[i].second.first * 1e-6);
+    }
+    return true;
+}
@@ -0,0 +1,59 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string>
+
+/**
+ * @brief Deterministic profiler of Python code run by PyDevice.
+ *
+ * Profile function is installed with PyEval_SetProfile() in every thread
+ * that takes the GIL through PyWrapper while profiler is running, on
+ * Python 3.12 and later it is also installed in all other threads of
+ * the main interpreter. The hook is written in C and only records time
+ * spent in each call path, Python 3.12 and later deliver its events
+ * through sys.monitoring.
+ *
+ * Code compiled for records uses record name as file name, so the first
+ * frame of every call path is the record that invoked it.
+ */
+class Profiler {
+    public:
+        /**
+         * @brief Discard previous results and start profiling.
+         */
+        static void start();
+
+        /**
+         * @brief Stop profiling, results are kept until next start().
+         */
+        static void stop();
+
+        /**
+         * @brief Write collapsed stacks and print summary.
+         *
+         * Each line of the file is a call path of frames separated by
+         * semicolons followed by microseconds spent in the last frame,
+         * the format used by flamegraph.pl and speedscope. Records with
+         * the highest cumulative time and functions with the highest
+         * own time are printed to the console.
+         *
+         * @param path File to write, existing file is overwritten
+         * @return false when file could not be written
+         */
+        static bool dump(const std::string& path);
+
+        /**
+         * @brief Install or remove profile function in calling thread.
+         *
+         * Called by PyWrapper whenever a thread takes the GIL, so threads
+         * pick up profiler state changes. Must be called with GIL held.
+         */
+        static void attach();
+};
+
+#endif // PROFILER_H
@@ -21,12 +21,16 @@
 #include "recSup.h"
 #include "recGbl.h"
 
+#include <map>
 #include <string>
 #include <cstring>
+#include <vector>
 
 #include "asyncexec.h"
+#include "fieldbinding.h"
+#include "iointr.h"
 #include "pywrapper.h"
-#include "util.h"
+#include "stats.h"
 
 #define GEN_SIZE_OFFSET
 #include "pycalcRecord.h"
@@ -56,8 +60,13 @@ static long fetchValues(pycalcRecord *rec);
 struct PyCalcRecordContext {
     CALLBACK callback;
     int processCbStatus;
-    std::string code;
+    FieldBinding fields;
+    AsyncExec::Options sched;
+    AsyncExec::Task task;
     PyWrapper::ByteCode bytecode;
+    PyWrapper::Awaiter awaiter;
+    RecordStats stats;
+    IoIntr::Slot* slot;         // Value slot when CALC is pydev.iointr('param')
 };
 
 rset pycalcRSET = {
@@ -83,6 +92,19 @@ rset pycalcRSET = {
 };
 epicsExportAddress(rset, pycalcRSET);
 
+/**
+ * Records in main interpreter with CALC reading an I/O Intr parameter
+ * take pushed values without running Python.
+ */
+static IoIntr::Slot* bindSlot(pycalcRecord* rec)
+{
+    std::string param;
+    if (rec->ctx->sched.worker < 0 && IoIntr::parse(rec->calc, param)) {
+        return IoIntr::slot(param);
+    }
+    return nullptr;
+}
+
 static long initRecord(dbCommon *common, int pass)
 {
     auto rec = reinterpret_cast<struct pycalcRecord *>(common);
@@ -122,176 +144,190 @@ static long initRecord(dbCommon *common, int pass)
     }
 
     // Initialize input links
+    std::vector<std::string> fields = {"NAME", "TPRO"};
+    std::map<std::string, const epicsUInt32*> arrays;
     for (int i = 0; i < PYCALCREC_NARGS; i++) {
         auto inp = &rec->inpa + i;
         auto ft  = &rec->fta  + i;
         auto val = &rec->a    + i;
+        auto me  = &rec->mea  + i;
+        auto ne  = &rec->nea  + i;
 
         // Only initialize constants, we fetch link values every time the record processes
         if (dbLinkIsConstant(inp)) {
             recGblInitConstantLink(inp, *ft, *val);
         }
+
+        std::string field(1, 'A'+i);
+        fields.push_back(field);
+        if (*me > 1) {
+            arrays[field] = ne;
+        }
     }
 
+    rec->ctx->fields.init(common, fields, arrays);
+    rec->ctx->fields.update(rec->calc);
+    rec->ctx->sched = AsyncExec::options(common);
+    rec->ctx->awaiter.timeout = rec->ctx->sched.timeout;
+    rec->ctx->awaiter.done = [rec]() { callbackRequestProcessCallback(&rec->ctx->callback, rec->prio, rec); };
+    rec->ctx->stats.init(common, "pycalc");
+    rec->ctx->slot = bindSlot(rec);
+
     return 0;
 }
 
-static void processRecordCb(pycalcRecord* rec)
+/**
+ * Copy numeric array into VAL field in a single pass.
+ *
+ * @return false when FTVL is not a numeric type
+ */
+static bool copyArray(pycalcRecord* rec, const Variant::Array& arr)
 {
-    auto ctx = reinterpret_cast<PyCalcRecordContext*>(rec->ctx);
-    std::string code = rec->calc;
-    std::map<std::string, Variant> args;
-    for (auto& macro: Util::getMacros(code)) {
-        if      (macro == "NAME") { args["pydevNAME"] = Variant(rec->name); code = Util::replaceMacro(code, "NAME", "pydevNAME"); }
-        else if (macro == "TPRO") { args["pydevTPRO"] = Variant(rec->tpro); code = Util::replaceMacro(code, "TPRO", "pydevTPRO"); }
-        else {
-            for (auto i = 0; i < PYCALCREC_NARGS; i++) {
-                std::string field = std::string(1,'A'+i);
-                if (macro == field) {
-                    auto val = &rec->a   + i;
-                    auto ft  = &rec->fta + i;
-                    auto me  = &rec->mea + i;
-                    auto ne  = &rec->nea + i;
-
-                    code = Util::replaceMacro(code, field, "pydev"+field);
-                    if (*me == 1) {
-                        if      (*ft == DBR_CHAR)   { args["pydev"+field] = Variant(*reinterpret_cast<   epicsInt8*>(*val)); }
-                        else if (*ft == DBR_UCHAR)  { args["pydev"+field] = Variant(*reinterpret_cast<  epicsUInt8*>(*val)); }
-                        else if (*ft == DBR_SHORT)  { args["pydev"+field] = Variant(*reinterpret_cast<  epicsInt16*>(*val)); }
-                        else if (*ft == DBR_USHORT) { args["pydev"+field] = Variant(*reinterpret_cast< epicsUInt16*>(*val)); }
-                        else if (*ft == DBR_LONG)   { args["pydev"+field] = Variant(*reinterpret_cast<  epicsInt32*>(*val)); }
-                        else if (*ft == DBR_ULONG)  { args["pydev"+field] = Variant(*reinterpret_cast< epicsUInt32*>(*val)); }
-#ifdef HAVE_EPICS_INT64
-                        else if (*ft == DBR_INT64)  { args["pydev"+field] = Variant(*reinterpret_cast<  epicsInt64*>(*val)); }
-                        else if (*ft == DBR_UINT64) { args["pydev"+field] = Variant(*reinterpret_cast< epicsUInt64*>(*val)); }
-#endif
-                        else if (*ft == DBR_FLOAT)  { args["pydev"+field] = Variant(*reinterpret_cast<epicsFloat32*>(*val)); }
-                        else if (*ft == DBR_DOUBLE) { args["pydev"+field] = Variant(*reinterpret_cast<epicsFloat64*>(*val)); }
-                        else if (*ft == DBR_STRING) { args["pydev"+field] = Variant( reinterpret_cast<        char*>(*val)); }
-                    } else {
-                        if      (*ft == DBR_CHAR)   { auto a = reinterpret_cast<   epicsInt8*>(*val); args["pydev"+field] = Variant(a, *ne); }
-                        else if (*ft == DBR_UCHAR)  { auto a = reinterpret_cast<  epicsUInt8*>(*val); args["pydev"+field] = Variant(a, *ne); }
-                        else if (*ft == DBR_SHORT)  { auto a = reinterpret_cast<  epicsInt16*>(*val); args["pydev"+field] = Variant(a, *ne); }
-                        else if (*ft == DBR_USHORT) { auto a = reinterpret_cast< epicsUInt16*>(*val); args["pydev"+field] = Variant(a, *ne); }
-                        else if (*ft == DBR_LONG)   { auto a = reinterpret_cast<  epicsInt32*>(*val); args["pydev"+field] = Variant(a, *ne); }
-                        else if (*ft == DBR_ULONG)  { auto a = reinterpret_cast< epicsUInt32*>(*val); args["pydev"+field] = Variant(a, *ne); }
-#ifdef HAVE_EPICS_INT64
-                        else if (*ft == DBR_INT64)  { auto a = reinterpret_cast<  epicsInt64*>(*val); args["pydev"+field] = Variant(a, *ne); }
-                        else if (*ft == DBR_UINT64) { auto a = reinterpret_cast< epicsUInt64*>(*val); args["pydev"+field] = Variant(a, *ne); }
-#endif
-                        else if (*ft == DBR_FLOAT)  { auto a = reinterpret_cast<epicsFloat32*>(*val); args["pydev"+field] = Variant(a, *ne); }
-                        else if (*ft == DBR_DOUBLE) { auto a = reinterpret_cast<epicsFloat64*>(*val); args["pydev"+field] = Variant(a, *ne); }
-                        else if (*ft == DBR_STRING) {
-                            std::vector<std::string> a;
-                            const char* ptr = reinterpret_cast<const char*>(*val);
-                            for (size_t i=0; i<*ne; i++) {
-                                std::string element(ptr, dbValueSize(DBF_STRING));
-                                element.resize(element.find('\0'));
-                                a.push_back(element);
-                                ptr += dbValueSize(DBF_STRING);
-                            }
-                            args["pydev"+field] = Variant(a);
-                        }
-                    }
-                }
-            }
-        }
+    Variant::ElementType type;
+    if (!FieldBinding::elementType(rec->ftvl, type)) {
+        return false;
     }
+    rec->nevl = arr.copy(rec->val, type, rec->mevl);
+    return true;
+}
 
-    try {
-        if (ctx->code != code) {
-            PyWrapper::destroy(std::move(ctx->bytecode));
-            ctx->bytecode = PyWrapper::compile(code, (rec->tpro == 1));
-            ctx->code = code;
+/**
+ * Assign value returned by Python code or pushed with pydev.iointr() to VAL.
+ */
+static void setValue(pycalcRecord* rec, const Variant& value)
+{
+    rec->nevl = 0;
+    typedef long (*convertRoutineCast)(const void*, void*, void*);
+    Variant::Array arr;
+    if (value.try_get(arr) && copyArray(rec, arr)) {
+        // Numeric vectors and arrays are copied to numeric VAL in a single pass
+    } else if (value.type == Variant::Type::BOOL) {
+        epicsInt32 val = value.get_bool();
+        auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_LONG][rec->ftvl]);
+        if (convert(&val, rec->val, 0) != 0) {
+            throw Variant::ConvertError("Failed to convert Python return value to EPICS VAL field");
+        }
+        rec->nevl = 1;
+    } else if (value.type == Variant::Type::LONG) {
+        epicsInt32 val = value.get_long();
+        auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_LONG][rec->ftvl]);
+        if (convert(&val, rec->val, 0) != 0) {
+            throw Variant::ConvertError("Failed to convert Python return value to EPICS VAL field");
+        }
+        rec->nevl = 1;
+    } else if (value.type == Variant::Type::UNSIGNED) {
+        epicsInt32 val = value.get_unsigned();
+        auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_ULONG][rec->ftvl]);
+        if (convert(&val, rec->val, 0) != 0) {
+            throw Variant::ConvertError("Failed to convert Python return value to EPICS VAL field");
         }
-        auto ret = PyWrapper::eval(ctx->bytecode, args, (rec->tpro == 1));
-
-        rec->nevl = 0;
-        typedef long (*convertRoutineCast)(const void*, void*, void*);
-        if (ret.type == Variant::Type::BOOL) {
-            epicsInt32 val = ret.get_bool();
-            auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_LONG][rec->ftvl]);
-            if (convert(&val, rec->val, 0) != 0) {
+        rec->nevl = 1;
+    } else if (value.type == Variant::Type::DOUBLE) {
+        epicsFloat64 val = value.get_double();
+        auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_DOUBLE][rec->ftvl]);
+        if (convert(&val, rec->val, 0) != 0) {
+            throw Variant::ConvertError("Failed to convert Python return value to EPICS VAL field");
+        }
+        rec->nevl = 1;
+    } else if (value.type == Variant::Type::STRING) {
+        char val[MAX_STRING_SIZE];
+        value.copy_string(val, sizeof(val));
+        auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_STRING][rec->ftvl]);
+        if (convert(val, rec->val, 0) != 0) {
+            throw Variant::ConvertError("Failed to convert Python return value to EPICS VAL field");
+        }
+        rec->nevl = 1;
+    } else if (value.type == Variant::Type::VECTOR_LONG) {
+        auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_LONG][rec->ftvl]);
+        auto values = value.get_long_array();
+        for (size_t i=0; i<values.size() && i<rec->mevl; i++) {
+            char* val = reinterpret_cast<char*>(rec->val) + i*dbValueSize(rec->ftvl);
+            if (convert(&values[i], val, 0) != 0) {
                 throw Variant::ConvertError("Failed to convert Python return value to EPICS VAL field");
             }
-            rec->nevl = 1;
-        } else if (ret.type == Variant::Type::LONG) {
-            epicsInt32 val = ret.get_long();
-            auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_LONG][rec->ftvl]);
-            if (convert(&val, rec->val, 0) != 0) {
+            rec->nevl++;
+        }
+    } else if (value.type == Variant::Type::VECTOR_UNSIGNED) {
+        auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_ULONG][rec->ftvl]);
+        auto values = value.get_unsigned_array();
+        for (size_t i=0; i<values.size() && i<rec->mevl; i++) {
+            char* val = reinterpret_cast<char*>(rec->val) + i*dbValueSize(rec->ftvl);
+            if (convert(&values[i], val, 0) != 0) {
                 throw Variant::ConvertError("Failed to convert Python return value to EPICS VAL field");
             }
-            rec->nevl = 1;
-        } else if (ret.type == Variant::Type::UNSIGNED) {
-            epicsInt32 val = ret.get_unsigned();
-            auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_ULONG][rec->ftvl]);
-            if (convert(&val, rec->val, 0) != 0) {
+            rec->nevl++;
+        }
+    } else if (value.type == Variant::Type::VECTOR_DOUBLE) {
+        auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_DOUBLE][rec->ftvl]);
+        auto values = value.get_double_array();
+        for (size_t i=0; i<values.size() && i<rec->mevl; i++) {
+            char* val = reinterpret_cast<char*>(rec->val) + i*dbValueSize(rec->ftvl);
+            if (convert(&values[i], val, 0) != 0) {
                 throw Variant::ConvertError("Failed to convert Python return value to EPICS VAL field");
             }
-            rec->nevl = 1;
-        } else if (ret.type == Variant::Type::DOUBLE) {
-            epicsFloat64 val = ret.get_double();
-            auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_DOUBLE][rec->ftvl]);
-            if (convert(&val, rec->val, 0) != 0) {
+            rec->nevl++;
+        }
+    } else if (value.type == Variant::Type::ARRAY) {
+        // Only string FTVL remains, numeric arrays were handled above
+        auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_STRING][rec->ftvl]);
+        auto values = value.get_string_array();
+        for (size_t i=0; i<values.size() && i<rec->mevl; i++) {
+            char* val = reinterpret_cast<char*>(rec->val) + i*dbValueSize(rec->ftvl);
+            if (convert(values[i].c_str(), val, 0) != 0) {
                 throw Variant::ConvertError("Failed to convert Python return value to EPICS VAL field");
             }
-            rec->nevl = 1;
-        } else if (ret.type == Variant::Type::STRING) {
-            char val[MAX_STRING_SIZE];
-            strncpy(val, ret.get_string().c_str(), MAX_STRING_SIZE);
-            val[MAX_STRING_SIZE-1] = 0;
-            auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_STRING][rec->ftvl]);
-            if (convert(val, rec->val, 0) != 0) {
+            rec->nevl++;
+        }
+    } else if (value.type == Variant::Type::VECTOR_STRING) {
+        auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_STRING][rec->ftvl]);
+        auto& values = value.get_string_vector();
+        for (size_t i=0; i<values.size() && i<rec->mevl; i++) {
+            char* val = reinterpret_cast<char*>(rec->val) + i*dbValueSize(rec->ftvl);
+            if (convert(values[i].c_str(), val, 0) != 0) {
                 throw Variant::ConvertError("Failed to convert Python return value to EPICS VAL field");
             }
-            rec->nevl = 1;
-        } else if (ret.type == Variant::Type::VECTOR_LONG) {
-            auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_LONG][rec->ftvl]);
-            auto values = ret.get_long_array();
-            for (size_t i=0; i<values.size() && i<rec->mevl; i++) {
-                char* val = reinterpret_cast<char*>(rec->val) + i*dbValueSize(rec->ftvl);
-                if (convert(&values[i], val, 0) != 0) {
-                    throw Variant::ConvertError("Failed to convert Python return value to EPICS VAL field");
-                }
-                rec->nevl++;
-            }
-        } else if (ret.type == Variant::Type::VECTOR_UNSIGNED) {
-            auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_ULONG][rec->ftvl]);
-            auto values = ret.get_unsigned_array();
-            for (size_t i=0; i<values.size() && i<rec->mevl; i++) {
-                char* val = reinterpret_cast<char*>(rec->val) + i*dbValueSize(rec->ftvl);
-                if (convert(&values[i], val, 0) != 0) {
-                    throw Variant::ConvertError("Failed to convert Python return value to EPICS VAL field");
-                }
-                rec->nevl++;
-            }
-        } else if (ret.type == Variant::Type::VECTOR_DOUBLE) {
-            auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_DOUBLE][rec->ftvl]);
-            auto values = ret.get_double_array();
-            for (size_t i=0; i<values.size() && i<rec->mevl; i++) {
-                char* val = reinterpret_cast<char*>(rec->val) + i*dbValueSize(rec->ftvl);
-                if (convert(&values[i], val, 0) != 0) {
-                    throw Variant::ConvertError("Failed to convert Python return value to EPICS VAL field");
-                }
-                rec->nevl++;
-            }
-        } else if (ret.type == Variant::Type::VECTOR_STRING) {
-            auto convert = reinterpret_cast<convertRoutineCast>(dbFastPutConvertRoutine[DBF_STRING][rec->ftvl]);
-            auto values = ret.get_string_array();
-            for (size_t i=0; i<values.size() && i<rec->mevl; i++) {
-                char* val = reinterpret_cast<char*>(rec->val) + i*dbValueSize(rec->ftvl);
-                if (convert(values[i].c_str(), val, 0) != 0) {
-                    throw Variant::ConvertError("Failed to convert Python return value to EPICS VAL field");
-                }
-                rec->nevl++;
-            }
-        } else if (ret.type != Variant::Type::NONE) {
-            throw PyWrapper::EvalError("Python code returned an unsupported type");
-        } else {
-            // Don't assign any value to the record if Python code didn't return anything
+            rec->nevl++;
+        }
+    } else if (value.type != Variant::Type::NONE) {
+        throw PyWrapper::EvalError("Python code returned an unsupported type");
+    } else {
+        // Don't assign any value to the record if Python code didn't return anything
+    }
+}
+
+/**
+ * Evaluate CALC and assign the result.
+ *
+ * @return false when code returned an awaitable, record is completed by
+ *         processAwaited() once asyncio loop has the result
+ */
+static bool evaluate(pycalcRecord* rec)
+{
+    auto ctx = reinterpret_cast<PyCalcRecordContext*>(rec->ctx);
+    try {
+        if (ctx->fields.update(rec->calc)) {
+            PyWrapper::destroy(std::move(ctx->bytecode));
+            ctx->slot = bindSlot(rec);
         }
+        if (!ctx->bytecode) {
+            ctx->bytecode = PyWrapper::compile(ctx->fields.code, ctx->fields.params, (rec->tpro == 1), rec->name);
+        }
+        ctx->stats.begin(ctx->task);
+        ctx->fields.collect();
+        auto value = PyWrapper::call(ctx->bytecode, ctx->fields.args, (rec->tpro == 1), &ctx->stats.timing, &ctx->awaiter);
+        if (ctx->awaiter.detach()) {
+            return false;
+        }
+        setValue(rec, value);
+        ctx->stats.end();
         ctx->processCbStatus = 0;
 
+    } catch (PyWrapper::TimeoutError& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmTimeout, epicsSevInvalid);
+        ctx->processCbStatus = -1;
     } catch (std::exception& e) {
         if (rec->tpro == 1) {
             printf("[%s] %s\n", rec->name, e.what());
@@ -299,8 +335,73 @@ static void processRecordCb(pycalcRecord* rec)
         recGblSetSevr(rec, epicsAlarmCalc, epicsSevInvalid);
         ctx->processCbStatus = -1;
     }
+    return true;
+}
 
-    callbackRequestProcessCallback(&ctx->callback, rec->prio, rec);
+static void evalRecord(pycalcRecord* rec)
+{
+    evaluate(rec);
+}
+
+/**
+ * Assign result of awaitable returned by Python code.
+ */
+static void processAwaited(pycalcRecord* rec)
+{
+    auto ctx = reinterpret_cast<PyCalcRecordContext*>(rec->ctx);
+    try {
+        setValue(rec, ctx->awaiter.result());
+        ctx->stats.end();
+        ctx->processCbStatus = 0;
+    } catch (PyWrapper::TimeoutError& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmTimeout, epicsSevInvalid);
+        ctx->processCbStatus = -1;
+    } catch (std::exception& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmCalc, epicsSevInvalid);
+        ctx->processCbStatus = -1;
+    }
+}
+
+/**
+ * Assign value pushed with pydev.iointr() without running Python.
+ *
+ * @return false when value must be read by Python code
+ */
+static bool evalNative(pycalcRecord* rec)
+{
+    auto ctx = reinterpret_cast<PyCalcRecordContext*>(rec->ctx);
+    // Changed CALC is picked up by evalRecord()
+    if (ctx->slot == nullptr || ctx->fields.link != rec->calc) {
+        return false;
+    }
+    auto value = ctx->slot->get();
+    if (!value) {
+        return false;
+    }
+    try {
+        setValue(rec, *value);
+        ctx->processCbStatus = 0;
+    } catch (std::exception& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmCalc, epicsSevInvalid);
+        ctx->processCbStatus = -1;
+    }
+    return true;
+}
+
+static void processRecordCb(pycalcRecord* rec)
+{
+    if (evaluate(rec)) {
+        callbackRequestProcessCallback(&rec->ctx->callback, rec->prio, rec);
+    }
 }
 
 static long processRecord(dbCommon *common)
@@ -315,12 +416,22 @@ static long processRecord(dbCommon *common)
             return S_dev_badInpType;
         }
 
-        auto scheduled = AsyncExec::schedule([rec]() {
-            processRecordCb(rec);
-        });
-        return (scheduled ? 0 : -1);
+        // Record run inline or natively completes right away, without callback
+        rec->ctx->task.bind<pycalcRecord, evalRecord>(rec);
+        if (!evalNative(rec) && !AsyncExec::runInline(rec->ctx->task, rec->ctx->sched)) {
+            rec->ctx->task.bind<pycalcRecord, processRecordCb>(rec);
+            auto scheduled = AsyncExec::schedule(rec->ctx->task, rec->ctx->sched);
+            return (scheduled ? 0 : -1);
+        }
+        if (rec->ctx->awaiter.pending()) {
+            // Awaitable returned by inline code completes asynchronously
+            return 0;
+        }
+    } else if (rec->ctx->awaiter.pending()) {
+        processAwaited(rec);
     }
 
+    rec->ctx->stats.complete();
     if (rec->ctx->processCbStatus == -1) {
         recGblSetSevr(rec, epicsAlarmCalc, epicsSevInvalid);
     }
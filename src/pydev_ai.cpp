@@ -13,38 +13,27 @@
 #include <epicsExport.h>
 #include <recGbl.h>
 
-#include <map>
 #include <string.h>
 
 #include "asyncexec.h"
+#include "fieldbinding.h"
+#include "iointr.h"
 #include "pywrapper.h"
-#include "util.h"
+#include "stats.h"
 
 struct PyDevContext {
     CALLBACK callback;
     IOSCANPVT scan;
+    IoIntr::Slot* slot;
     int processCbStatus;
-    std::string code;
+    FieldBinding fields;
+    AsyncExec::Options sched;
+    AsyncExec::Task task;
     PyWrapper::ByteCode bytecode;
+    PyWrapper::Awaiter awaiter;
+    RecordStats stats;
 };
 
-static std::map<std::string, IOSCANPVT> ioScanPvts;
-
-static void scanCallback(IOSCANPVT scan)
-{
-#ifdef VERSION_INT
-#  if EPICS_VERSION_INT < VERSION_INT(3,16,0,0)
-    scanIoRequest(scan);
-#  else
-    scanIoImmediate(scan, priorityHigh);
-    scanIoImmediate(scan, priorityMedium);
-    scanIoImmediate(scan, priorityLow);
-#  endif
-#else
-    scanIoRequest(scan);
-#endif
-}
-
 static long initRecord(aiRecord* rec)
 {
     std::string addr = rec->inp.value.instio.string;
@@ -52,20 +41,18 @@ static long initRecord(aiRecord* rec)
     PyDevContext* ctx = new (buffer) PyDevContext;
     rec->dpvt = ctx;
 
-    // This could be better checked with regex
-    if (addr.find("pydev.iointr('") == 0 && addr.substr(addr.size()-2) == "')") {
-        std::string param = addr.substr(14, addr.size()-16);
-        auto it = ioScanPvts.find(param);
-        if (it == ioScanPvts.end()) {
-            scanIoInit( &ioScanPvts[param] );
-            PyWrapper::Callback cb = std::bind(scanCallback, ioScanPvts[param]);
-            PyWrapper::registerIoIntr(param, cb);
-            it = ioScanPvts.find(param);
-        }
-        ctx->scan = it->second;
-    } else {
-        ctx->scan = nullptr;
-    }
+    ctx->fields.init(reinterpret_cast<dbCommon*>(rec), {"VAL", "RVAL", "ORAW", "NAME", "EGU", "HOPR", "LOPR", "PREC", "TPRO"});
+    ctx->fields.update(rec->inp.value.instio.string);
+    ctx->sched = AsyncExec::options(reinterpret_cast<dbCommon*>(rec));
+    ctx->awaiter.timeout = ctx->sched.timeout;
+    ctx->awaiter.done = [ctx, rec]() { callbackRequestProcessCallback(&ctx->callback, rec->prio, rec); };
+    ctx->stats.init(reinterpret_cast<dbCommon*>(rec), "ai");
+
+    std::string param;
+    bool iointr = IoIntr::parse(addr, param);
+    ctx->scan = (iointr ? IoIntr::scanList(param) : nullptr);
+    // Records in main interpreter read pushed values without running Python
+    ctx->slot = (iointr && ctx->sched.worker < 0 ? IoIntr::slot(param) : nullptr);
 
     return 0;
 }
@@ -79,43 +66,61 @@ static long getIointInfo(int /*direction*/, aiRecord *rec, IOSCANPVT* io)
     return 0;
 }
 
-static void processRecordCb(aiRecord* rec)
+/**
+ * Convert VAL back to raw units, as passed to Python code and smoothed
+ * by setValue().
+ */
+static void unconvert(aiRecord* rec)
 {
-    auto ctx = reinterpret_cast<PyDevContext*>(rec->dpvt);
-
     rec->val -= rec->aoff;
     if (rec->aslo != 0.0) rec->val /= rec->aslo;
+}
 
-    std::string code = rec->inp.value.instio.string;
-    std::map<std::string, Variant> args;
-    for (auto& macro: Util::getMacros(code)) {
-        if      (macro == "VAL")  { args["pydevVAL"]  = Variant(rec->val);  code = Util::replaceMacro(code, "VAL",  "pydevVAL");  }
-        else if (macro == "RVAL") { args["pydevRVAL"] = Variant(rec->rval); code = Util::replaceMacro(code, "RVAL", "pydevRVAL"); }
-        else if (macro == "ORAW") { args["pydevORAW"] = Variant(rec->oraw); code = Util::replaceMacro(code, "ORAW", "pydevORAW"); }
-        else if (macro == "NAME") { args["pydevNAME"] = Variant(rec->name); code = Util::replaceMacro(code, "NAME", "pydevNAME"); }
-        else if (macro == "EGU")  { args["pydevEGU"]  = Variant(rec->egu);  code = Util::replaceMacro(code, "EGU",  "pydevEGU");  }
-        else if (macro == "HOPR") { args["pydevHOPR"] = Variant(rec->hopr); code = Util::replaceMacro(code, "HOPR", "pydevHOPR"); }
-        else if (macro == "LOPR") { args["pydevLOPR"] = Variant(rec->lopr); code = Util::replaceMacro(code, "LOPR", "pydevLOPR"); }
-        else if (macro == "PREC") { args["pydevPREC"] = Variant(rec->prec); code = Util::replaceMacro(code, "PREC", "pydevPREC"); }
-        else if (macro == "TPRO") { args["pydevTPRO"] = Variant(rec->tpro); code = Util::replaceMacro(code, "TPRO", "pydevTPRO"); }
-    }
+/**
+ * Assign value returned by Python code or pushed with pydev.iointr(),
+ * VAL must be in raw units, see unconvert().
+ */
+static void setValue(aiRecord* rec, const Variant& value)
+{
+    double val = value.get_double();
+    val = (val * rec->aslo) + rec->aoff;
+    if (rec->smoo == 0.0 || rec->udf)
+        rec->val = val;
+    else
+        rec->val = (rec->val * rec->smoo) + (val * (1.0 - rec->smoo));
+    rec->udf = 0;
+}
+
+static void processRecordCb(aiRecord* rec)
+{
+    auto ctx = reinterpret_cast<PyDevContext*>(rec->dpvt);
+
+    unconvert(rec);
 
     try {
-        if (ctx->code != code) {
+        if (ctx->fields.update(rec->inp.value.instio.string)) {
             PyWrapper::destroy(std::move(ctx->bytecode));
-            ctx->bytecode = PyWrapper::compile(code, (rec->tpro == 1));
-            ctx->code = code;
         }
-        double val = PyWrapper::eval(ctx->bytecode, args, (rec->tpro == 1)).get_double();
-
-        val = (val * rec->aslo) + rec->aoff;
-        if (rec->smoo == 0.0 || rec->udf)
-            rec->val = val;
-        else
-            rec->val = (rec->val * rec->smoo) + (val * (1.0 - rec->smoo));
-        rec->udf = 0;
+        if (!ctx->bytecode) {
+            ctx->bytecode = PyWrapper::compile(ctx->fields.code, ctx->fields.params, (rec->tpro == 1), rec->name);
+        }
+        ctx->stats.begin(ctx->task);
+        ctx->fields.collect();
+        auto value = PyWrapper::call(ctx->bytecode, ctx->fields.args, (rec->tpro == 1), &ctx->stats.timing, &ctx->awaiter);
+        if (ctx->awaiter.detach()) {
+            // Completed by processAwaited() once asyncio loop has the result
+            return;
+        }
+        setValue(rec, value);
+        ctx->stats.end();
         ctx->processCbStatus = 2; // Conversion already done
 
+    } catch (PyWrapper::TimeoutError& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmTimeout, epicsSevInvalid);
+        ctx->processCbStatus = -1;
     } catch (std::exception& e) {
         if (rec->tpro == 1) {
             printf("[%s] %s\n", rec->name, e.what());
@@ -124,7 +129,62 @@ static void processRecordCb(aiRecord* rec)
         ctx->processCbStatus = -1;
     }
 
-    callbackRequestProcessCallback(&ctx->callback, rec->prio, rec);
+    // Record run inline in processing thread completes without callback
+    if (rec->pact == 1) {
+        callbackRequestProcessCallback(&ctx->callback, rec->prio, rec);
+    }
+}
+
+/**
+ * Complete record from value pushed with pydev.iointr() without running Python.
+ *
+ * @return false when value must be read by Python code
+ */
+static bool processNative(aiRecord* rec)
+{
+    auto ctx = reinterpret_cast<PyDevContext*>(rec->dpvt);
+    auto value = ctx->slot->get();
+    if (!value) {
+        return false;
+    }
+    // Same conversion as with value returned by Python code
+    unconvert(rec);
+    try {
+        setValue(rec, *value);
+        ctx->processCbStatus = 2; // Conversion already done
+    } catch (std::exception& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmCalc, epicsSevInvalid);
+        ctx->processCbStatus = -1;
+    }
+    return true;
+}
+
+/**
+ * Complete record with result of awaitable returned by Python code.
+ */
+static void processAwaited(aiRecord* rec)
+{
+    auto ctx = reinterpret_cast<PyDevContext*>(rec->dpvt);
+    try {
+        setValue(rec, ctx->awaiter.result());
+        ctx->stats.end();
+        ctx->processCbStatus = 2; // Conversion already done
+    } catch (PyWrapper::TimeoutError& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmTimeout, epicsSevInvalid);
+        ctx->processCbStatus = -1;
+    } catch (std::exception& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmCalc, epicsSevInvalid);
+        ctx->processCbStatus = -1;
+    }
 }
 
 static long processRecord(aiRecord* rec)
@@ -138,23 +198,45 @@ static long processRecord(aiRecord* rec)
     }
 
     if (rec->pact == 1) {
+        if (ctx->awaiter.pending()) {
+            processAwaited(rec);
+        }
+        ctx->stats.complete();
         rec->pact = 0;
         return ctx->processCbStatus;
     }
-    rec->pact = 1;
 
-    auto scheduled = AsyncExec::schedule([rec]() {
-        processRecordCb(rec);
-    });
+    if (ctx->slot != nullptr && processNative(rec)) {
+        return ctx->processCbStatus;
+    }
+
+    ctx->task.bind<aiRecord, processRecordCb>(rec);
+    if (AsyncExec::runInline(ctx->task, ctx->sched)) {
+        if (ctx->awaiter.pending()) {
+            // Awaitable returned by inline code completes asynchronously
+            rec->pact = 1;
+            return 0;
+        }
+        ctx->stats.complete();
+        return ctx->processCbStatus;
+    }
+    rec->pact = 1;
+    auto scheduled = AsyncExec::schedule(ctx->task, ctx->sched);
     return (scheduled ? 0 : -1);
 }
 
+static long reportStats(int level)
+{
+    RecordStats::report("ai", level);
+    return 0;
+}
+
 extern "C"
 {
     struct
     {
         long number{6};
-        DEVSUPFUN report{nullptr};
+        DEVSUPFUN report{(DEVSUPFUN)reportStats};
         DEVSUPFUN init{nullptr};
         DEVSUPFUN init_record{(DEVSUPFUN)initRecord};
         DEVSUPFUN get_ioint_info{(DEVSUPFUN)getIointInfo};
@@ -13,38 +13,27 @@
 #include <epicsExport.h>
 #include <recGbl.h>
 
-#include <map>
 #include <string.h>
 
 #include "asyncexec.h"
+#include "fieldbinding.h"
+#include "iointr.h"
 #include "pywrapper.h"
-#include "util.h"
+#include "stats.h"
 
 struct PyDevContext {
     CALLBACK callback;
     IOSCANPVT scan;
+    IoIntr::Slot* slot;
     int processCbStatus;
-    std::string code;
+    FieldBinding fields;
+    AsyncExec::Options sched;
+    AsyncExec::Task task;
     PyWrapper::ByteCode bytecode;
+    PyWrapper::Awaiter awaiter;
+    RecordStats stats;
 };
 
-static std::map<std::string, IOSCANPVT> ioScanPvts;
-
-static void scanCallback(IOSCANPVT scan)
-{
-#ifdef VERSION_INT
-#  if EPICS_VERSION_INT < VERSION_INT(3,16,0,0)
-    scanIoRequest(scan);
-#  else
-    scanIoImmediate(scan, priorityHigh);
-    scanIoImmediate(scan, priorityMedium);
-    scanIoImmediate(scan, priorityLow);
-#  endif
-#else
-    scanIoRequest(scan);
-#endif
-}
-
 static long initRecord(mbboRecord* rec)
 {
     std::string addr = rec->out.value.instio.string;
@@ -52,20 +41,18 @@ static long initRecord(mbboRecord* rec)
     PyDevContext* ctx = new (buffer) PyDevContext;
     rec->dpvt = ctx;
 
-    // This could be better checked with regex
-    if (addr.find("pydev.iointr('") == 0 && addr.substr(addr.size()-2) == "')") {
-        std::string param = addr.substr(14, addr.size()-16);
-        auto it = ioScanPvts.find(param);
-        if (it == ioScanPvts.end()) {
-            scanIoInit( &ioScanPvts[param] );
-            PyWrapper::Callback cb = std::bind(scanCallback, ioScanPvts[param]);
-            PyWrapper::registerIoIntr(param, cb);
-            it = ioScanPvts.find(param);
-        }
-        ctx->scan = it->second;
-    } else {
-        ctx->scan = nullptr;
-    }
+    ctx->fields.init(reinterpret_cast<dbCommon*>(rec), {"VAL", "RVAL", "NAME", "ZRVL", "ONVL", "TWVL", "THVL", "FRVL", "FVVL", "SXVL", "SVVL", "EIVL", "NIVL", "TEVL", "ELVL", "TVVL", "TTVL", "FTVL", "FFVL", "ZRST", "ONST", "TWST", "THST", "FRST", "FVST", "SXST", "SVST", "EIST", "NIST", "TEST", "ELST", "TVST", "TTST", "FTST", "FFST", "TPRO"});
+    ctx->fields.update(rec->out.value.instio.string);
+    ctx->sched = AsyncExec::options(reinterpret_cast<dbCommon*>(rec));
+    ctx->awaiter.timeout = ctx->sched.timeout;
+    ctx->awaiter.done = [ctx, rec]() { callbackRequestProcessCallback(&ctx->callback, rec->prio, rec); };
+    ctx->stats.init(reinterpret_cast<dbCommon*>(rec), "mbbo");
+
+    std::string param;
+    bool iointr = IoIntr::parse(addr, param);
+    ctx->scan = (iointr ? IoIntr::scanList(param) : nullptr);
+    // Records in main interpreter read pushed values without running Python
+    ctx->slot = (iointr && ctx->sched.worker < 0 ? IoIntr::slot(param) : nullptr);
 
     return 2;
 }
@@ -79,61 +66,97 @@ static long getIointInfo(int /*direction*/, mbboRecord *rec, IOSCANPVT* io)
     return 0;
 }
 
+/**
+ * Assign value returned by Python code or pushed with pydev.iointr().
+ */
+static void setValue(mbboRecord* rec, const Variant& value)
+{
+    rec->val = value.get_long();
+    rec->udf = 0;
+}
+
 static void processRecordCb(mbboRecord* rec)
 {
     auto ctx = reinterpret_cast<PyDevContext*>(rec->dpvt);
 
-    std::string code = rec->out.value.instio.string;
-    std::map<std::string, Variant> args;
-    for (auto& macro: Util::getMacros(code)) {
-        if      (macro == "VAL")  { args["pydevVAL"]  = Variant(rec->val);  code = Util::replaceMacro(code, "VAL",  "pydevVAL");  }
-        else if (macro == "RVAL") { args["pydevRVAL"] = Variant(rec->rval); code = Util::replaceMacro(code, "RVAL", "pydevRVAL"); }
-        else if (macro == "NAME") { args["pydevNAME"] = Variant(rec->name); code = Util::replaceMacro(code, "NAME", "pydevNAME"); }
-        else if (macro == "ZRVL") { args["pydevZRVL"] = Variant(rec->zrvl); code = Util::replaceMacro(code, "ZRVL", "pydevZRVL"); }
-        else if (macro == "ONVL") { args["pydevONVL"] = Variant(rec->onvl); code = Util::replaceMacro(code, "ONVL", "pydevONVL"); }
-        else if (macro == "TWVL") { args["pydevTWVL"] = Variant(rec->twvl); code = Util::replaceMacro(code, "TWVL", "pydevTWVL"); }
-        else if (macro == "THVL") { args["pydevTHVL"] = Variant(rec->thvl); code = Util::replaceMacro(code, "THVL", "pydevTHVL"); }
-        else if (macro == "FRVL") { args["pydevFRVL"] = Variant(rec->frvl); code = Util::replaceMacro(code, "FRVL", "pydevFRVL"); }
-        else if (macro == "FVVL") { args["pydevFVVL"] = Variant(rec->fvvl); code = Util::replaceMacro(code, "FVVL", "pydevFVVL"); }
-        else if (macro == "SXVL") { args["pydevSXVL"] = Variant(rec->sxvl); code = Util::replaceMacro(code, "SXVL", "pydevSXVL"); }
-        else if (macro == "SVVL") { args["pydevSVVL"] = Variant(rec->svvl); code = Util::replaceMacro(code, "SVVL", "pydevSVVL"); }
-        else if (macro == "EIVL") { args["pydevEIVL"] = Variant(rec->eivl); code = Util::replaceMacro(code, "EIVL", "pydevEIVL"); }
-        else if (macro == "NIVL") { args["pydevNIVL"] = Variant(rec->nivl); code = Util::replaceMacro(code, "NIVL", "pydevNIVL"); }
-        else if (macro == "TEVL") { args["pydevTEVL"] = Variant(rec->tevl); code = Util::replaceMacro(code, "TEVL", "pydevTEVL"); }
-        else if (macro == "ELVL") { args["pydevELVL"] = Variant(rec->elvl); code = Util::replaceMacro(code, "ELVL", "pydevELVL"); }
-        else if (macro == "TVVL") { args["pydevTVVL"] = Variant(rec->tvvl); code = Util::replaceMacro(code, "TVVL", "pydevTVVL"); }
-        else if (macro == "TTVL") { args["pydevTTVL"] = Variant(rec->ttvl); code = Util::replaceMacro(code, "TTVL", "pydevTTVL"); }
-        else if (macro == "FTVL") { args["pydevFTVL"] = Variant(rec->ftvl); code = Util::replaceMacro(code, "FTVL", "pydevFTVL"); }
-        else if (macro == "FFVL") { args["pydevFFVL"] = Variant(rec->ffvl); code = Util::replaceMacro(code, "FFVL", "pydevFFVL"); }
-        else if (macro == "ZRST") { args["pydevZRST"] = Variant(rec->zrst); code = Util::replaceMacro(code, "ZRST", "pydevZRST"); }
-        else if (macro == "ONST") { args["pydevONST"] = Variant(rec->onst); code = Util::replaceMacro(code, "ONST", "pydevONST"); }
-        else if (macro == "TWST") { args["pydevTWST"] = Variant(rec->twst); code = Util::replaceMacro(code, "TWST", "pydevTWST"); }
-        else if (macro == "THST") { args["pydevTHST"] = Variant(rec->thst); code = Util::replaceMacro(code, "THST", "pydevTHST"); }
-        else if (macro == "FRST") { args["pydevFRST"] = Variant(rec->frst); code = Util::replaceMacro(code, "FRST", "pydevFRST"); }
-        else if (macro == "FVST") { args["pydevFVST"] = Variant(rec->fvst); code = Util::replaceMacro(code, "FVST", "pydevFVST"); }
-        else if (macro == "SXST") { args["pydevSXST"] = Variant(rec->sxst); code = Util::replaceMacro(code, "SXST", "pydevSXST"); }
-        else if (macro == "SVST") { args["pydevSVST"] = Variant(rec->svst); code = Util::replaceMacro(code, "SVST", "pydevSVST"); }
-        else if (macro == "EIST") { args["pydevEIST"] = Variant(rec->eist); code = Util::replaceMacro(code, "EIST", "pydevEIST"); }
-        else if (macro == "NIST") { args["pydevNIST"] = Variant(rec->nist); code = Util::replaceMacro(code, "NIST", "pydevNIST"); }
-        else if (macro == "TEST") { args["pydevTEST"] = Variant(rec->test); code = Util::replaceMacro(code, "TEST", "pydevTEST"); }
-        else if (macro == "ELST") { args["pydevELST"] = Variant(rec->elst); code = Util::replaceMacro(code, "ELST", "pydevELST"); }
-        else if (macro == "TVST") { args["pydevTVST"] = Variant(rec->tvst); code = Util::replaceMacro(code, "TVST", "pydevTVST"); }
-        else if (macro == "TTST") { args["pydevTTST"] = Variant(rec->ttst); code = Util::replaceMacro(code, "TTST", "pydevTTST"); }
-        else if (macro == "FTST") { args["pydevFTST"] = Variant(rec->ftst); code = Util::replaceMacro(code, "FTST", "pydevFTST"); }
-        else if (macro == "FFST") { args["pydevFFST"] = Variant(rec->ffst); code = Util::replaceMacro(code, "FFST", "pydevFFST"); }
-        else if (macro == "TPRO") { args["pydevTPRO"] = Variant(rec->tpro); code = Util::replaceMacro(code, "TPRO", "pydevTPRO"); }
-    }
-
     try {
-        if (ctx->code != code) {
+        if (ctx->fields.update(rec->out.value.instio.string)) {
             PyWrapper::destroy(std::move(ctx->bytecode));
-            ctx->bytecode = PyWrapper::compile(code, (rec->tpro == 1));
-            ctx->code = code;
         }
-        rec->val = PyWrapper::eval(ctx->bytecode, args, (rec->tpro == 1)).get_long();
-        rec->udf = 0;
+        if (!ctx->bytecode) {
+            ctx->bytecode = PyWrapper::compile(ctx->fields.code, ctx->fields.params, (rec->tpro == 1), rec->name);
+        }
+        ctx->stats.begin(ctx->task);
+        ctx->fields.collect();
+        auto value = PyWrapper::call(ctx->bytecode, ctx->fields.args, (rec->tpro == 1), &ctx->stats.timing, &ctx->awaiter);
+        if (ctx->awaiter.detach()) {
+            // Completed by processAwaited() once asyncio loop has the result
+            return;
+        }
+        setValue(rec, value);
+        ctx->stats.end();
+        ctx->processCbStatus = 0;
+
+    } catch (PyWrapper::TimeoutError& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmTimeout, epicsSevInvalid);
+        ctx->processCbStatus = -1;
+    } catch (std::exception& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmCalc, epicsSevInvalid);
+        ctx->processCbStatus = -1;
+    }
+    // Record run inline in processing thread completes without callback
+    if (rec->pact == 1) {
+        callbackRequestProcessCallback(&ctx->callback, rec->prio, rec);
+    }
+}
+
+/**
+ * Complete record from value pushed with pydev.iointr() without running Python.
+ *
+ * @return false when value must be read by Python code
+ */
+static bool processNative(mbboRecord* rec)
+{
+    auto ctx = reinterpret_cast<PyDevContext*>(rec->dpvt);
+    auto value = ctx->slot->get();
+    if (!value) {
+        return false;
+    }
+    try {
+        setValue(rec, *value);
         ctx->processCbStatus = 0;
+    } catch (std::exception& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmCalc, epicsSevInvalid);
+        ctx->processCbStatus = -1;
+    }
+    return true;
+}
 
+/**
+ * Complete record with result of awaitable returned by Python code.
+ */
+static void processAwaited(mbboRecord* rec)
+{
+    auto ctx = reinterpret_cast<PyDevContext*>(rec->dpvt);
+    try {
+        setValue(rec, ctx->awaiter.result());
+        ctx->stats.end();
+        ctx->processCbStatus = 0;
+    } catch (PyWrapper::TimeoutError& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmTimeout, epicsSevInvalid);
+        ctx->processCbStatus = -1;
     } catch (std::exception& e) {
         if (rec->tpro == 1) {
             printf("[%s] %s\n", rec->name, e.what());
@@ -141,7 +164,6 @@ static void processRecordCb(mbboRecord* rec)
         recGblSetSevr(rec, epicsAlarmCalc, epicsSevInvalid);
         ctx->processCbStatus = -1;
     }
-    callbackRequestProcessCallback(&ctx->callback, rec->prio, rec);
 }
 
 static long processRecord(mbboRecord* rec)
@@ -155,23 +177,45 @@ static long processRecord(mbboRecord* rec)
     }
 
     if (rec->pact == 1) {
+        if (ctx->awaiter.pending()) {
+            processAwaited(rec);
+        }
+        ctx->stats.complete();
         rec->pact = 0;
         return ctx->processCbStatus;
     }
-    rec->pact = 1;
 
-    auto scheduled = AsyncExec::schedule([rec]() {
-        processRecordCb(rec);
-    });
+    if (ctx->slot != nullptr && processNative(rec)) {
+        return ctx->processCbStatus;
+    }
+
+    ctx->task.bind<mbboRecord, processRecordCb>(rec);
+    if (AsyncExec::runInline(ctx->task, ctx->sched)) {
+        if (ctx->awaiter.pending()) {
+            // Awaitable returned by inline code completes asynchronously
+            rec->pact = 1;
+            return 0;
+        }
+        ctx->stats.complete();
+        return ctx->processCbStatus;
+    }
+    rec->pact = 1;
+    auto scheduled = AsyncExec::schedule(ctx->task, ctx->sched);
     return (scheduled ? 0 : -1);
 }
 
+static long reportStats(int level)
+{
+    RecordStats::report("mbbo", level);
+    return 0;
+}
+
 extern "C"
 {
     struct
     {
         long number{5};
-        DEVSUPFUN report{nullptr};
+        DEVSUPFUN report{(DEVSUPFUN)reportStats};
         DEVSUPFUN init{nullptr};
         DEVSUPFUN init_record{(DEVSUPFUN)initRecord};
         DEVSUPFUN get_ioint_info{(DEVSUPFUN)getIointInfo};
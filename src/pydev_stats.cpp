@@ -0,0 +1,316 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+/**
+ * pydevStats device support publishes PyDevice runtime counters through
+ * ai, longin and waveform records. Counters are read from atomics, no
+ * Python code runs and the GIL is never taken, so the records keep
+ * updating even when all workers are stuck.
+ *
+ * INP is "@<metric> [pool]", rates and averages are calculated over the
+ * period between two processings of the record.
+ */
+
+#include <aiRecord.h>
+#include <longinRecord.h>
+#include <waveformRecord.h>
+
+#include <alarm.h>
+#include <cantProceed.h>
+#include <dbAccess.h>
+#include <devSup.h>
+#include <epicsExport.h>
+#include <menuFtype.h>
+#include <recGbl.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "asyncexec.h"
+#include "pywrapper.h"
+
+enum Metric {
+    QUEUE,          // Tasks waiting in queue
+    UTILIZATION,    // Percent of time workers were busy
+    EVALS,          // Python evaluations per second
+    EXCEPTIONS,     // Python exceptions per second
+    GIL_WAIT,       // Average wait for GIL, us
+    GIL_HOLD,       // Average time GIL was held, us
+    IOINTR,         // pydev.iointr() pushes per second
+    HEAP,           // Blocks allocated by Python
+    NUM_METRICS
+};
+
+static const char* metricNames[NUM_METRICS] = {
+    "queue", "utilization", "evals", "exceptions", "gil_wait", "gil_hold", "iointr", "heap"
+};
+
+struct StatsContext {
+    Metric metric;
+    std::string pool;           // Empty for all pools
+    bool perPool;               // One value per pool instead of combined
+    int64_t last;               // Previous processing time, ns, 0 before first one
+    std::vector<uint64_t> prev; // Counters at previous processing
+};
+
+static int64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Parse "@metric [pool]" into new context, print error and return nullptr on failure.
+ */
+static StatsContext* createContext(dbCommon* rec, const char* inp, bool array)
+{
+    std::istringstream ss(inp);
+    std::string name, pool;
+    ss >> name >> pool;
+
+    unsigned metric = 0;
+    while (metric < NUM_METRICS && name != metricNames[metric]) {
+        metric++;
+    }
+    if (metric == NUM_METRICS) {
+        printf("[%s] Unknown pydevStats metric '%s'\n", rec->name, name.c_str());
+        return nullptr;
+    }
+    if (!pool.empty()) {
+        bool found = false;
+        for (auto& stats: AsyncExec::stats()) {
+            found |= (stats.name == pool);
+        }
+        if (!found) {
+            printf("[%s] PyDevice pool '%s' not found\n", rec->name, pool.c_str());
+            return nullptr;
+        }
+    }
+
+    void *buffer = callocMustSucceed(1, sizeof(StatsContext), "pydevStats::initRecord");
+    StatsContext* ctx = new (buffer) StatsContext;
+    ctx->metric = static_cast<Metric>(metric);
+    ctx->pool = pool;
+    ctx->perPool = (array && pool.empty());
+    ctx->last = 0;
+    return ctx;
+}
+
+/**
+ * Return increase of counter since previous processing and remember its
+ * current value. First processing has no previous value and returns 0.
+ */
+static double delta(StatsContext* ctx, size_t index, uint64_t value)
+{
+    if (ctx->prev.size() <= index) {
+        ctx->prev.resize(index + 1, value);
+    }
+    uint64_t diff = value - ctx->prev[index];
+    ctx->prev[index] = value;
+    return static_cast<double>(diff);
+}
+
+/**
+ * Calculate current values of the metric.
+ *
+ * @return false when the value is not known yet
+ */
+static bool evaluate(StatsContext* ctx, std::vector<double>& values)
+{
+    int64_t t = now();
+    double period = (ctx->last > 0 ? (t - ctx->last) * 1e-9 : 0.0);
+    ctx->last = t;
+    values.clear();
+
+    if (ctx->metric == QUEUE || ctx->metric == UTILIZATION) {
+        double depth = 0.0, busy = 0.0;
+        unsigned workers = 0;
+        size_t i = 0;
+        for (auto& pool: AsyncExec::stats()) {
+            if (!ctx->pool.empty() && pool.name != ctx->pool) {
+                continue;
+            }
+            depth += pool.depth;
+            busy += delta(ctx, i++, pool.busyNs);
+            workers += pool.workers;
+            if (ctx->perPool) {
+                double time = period * 1e9 * workers;
+                values.push_back(ctx->metric == QUEUE ? depth : (time > 0.0 ? 100.0 * busy / time : 0.0));
+                depth = busy = 0.0;
+                workers = 0;
+            }
+        }
+        if (!ctx->perPool) {
+            double time = period * 1e9 * workers;
+            values.push_back(ctx->metric == QUEUE ? depth : (time > 0.0 ? 100.0 * busy / time : 0.0));
+        }
+        return true;
+    }
+
+    auto counters = PyWrapper::counters();
+    switch (ctx->metric) {
+        case EVALS:
+        case EXCEPTIONS:
+        case IOINTR:
+        {
+            uint64_t count = (ctx->metric == EVALS ? counters.evals :
+                              ctx->metric == EXCEPTIONS ? counters.exceptions : counters.iointrPushes);
+            double diff = delta(ctx, 0, count);
+            values.push_back(period > 0.0 ? diff / period : 0.0);
+            break;
+        }
+        case GIL_WAIT:
+        case GIL_HOLD:
+        {
+            double count = delta(ctx, 0, counters.gilAcquired);
+            double ns = delta(ctx, 1, (ctx->metric == GIL_WAIT ? counters.gilWaitNs : counters.gilHoldNs));
+            values.push_back(count > 0.0 ? ns / count * 1e-3 : 0.0);
+            break;
+        }
+        case HEAP:
+            if (counters.heapBlocks < 0) {
+                return false;
+            }
+            values.push_back(counters.heapBlocks);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+static long initAi(aiRecord* rec)
+{
+    rec->dpvt = createContext(reinterpret_cast<dbCommon*>(rec), rec->inp.value.instio.string, false);
+    return (rec->dpvt ? 0 : S_dev_badInpType);
+}
+
+static long readAi(aiRecord* rec)
+{
+    auto ctx = reinterpret_cast<StatsContext*>(rec->dpvt);
+    std::vector<double> values;
+    if (ctx == nullptr || !evaluate(ctx, values) || values.empty()) {
+        recGblSetSevr(rec, epicsAlarmUDF, epicsSevInvalid);
+        return 2;
+    }
+    rec->val = values[0];
+    rec->udf = 0;
+    return 2; // Conversion already done
+}
+
+static long initLongin(longinRecord* rec)
+{
+    rec->dpvt = createContext(reinterpret_cast<dbCommon*>(rec), rec->inp.value.instio.string, false);
+    return (rec->dpvt ? 0 : S_dev_badInpType);
+}
+
+static long readLongin(longinRecord* rec)
+{
+    auto ctx = reinterpret_cast<StatsContext*>(rec->dpvt);
+    std::vector<double> values;
+    if (ctx == nullptr || !evaluate(ctx, values) || values.empty()) {
+        recGblSetSevr(rec, epicsAlarmUDF, epicsSevInvalid);
+        return 0;
+    }
+    rec->val = static_cast<epicsInt32>(std::lround(values[0]));
+    rec->udf = 0;
+    return 0;
+}
+
+static long initWaveform(waveformRecord* rec)
+{
+    switch (rec->ftvl) {
+        case menuFtypeCHAR:
+        case menuFtypeUCHAR:
+        case menuFtypeSHORT:
+        case menuFtypeUSHORT:
+        case menuFtypeLONG:
+        case menuFtypeULONG:
+        case menuFtypeFLOAT:
+        case menuFtypeDOUBLE:
+            break;
+        default:
+            printf("[%s] Unsupported FTVL for pydevStats\n", rec->name);
+            return S_dev_badInpType;
+    }
+    rec->dpvt = createContext(reinterpret_cast<dbCommon*>(rec), rec->inp.value.instio.string, true);
+    return (rec->dpvt ? 0 : S_dev_badInpType);
+}
+
+template<typename T>
+static void fill(void* bptr, const std::vector<double>& values, size_t n)
+{
+    T* arr = reinterpret_cast<T*>(bptr);
+    for (size_t i = 0; i < n; i++) {
+        arr[i] = static_cast<T>(values[i]);
+    }
+}
+
+static long readWaveform(waveformRecord* rec)
+{
+    auto ctx = reinterpret_cast<StatsContext*>(rec->dpvt);
+    std::vector<double> values;
+    if (ctx == nullptr || !evaluate(ctx, values)) {
+        recGblSetSevr(rec, epicsAlarmUDF, epicsSevInvalid);
+        return 0;
+    }
+    size_t n = std::min<size_t>(values.size(), rec->nelm);
+    switch (rec->ftvl) {
+        case menuFtypeCHAR:     fill<epicsInt8>(rec->bptr, values, n); break;
+        case menuFtypeUCHAR:    fill<epicsUInt8>(rec->bptr, values, n); break;
+        case menuFtypeSHORT:    fill<epicsInt16>(rec->bptr, values, n); break;
+        case menuFtypeUSHORT:   fill<epicsUInt16>(rec->bptr, values, n); break;
+        case menuFtypeLONG:     fill<epicsInt32>(rec->bptr, values, n); break;
+        case menuFtypeULONG:    fill<epicsUInt32>(rec->bptr, values, n); break;
+        case menuFtypeFLOAT:    fill<epicsFloat32>(rec->bptr, values, n); break;
+        case menuFtypeDOUBLE:   fill<epicsFloat64>(rec->bptr, values, n); break;
+        default:                break;
+    }
+    rec->nord = n;
+    rec->udf = 0;
+    return 0;
+}
+
+extern "C"
+{
+    struct
+    {
+        long number{6};
+        DEVSUPFUN report{nullptr};
+        DEVSUPFUN init{nullptr};
+        DEVSUPFUN init_record{(DEVSUPFUN)initAi};
+        DEVSUPFUN get_ioint_info{nullptr};
+        DEVSUPFUN read{(DEVSUPFUN)readAi};
+        DEVSUPFUN special_linconv{nullptr};
+    } devPyDevStatsAi;
+    epicsExportAddress(dset, devPyDevStatsAi);
+
+    struct
+    {
+        long number{5};
+        DEVSUPFUN report{nullptr};
+        DEVSUPFUN init{nullptr};
+        DEVSUPFUN init_record{(DEVSUPFUN)initLongin};
+        DEVSUPFUN get_ioint_info{nullptr};
+        DEVSUPFUN read{(DEVSUPFUN)readLongin};
+    } devPyDevStatsLongin;
+    epicsExportAddress(dset, devPyDevStatsLongin);
+
+    struct
+    {
+        long number{5};
+        DEVSUPFUN report{nullptr};
+        DEVSUPFUN init{nullptr};
+        DEVSUPFUN init_record{(DEVSUPFUN)initWaveform};
+        DEVSUPFUN get_ioint_info{nullptr};
+        DEVSUPFUN read{(DEVSUPFUN)readWaveform};
+    } devPyDevStatsWaveform;
+    epicsExportAddress(dset, devPyDevStatsWaveform);
+
+}; // extern "C"
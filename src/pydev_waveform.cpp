@@ -14,23 +14,27 @@
 #include <menuFtype.h>
 #include <recGbl.h>
 
-#include <map>
 #include <string.h>
 #include <sstream>
 #include "asyncexec.h"
+#include "fieldbinding.h"
+#include "iointr.h"
 #include "pywrapper.h"
-#include "util.h"
+#include "stats.h"
 
 struct PyDevContext {
     CALLBACK callback;
     IOSCANPVT scan;
+    IoIntr::Slot* slot;
     int processCbStatus;
-    std::string code;
+    FieldBinding fields;
+    AsyncExec::Options sched;
+    AsyncExec::Task task;
     PyWrapper::ByteCode bytecode;
+    PyWrapper::Awaiter awaiter;
+    RecordStats stats;
 };
 
-static std::map<std::string, IOSCANPVT> ioScanPvts;
-
 template <typename T>
 static void toRecArrayVal(waveformRecord* rec, const std::vector<T>& arr)
 {
@@ -71,53 +75,27 @@ static void toRecArrayVal(waveformRecord* rec, const std::vector<T>& arr)
     }
 }
 
-template <>
-void toRecArrayVal<std::string>(waveformRecord* rec, const std::vector<std::string>& arr)
+/**
+ * Print elements of string array that don't fit in MAX_STRING_SIZE.
+ */
+static void printTruncated(waveformRecord* rec, const Variant& value)
 {
-
-    if (!rec->ftvl == menuFtypeSTRING) {
-        throw Variant::ConvertError();
-    }
-
-    rec->nord = std::min(arr.size(), (size_t)rec->nelm);
-    auto val = reinterpret_cast<char*>(rec->bptr);
-
-    for (size_t i = 0; i < rec->nord; ++i) {
-        char *cptr = &val[i * MAX_STRING_SIZE];
-        std::string sval = arr[i];
-        if (rec->tpro) {
-            // need to foresee space for last '\0'
-            if (sval.size() > MAX_STRING_SIZE - 1) {
-                // Indicate on console which element will be truncated where
-                std::stringstream strm;
-                strm << rec->name << "[" << i << "]: '";
-                const std::string info = strm.str();
-                printf("%s%s' too long\n%s^\n", info.c_str(), sval.c_str(),
-                       std::string(info.size() + MAX_STRING_SIZE - 1, ' ').c_str()
-                );
-            }
+    auto arr = value.get_string_array();
+    for (size_t i = 0; i < arr.size() && i < rec->nelm; ++i) {
+        const std::string& sval = arr[i];
+        // need to foresee space for last '\0'
+        if (sval.size() > MAX_STRING_SIZE - 1) {
+            // Indicate on console which element will be truncated where
+            std::stringstream strm;
+            strm << rec->name << "[" << i << "]: '";
+            const std::string info = strm.str();
+            printf("%s%s' too long\n%s^\n", info.c_str(), sval.c_str(),
+                   std::string(info.size() + MAX_STRING_SIZE - 1, ' ').c_str()
+            );
         }
-        std::string cval = sval.substr(0, MAX_STRING_SIZE - 1);
-        std::copy(cval.begin(), cval.end(), cptr);
-        cptr[MAX_STRING_SIZE - 1] = '\0'; /* sentinel */
     }
 }
 
-static void scanCallback(IOSCANPVT scan)
-{
-#ifdef VERSION_INT
-#  if EPICS_VERSION_INT < VERSION_INT(3,16,0,0)
-    scanIoRequest(scan);
-#  else
-    scanIoImmediate(scan, priorityHigh);
-    scanIoImmediate(scan, priorityMedium);
-    scanIoImmediate(scan, priorityLow);
-#  endif
-#else
-    scanIoRequest(scan);
-#endif
-}
-
 static long initRecord(waveformRecord* rec)
 {
     std::string addr = rec->inp.value.instio.string;
@@ -125,20 +103,18 @@ static long initRecord(waveformRecord* rec)
     PyDevContext* ctx = new (buffer) PyDevContext;
     rec->dpvt = ctx;
 
-    // This could be better checked with regex
-    if (addr.find("pydev.iointr('") == 0 && addr.substr(addr.size()-2) == "')") {
-        std::string param = addr.substr(14, addr.size()-16);
-        auto it = ioScanPvts.find(param);
-        if (it == ioScanPvts.end()) {
-            scanIoInit( &ioScanPvts[param] );
-            PyWrapper::Callback cb = std::bind(scanCallback, ioScanPvts[param]);
-            PyWrapper::registerIoIntr(param, cb);
-            it = ioScanPvts.find(param);
-        }
-        ctx->scan = it->second;
-    } else {
-        ctx->scan = nullptr;
-    }
+    ctx->fields.init(reinterpret_cast<dbCommon*>(rec), {"VAL", "TPRO"}, {{"VAL", &rec->nord}});
+    ctx->fields.update(rec->inp.value.instio.string);
+    ctx->sched = AsyncExec::options(reinterpret_cast<dbCommon*>(rec));
+    ctx->awaiter.timeout = ctx->sched.timeout;
+    ctx->awaiter.done = [ctx, rec]() { callbackRequestProcessCallback(&ctx->callback, rec->prio, rec); };
+    ctx->stats.init(reinterpret_cast<dbCommon*>(rec), "waveform");
+
+    std::string param;
+    bool iointr = IoIntr::parse(addr, param);
+    ctx->scan = (iointr ? IoIntr::scanList(param) : nullptr);
+    // Records in main interpreter read pushed values without running Python
+    ctx->slot = (iointr && ctx->sched.worker < 0 ? IoIntr::slot(param) : nullptr);
 
     return 0;
 }
@@ -152,81 +128,115 @@ static long getIointInfo(int /*direction*/, waveformRecord *rec, IOSCANPVT* io)
     return 0;
 }
 
-
-std::string arrayOfStrToStr(const std::vector<std::string>& val)
+/**
+ * Assign value returned by Python code or pushed with pydev.iointr().
+ */
+static void setValue(waveformRecord* rec, const Variant& value)
 {
-    std::string value = "[";
-    for (const auto& v: val) {
-        value += "b\"" +  Util::escape(v) + "\",";
-    }
-    if (value.back() == ',') {
-        value.back() = ']';
+    Variant::Array arr;
+    Variant::ElementType type;
+    if (value.try_get(arr) && FieldBinding::elementType(rec->ftvl, type)) {
+        // Numeric results, incl. numpy.ndarray, are copied in a single pass
+        rec->nord = arr.copy(rec->bptr, type, rec->nelm);
+    } else if (rec->ftvl == menuFtypeFLOAT || rec->ftvl == menuFtypeDOUBLE) {
+        std::vector<double> arr = value.get_double_array();
+        toRecArrayVal(rec, arr);
+    } else if (rec->ftvl == menuFtypeSTRING) {
+        if (rec->tpro) {
+            printTruncated(rec, value);
+        }
+        // Strings are truncated in place, without copying the array first
+        rec->nord = value.copy_strings(reinterpret_cast<char*>(rec->bptr), MAX_STRING_SIZE, rec->nelm);
     } else {
-        value += "]";
+        std::vector<long long int> arr = value.get_long_array();
+        toRecArrayVal(rec, arr);
     }
-    return value;
+
+    rec->udf = 0;
 }
 
 static void processRecordCb(waveformRecord* rec)
 {
     auto ctx = reinterpret_cast<PyDevContext*>(rec->dpvt);
 
-    std::string code = rec->inp.value.instio.string;
-    std::map<std::string, Variant> args;
-    for (auto& macro: Util::getMacros(code)) {
-        if (macro == "VAL")  {
-            std::vector<long long int> vl;
-            std::vector<double> vd;
-            std::vector<std::string> vs;
-            if      (rec->ftvl == menuFtypeCHAR)   { auto a = reinterpret_cast<epicsInt8*>(rec->bptr);    vl.assign(a, a+rec->nelm); }
-            else if (rec->ftvl == menuFtypeUCHAR)  { auto a = reinterpret_cast<epicsUInt8*>(rec->bptr);   vl.assign(a, a+rec->nelm); }
-            else if (rec->ftvl == menuFtypeSHORT)  { auto a = reinterpret_cast<epicsInt16*>(rec->bptr);   vl.assign(a, a+rec->nelm); }
-            else if (rec->ftvl == menuFtypeUSHORT) { auto a = reinterpret_cast<epicsUInt16*>(rec->bptr);  vl.assign(a, a+rec->nelm); }
-            else if (rec->ftvl == menuFtypeLONG)   { auto a = reinterpret_cast<epicsInt32*>(rec->bptr);   vl.assign(a, a+rec->nelm); }
-            else if (rec->ftvl == menuFtypeULONG)  { auto a = reinterpret_cast<epicsUInt32*>(rec->bptr);  vl.assign(a, a+rec->nelm); }
-            else if (rec->ftvl == menuFtypeFLOAT)  { auto a = reinterpret_cast<epicsFloat32*>(rec->bptr); vd.assign(a, a+rec->nelm); }
-            else if (rec->ftvl == menuFtypeDOUBLE) { auto a = reinterpret_cast<epicsFloat64*>(rec->bptr); vd.assign(a, a+rec->nelm); }
-            else if (rec->ftvl == menuFtypeSTRING) {
-                vs.resize(rec->nord);
-                auto a = reinterpret_cast<char*>(rec->bptr);
-                for(size_t i=0; i<rec->nord; ++i){
-                    const char *cptr = &a[i * MAX_STRING_SIZE];
-                    vs[i] = std::string(cptr, 0, MAX_STRING_SIZE);
-                }
-            }
-
-            if (!vl.empty()) args["pydevVAL"] = Variant(vl);
-            if (!vd.empty()) args["pydevVAL"] = Variant(vd);
-            if (!vs.empty()) args["pydevVAL"] = Variant(vs);
-            code = Util::replaceMacro(code, "VAL", "pydevVAL");
-        } else if (macro == "TPRO") {
-            args["pydevTPRO"] = Variant(rec->tpro);
-            code = Util::replaceMacro(code, "TPRO", "pydevTPRO");
-        }
-    }
-
     try {
-        if (ctx->code != code) {
+        if (ctx->fields.update(rec->inp.value.instio.string)) {
             PyWrapper::destroy(std::move(ctx->bytecode));
-            ctx->bytecode = PyWrapper::compile(code, (rec->tpro == 1));
-            ctx->code = code;
         }
-        auto val = PyWrapper::eval(ctx->bytecode, args, (rec->tpro == 1));
+        if (!ctx->bytecode) {
+            ctx->bytecode = PyWrapper::compile(ctx->fields.code, ctx->fields.params, (rec->tpro == 1), rec->name);
+        }
+        ctx->stats.begin(ctx->task);
+        ctx->fields.collect();
+        auto value = PyWrapper::call(ctx->bytecode, ctx->fields.args, (rec->tpro == 1), &ctx->stats.timing, &ctx->awaiter);
+        if (ctx->awaiter.detach()) {
+            // Completed by processAwaited() once asyncio loop has the result
+            return;
+        }
+        setValue(rec, value);
+        ctx->stats.end();
+        ctx->processCbStatus = 0;
 
-        if (rec->ftvl == menuFtypeFLOAT || rec->ftvl == menuFtypeDOUBLE) {
-            std::vector<double> arr = val.get_double_array();
-            toRecArrayVal(rec, arr);
-        } else if (rec->ftvl == menuFtypeSTRING) {
-            std::vector<std::string> arr = val.get_string_array();
-            toRecArrayVal(rec, arr);
-        } else {
-            std::vector<long long int> arr = val.get_long_array();
-            toRecArrayVal(rec, arr);
+    } catch (PyWrapper::TimeoutError& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
         }
+        recGblSetSevr(rec, epicsAlarmTimeout, epicsSevInvalid);
+        ctx->processCbStatus = -1;
+    } catch (std::exception& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmCalc, epicsSevInvalid);
+        ctx->processCbStatus = -1;
+    }
+    // Record run inline in processing thread completes without callback
+    if (rec->pact == 1) {
+        callbackRequestProcessCallback(&ctx->callback, rec->prio, rec);
+    }
+}
 
-        rec->udf = 0;
+/**
+ * Complete record from value pushed with pydev.iointr() without running Python.
+ *
+ * @return false when value must be read by Python code
+ */
+static bool processNative(waveformRecord* rec)
+{
+    auto ctx = reinterpret_cast<PyDevContext*>(rec->dpvt);
+    auto value = ctx->slot->get();
+    if (!value) {
+        return false;
+    }
+    try {
+        setValue(rec, *value);
         ctx->processCbStatus = 0;
+    } catch (std::exception& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmCalc, epicsSevInvalid);
+        ctx->processCbStatus = -1;
+    }
+    return true;
+}
 
+/**
+ * Complete record with result of awaitable returned by Python code.
+ */
+static void processAwaited(waveformRecord* rec)
+{
+    auto ctx = reinterpret_cast<PyDevContext*>(rec->dpvt);
+    try {
+        setValue(rec, ctx->awaiter.result());
+        ctx->stats.end();
+        ctx->processCbStatus = 0;
+    } catch (PyWrapper::TimeoutError& e) {
+        if (rec->tpro == 1) {
+            printf("[%s] %s\n", rec->name, e.what());
+        }
+        recGblSetSevr(rec, epicsAlarmTimeout, epicsSevInvalid);
+        ctx->processCbStatus = -1;
     } catch (std::exception& e) {
         if (rec->tpro == 1) {
             printf("[%s] %s\n", rec->name, e.what());
@@ -234,7 +244,6 @@ static void processRecordCb(waveformRecord* rec)
         recGblSetSevr(rec, epicsAlarmCalc, epicsSevInvalid);
         ctx->processCbStatus = -1;
     }
-    callbackRequestProcessCallback(&ctx->callback, rec->prio, rec);
 }
 
 static long processRecord(waveformRecord* rec)
@@ -248,23 +257,45 @@ static long processRecord(waveformRecord* rec)
     }
 
     if (rec->pact == 1) {
+        if (ctx->awaiter.pending()) {
+            processAwaited(rec);
+        }
+        ctx->stats.complete();
         rec->pact = 0;
         return ctx->processCbStatus;
     }
-    rec->pact = 1;
 
-    auto scheduled = AsyncExec::schedule([rec]() {
-        processRecordCb(rec);
-    });
+    if (ctx->slot != nullptr && processNative(rec)) {
+        return ctx->processCbStatus;
+    }
+
+    ctx->task.bind<waveformRecord, processRecordCb>(rec);
+    if (AsyncExec::runInline(ctx->task, ctx->sched)) {
+        if (ctx->awaiter.pending()) {
+            // Awaitable returned by inline code completes asynchronously
+            rec->pact = 1;
+            return 0;
+        }
+        ctx->stats.complete();
+        return ctx->processCbStatus;
+    }
+    rec->pact = 1;
+    auto scheduled = AsyncExec::schedule(ctx->task, ctx->sched);
     return (scheduled ? 0 : -1);
 }
 
+static long reportStats(int level)
+{
+    RecordStats::report("waveform", level);
+    return 0;
+}
+
 extern "C"
 {
     struct
     {
         long number{5};
-        DEVSUPFUN report{nullptr};
+        DEVSUPFUN report{(DEVSUPFUN)reportStats};
         DEVSUPFUN init{nullptr};
         DEVSUPFUN init_record{(DEVSUPFUN)initRecord};
         DEVSUPFUN get_ioint_info{(DEVSUPFUN)getIointInfo};
@@ -0,0 +1,275 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+/**
+ * Shared memory ring buffer for pushing I/O Intr parameter values from
+ * external processes into the IOC.
+ *
+ * The ring is created by the IOC with the pydevRing iocsh command and
+ * drained by a native IOC thread. Writers map the same shared memory
+ * object and append messages, each carrying a parameter name and its
+ * new value. This header has no dependencies and can be used from C
+ * and C++ writers; python/pydevring.py implements the same protocol.
+ *
+ * Layout: a header of PYDEV_RING_DATA bytes is followed by the data area
+ * of 'size' bytes, size is a power of two. Read and write positions only
+ * ever increase, their offset in the data area is position & (size-1).
+ * Messages are 8 byte aligned and never wrap, writer fills the rest of
+ * the data area with a padding message when the next message doesn't
+ * fit.
+ *
+ * Protocol: writer reserves space by advancing tail, copies the message
+ * and finally stores the message size, which publishes the message.
+ * Reader processes messages at head in order, stops at the first one
+ * with size still 0, clears the processed bytes and advances head.
+ * C writers reserve space with compare-and-swap, so any number of them
+ * can share a ring. Writers that can't do atomic operations, like the
+ * Python client, must be the only writer of a ring or serialize among
+ * themselves with a lock.
+ *
+ * Reader doesn't trust shared memory, it keeps its own copy of size and
+ * head and checks every message size before touching the message. A
+ * size that is not aligned or runs past the end of the data area marks
+ * the ring corrupt and the reader stops. A writer that dies between
+ * reserving space and publishing the size stalls the ring for good,
+ * messages after it are never read and the ring has to be recreated.
+ */
+
+#ifndef PYDEVRING_H
+#define PYDEVRING_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PYDEV_RING_MAGIC    0x50594452u /* "PYDR" */
+#define PYDEV_RING_VERSION  1u
+#define PYDEV_RING_DATA     192u        /* Offset of data area */
+#define PYDEV_RING_NAME_MAX 255u        /* Longest parameter name */
+
+/* Message types */
+#define PYDEV_RING_PAD      0u          /* Unused space until end of data area */
+#define PYDEV_RING_DOUBLE   1u          /* One double */
+#define PYDEV_RING_INT64    2u          /* One int64_t */
+#define PYDEV_RING_STRING   3u          /* count bytes of UTF-8, not terminated */
+#define PYDEV_RING_ARRAY    4u          /* count elements of elem_type */
+
+/* Array element types */
+#define PYDEV_RING_INT8     0u
+#define PYDEV_RING_UINT8    1u
+#define PYDEV_RING_INT16    2u
+#define PYDEV_RING_UINT16   3u
+#define PYDEV_RING_INT32    4u
+#define PYDEV_RING_UINT32   5u
+#define PYDEV_RING_INT64_T  6u
+#define PYDEV_RING_UINT64   7u
+#define PYDEV_RING_FLOAT    8u
+#define PYDEV_RING_DOUBLE_T 9u
+
+/* Shared memory header, positions are on separate cache lines */
+typedef struct pydev_ring_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;          /* Bytes in data area */
+    uint64_t dropped;       /* Messages rejected because ring was full */
+    uint64_t pad0[5];
+    uint64_t tail;          /* Next position to reserve, written by writers */
+    uint64_t pad1[7];
+    uint64_t head;          /* Next position to read, written by reader */
+    uint64_t pad2[7];
+} pydev_ring_header;
+
+/* Message header, followed by name padded to 8 bytes and value */
+typedef struct pydev_ring_msg {
+    uint32_t size;          /* Total message bytes, stored last */
+    uint16_t type;          /* PYDEV_RING_* message type */
+    uint8_t elem_type;      /* PYDEV_RING_* element type of arrays */
+    uint8_t name_len;       /* Bytes of parameter name */
+    uint32_t count;         /* Elements of array, bytes of string */
+    uint32_t reserved;
+} pydev_ring_msg;
+
+static inline uint32_t pydev_ring_align(uint64_t n)
+{
+    return (uint32_t)((n + 7u) & ~(uint64_t)7u);
+}
+
+static inline uint32_t pydev_ring_itemsize(uint8_t elem_type)
+{
+    static const uint32_t sizes[] = { 1, 1, 2, 2, 4, 4, 8, 8, 4, 8 };
+    return (elem_type < sizeof(sizes)/sizeof(sizes[0]) ? sizes[elem_type] : 0);
+}
+
+static inline uint8_t* pydev_ring_data(pydev_ring_header* ring)
+{
+    return (uint8_t*)ring + PYDEV_RING_DATA;
+}
+
+static inline const char* pydev_ring_msg_name(const pydev_ring_msg* msg)
+{
+    return (const char*)(msg + 1);
+}
+
+static inline const void* pydev_ring_msg_value(const pydev_ring_msg* msg)
+{
+    return (const uint8_t*)(msg + 1) + pydev_ring_align(msg->name_len);
+}
+
+/**
+ * Initialize ring in zeroed memory of PYDEV_RING_DATA + size bytes,
+ * size must be a power of two.
+ */
+static inline void pydev_ring_init(pydev_ring_header* ring, uint64_t size)
+{
+    ring->version = PYDEV_RING_VERSION;
+    ring->size = size;
+    ring->dropped = 0;
+    ring->tail = 0;
+    ring->head = 0;
+    __atomic_store_n(&ring->magic, PYDEV_RING_MAGIC, __ATOMIC_RELEASE);
+}
+
+/**
+ * Check that memory contains a ring compatible with this header.
+ */
+static inline int pydev_ring_valid(pydev_ring_header* ring)
+{
+    return (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) == PYDEV_RING_MAGIC &&
+            ring->version == PYDEV_RING_VERSION &&
+            ring->size >= 64 && (ring->size & (ring->size - 1)) == 0);
+}
+
+/**
+ * Append a message, safe to call from concurrent writers.
+ *
+ * @param type PYDEV_RING_DOUBLE, PYDEV_RING_INT64, PYDEV_RING_STRING or PYDEV_RING_ARRAY
+ * @param elem_type Element type of arrays, ignored otherwise
+ * @param value Value, count elements for arrays and count bytes for strings
+ * @return 0 on success, -1 when ring is full or message invalid
+ */
+static inline int pydev_ring_write(pydev_ring_header* ring, const char* name, uint16_t type, uint8_t elem_type, const void* value, uint32_t count)
+{
+    size_t name_len = strlen(name);
+    uint64_t value_len;
+    switch (type) {
+        case PYDEV_RING_DOUBLE: value_len = sizeof(double);  count = 1; break;
+        case PYDEV_RING_INT64:  value_len = sizeof(int64_t); count = 1; break;
+        case PYDEV_RING_STRING: value_len = count; break;
+        case PYDEV_RING_ARRAY:  value_len = (uint64_t)count * pydev_ring_itemsize(elem_type); break;
+        default:                return -1;
+    }
+    uint64_t need = sizeof(pydev_ring_msg) + pydev_ring_align(name_len) + pydev_ring_align(value_len);
+    uint64_t size = ring->size;
+    if (name_len == 0 || name_len > PYDEV_RING_NAME_MAX || (type == PYDEV_RING_ARRAY && value_len == 0 && count > 0) ||
+        need > size / 2 || need > UINT32_MAX) {
+        return -1;
+    }
+
+    uint64_t tail, pad;
+    do {
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t offset = tail & (size - 1);
+        pad = (offset + need > size ? size - offset : 0);
+        if (tail + pad + need - head > size) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&ring->tail, &tail, tail + pad + need, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    uint8_t* data = pydev_ring_data(ring);
+    if (pad > 0) {
+        pydev_ring_msg* padding = (pydev_ring_msg*)(data + (tail & (size - 1)));
+        padding->type = PYDEV_RING_PAD;
+        __atomic_store_n(&padding->size, (uint32_t)pad, __ATOMIC_RELEASE);
+    }
+
+    pydev_ring_msg* msg = (pydev_ring_msg*)(data + ((tail + pad) & (size - 1)));
+    msg->type = type;
+    msg->elem_type = elem_type;
+    msg->name_len = (uint8_t)name_len;
+    msg->count = count;
+    msg->reserved = 0;
+    memcpy(msg + 1, name, name_len);
+    memcpy((uint8_t*)(msg + 1) + pydev_ring_align(name_len), value, value_len);
+    __atomic_store_n(&msg->size, (uint32_t)need, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Reader state, kept in reader's private memory */
+typedef struct pydev_ring_reader {
+    pydev_ring_header* ring;
+    uint64_t size;          /* Bytes in data area when attached */
+    uint64_t head;          /* Next position to read */
+    uint32_t len;           /* Checked size of message returned by peek */
+    int corrupt;            /* Set when a message had invalid size */
+} pydev_ring_reader;
+
+/**
+ * Attach reader to a valid ring, see pydev_ring_valid().
+ */
+static inline void pydev_ring_reader_init(pydev_ring_reader* reader, pydev_ring_header* ring)
+{
+    reader->ring = ring;
+    reader->size = ring->size;
+    reader->head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    reader->len = 0;
+    reader->corrupt = 0;
+}
+
+/**
+ * Release message returned by pydev_ring_peek(), its space is cleared
+ * and made available to writers.
+ */
+static inline void pydev_ring_release(pydev_ring_reader* reader, const pydev_ring_msg* msg)
+{
+    memset((void*)msg, 0, reader->len);
+    reader->head += reader->len;
+    reader->len = 0;
+    __atomic_store_n(&reader->ring->head, reader->head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Get oldest published message, only called by the reader.
+ *
+ * Padding is skipped. Returned message must be released with
+ * pydev_ring_release() before next call. Only reader->len bytes of the
+ * message may be read, other fields may change under the reader's feet.
+ *
+ * @return Message or NULL when none is published or ring is corrupt
+ */
+static inline const pydev_ring_msg* pydev_ring_peek(pydev_ring_reader* reader)
+{
+    uint64_t size = reader->size;
+    while (!reader->corrupt) {
+        uint64_t offset = reader->head & (size - 1);
+        pydev_ring_msg* msg = (pydev_ring_msg*)(pydev_ring_data(reader->ring) + offset);
+        uint32_t len = __atomic_load_n(&msg->size, __ATOMIC_ACQUIRE);
+        if (len == 0) {
+            return NULL;
+        }
+        uint16_t type = msg->type;
+        /* Padding may be shorter than message header, but not than size and type */
+        if ((len & 7u) != 0 || len > size - offset || (type != PYDEV_RING_PAD && len < sizeof(pydev_ring_msg))) {
+            reader->corrupt = 1;
+            return NULL;
+        }
+        reader->len = len;
+        if (type != PYDEV_RING_PAD) {
+            return msg;
+        }
+        pydev_ring_release(reader, msg);
+    }
+    return NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PYDEVRING_H */
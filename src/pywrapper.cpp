@@ -4,38 +4,472 @@
 \*************************************************************************/
 
 #include "pywrapper.h"
+#include "profiler.h"
 #include "util.h"
 
 #include <Python.h>
+#include <pythread.h>
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <map>
+#include <mutex>
+#include <unordered_map>
 #include <stdexcept>
 #include <iostream>
 
+/**
+ * Sub-interpreter bound to a single thread.
+ *
+ * Sub-interpreter with its own GIL can not use PyGILState API, thread
+ * state is swapped in and out explicitly instead. Nesting depth allows
+ * PyWrapper functions to be called within a Session.
+ */
+struct Interpreter
+{
+    unsigned index;             // 0 is main interpreter
+    PyThreadState* tstate;
+    PyObject* globDict;
+    unsigned depth;
+};
+
 static PyObject* globDict = nullptr;
-static PyObject* locDict = nullptr;
 static PyThreadState* mainThread = nullptr;
-static std::map<std::string, std::pair<PyWrapper::Callback, PyObject*>> params;
+static std::atomic<unsigned> numInterpreters{1};
+static thread_local Interpreter* interpreter = nullptr;
+
+/**
+ * Callback of a record type registered for I/O Intr parameter.
+ *
+ * Callbacks are only ever prepended to the list while holding ParamsLock,
+ * pushing values walks the list without any lock.
+ */
+struct IoIntrCallback {
+    PyWrapper::Callback callback;
+    IoIntrCallback* next;
+};
+
+struct IoIntrValueCallback {
+    PyWrapper::ValueCallback callback;
+    IoIntrValueCallback* next;
+};
+
+/**
+ * I/O Intr parameter. Entries are never removed, handles returned by
+ * pydev.iointr_handle() point to them directly.
+ */
+struct IoIntrParam {
+    std::string name;
+    std::atomic<IoIntrCallback*> callbacks{nullptr};
+    std::atomic<IoIntrValueCallback*> valueCallbacks{nullptr};
+    std::vector<PyObject*> values;  // Cached value per interpreter, guarded by ParamsLock
+    PyWrapper::IoIntrValue pushed;  // Native push not yet converted for main interpreter, guarded by ParamsLock
+    uint64_t generation{0};         // Incremented on every push, guarded by ParamsLock
+};
+
+/**
+ * Parameter name that doesn't own its characters, lookups are done with
+ * the UTF-8 buffer of Python string without copying it.
+ */
+struct NameKey {
+    const char* data;
+    size_t size;
+
+    bool operator==(const NameKey& o) const
+    {
+        return (size == o.size && memcmp(data, o.data, size) == 0);
+    }
+};
+
+struct NameHash {
+    size_t operator()(const NameKey& key) const
+    {
+        // FNV-1a
+        uint64_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < key.size; i++) {
+            hash = (hash ^ static_cast<unsigned char>(key.data[i])) * 1099511628211ULL;
+        }
+        return static_cast<size_t>(hash);
+    }
+};
+
+// I/O Intr parameters, keys point to names owned by entries. Cached values
+// are separate for each interpreter since Python objects can't be shared
+// between interpreters.
+static std::unordered_map<NameKey, IoIntrParam*, NameHash> params;
+
+/**
+ * Lock protecting params, GIL is not enough with sub-interpreters or
+ * free-threaded Python. Free-threaded build uses PyMutex which detaches
+ * thread state while waiting and so can't block stop-the-world GC.
+ * No Python code must run while lock is held.
+ */
+class ParamsLock
+{
+    private:
+#ifdef Py_GIL_DISABLED
+        static PyMutex mutex;
+#else
+        static std::mutex mutex;
+#endif
+        bool locked;
+
+    public:
+        ParamsLock() : locked(true) {
+#ifdef Py_GIL_DISABLED
+            PyMutex_Lock(&mutex);
+#else
+            mutex.lock();
+#endif
+        }
+        ~ParamsLock() {
+            unlock();
+        }
+        void lock() {
+            if (!locked) {
+#ifdef Py_GIL_DISABLED
+                PyMutex_Lock(&mutex);
+#else
+                mutex.lock();
+#endif
+                locked = true;
+            }
+        }
+        void unlock() {
+            if (locked) {
+                locked = false;
+#ifdef Py_GIL_DISABLED
+                PyMutex_Unlock(&mutex);
+#else
+                mutex.unlock();
+#endif
+            }
+        }
+};
+#ifdef Py_GIL_DISABLED
+PyMutex ParamsLock::mutex = {0};
+#else
+std::mutex ParamsLock::mutex;
+#endif
+
+// Number of threads holding or waiting for the main interpreter GIL
+// through PyGIL, and nesting depth of PyGIL in calling thread
+static std::atomic<unsigned> gilUsers{0};
+static thread_local unsigned gilDepth = 0;
+
+// Runtime counters, see PyWrapper::counters()
+static std::atomic<uint64_t> numEvals{0};
+static std::atomic<uint64_t> numExceptions{0};
+static std::atomic<uint64_t> numIointrPushes{0};
+static std::atomic<uint64_t> gilAcquired{0};
+static std::atomic<uint64_t> gilWaitNs{0};
+static std::atomic<uint64_t> gilHoldNs{0};
+static std::atomic<int64_t> heapBlocks{-1};
+static std::atomic<int64_t> nextHeapSample{0};
+
+/**
+ * Steady clock timestamp in ns, for PyWrapper::Timing.
+ */
+static int64_t clockNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Update number of blocks allocated by Python, at most once a second.
+ *
+ * Allocator statistics can only be read with the GIL held, so they're
+ * sampled by whichever thread is about to release the main interpreter.
+ */
+static void sampleHeap(int64_t now)
+{
+    int64_t next = nextHeapSample.load(std::memory_order_relaxed);
+    if (now < next || !nextHeapSample.compare_exchange_strong(next, now + 1000000000)) {
+        return;
+    }
+    PyObject *type, *value, *traceback;
+    PyErr_Fetch(&type, &value, &traceback);
+    PyObject* func = PySys_GetObject(const_cast<char*>("getallocatedblocks"));
+    if (func != nullptr) {
+        PyObject* blocks = PyObject_CallObject(func, nullptr);
+        if (blocks != nullptr) {
+            heapBlocks = PyLong_AsLongLong(blocks);
+            Py_DECREF(blocks);
+        }
+    }
+    PyErr_Clear();
+    PyErr_Restore(type, value, traceback);
+}
 
 struct PyGIL
 {
     PyGILState_STATE state;
-    PyGIL() {
-        state = PyGILState_Ensure();
+    Interpreter* interp;
+    int64_t acquired;   // When outermost PyGIL got the GIL, 0 when nested
+    explicit PyGIL(bool claimed = false) : interp(interpreter), acquired(0) {
+        if (interp == nullptr) {
+            bool outer = (gilDepth++ == 0);
+            if (outer && !claimed) {
+                gilUsers++;
+            }
+            int64_t waiting = (outer ? clockNs() : 0);
+            state = PyGILState_Ensure();
+            if (outer) {
+                account(waiting);
+            }
+        } else if (interp->depth++ == 0) {
+            int64_t waiting = clockNs();
+            PyEval_RestoreThread(interp->tstate);
+            account(waiting);
+        }
     }
     ~PyGIL() {
-        PyGILState_Release(state);
+        if (acquired != 0) {
+            int64_t now = clockNs();
+            // Sub-interpreters have their own allocator on Python 3.12+,
+            // only main interpreter is sampled to keep the metric steady
+            if (interp == nullptr) {
+                sampleHeap(now);
+            }
+            gilHoldNs.fetch_add(now - acquired, std::memory_order_relaxed);
+        }
+        if (interp == nullptr) {
+            PyGILState_Release(state);
+            if (--gilDepth == 0) {
+                gilUsers--;
+            }
+        } else if (--interp->depth == 0) {
+            interp->tstate = PyEval_SaveThread();
+        }
+    }
+
+    void account(int64_t waiting) {
+        acquired = clockNs();
+        gilAcquired.fetch_add(1, std::memory_order_relaxed);
+        gilWaitNs.fetch_add(acquired - waiting, std::memory_order_relaxed);
+        Profiler::attach();
+    }
+
+    /**
+     * Check whether calling thread holds the GIL, same as
+     * PyGILState_Check() which always succeeds once any sub-interpreter
+     * has been created. Before Python 3.12 current thread state belongs
+     * to whichever thread holds the GIL, so it must be compared with
+     * thread state of the calling thread.
+     */
+    static bool attached() {
+        PyThreadState* own = PyGILState_GetThisThreadState();
+#if PY_MAJOR_VERSION < 3
+        PyThreadState* current = _PyThreadState_Current;
+#elif PY_VERSION_HEX >= 0x030D0000
+        PyThreadState* current = PyThreadState_GetUnchecked();
+#elif PY_VERSION_HEX >= 0x03050200
+        PyThreadState* current = _PyThreadState_UncheckedGet();
+#else
+        PyThreadState* current = (PyGILState_Check() ? own : nullptr);
+#endif
+        return (own != nullptr && own == current);
+    }
+
+    /**
+     * Check whether calling thread can take the main interpreter GIL
+     * without waiting for other PyDevice threads.
+     *
+     * Python threads started by user code are not accounted for. They
+     * release the GIL at the next switch interval and while pydev.iointr()
+     * notifies records, so scan threads never wait for them while those
+     * threads wait for dbScanLock.
+     *
+     * @param claimed Set when this thread has been counted as GIL user,
+     *                must be passed to PyGIL constructor
+     */
+    static bool available(bool& claimed) {
+        claimed = false;
+        if (interpreter != nullptr) {
+            return false;
+        }
+#ifdef Py_GIL_DISABLED
+        return true;
+#else
+        if (gilDepth > 0 || attached()) {
+            // Already held by this thread, unless released by PyUnlock
+            return attached();
+        }
+        unsigned expected = 0;
+        claimed = gilUsers.compare_exchange_strong(expected, 1);
+        return claimed;
+#endif
     }
 };
 
+/**
+ * Release the GIL held by calling thread for the scope, PyGIL in the
+ * scope takes it again like in any other thread.
+ */
+struct PyUnlock
+{
+    PyThreadState* tstate;
+    unsigned depth;
+    PyUnlock() : depth(0) {
+        if (interpreter != nullptr) {
+            depth = interpreter->depth;
+            interpreter->depth = 0;
+        }
+        tstate = PyEval_SaveThread();
+    }
+    ~PyUnlock() {
+        PyEval_RestoreThread(tstate);
+        if (interpreter != nullptr) {
+            interpreter->depth = depth;
+        }
+    }
+};
+
+/**
+ * Return global namespace of the interpreter bound to the calling thread.
+ */
+static PyObject* globals()
+{
+    return (interpreter ? interpreter->globDict : globDict);
+}
+
+/**
+ * Create read-only memoryview of native array.
+ *
+ * Memoryview references array memory directly, no elements are copied.
+ * Python 2 memoryview keeps pointers to the Py_buffer members instead of
+ * copying them, so a list is created instead.
+ */
+static PyObject* toMemoryView(const Variant& val)
+{
+    const Variant::Array& arr = val.get_array();
+#if PY_MAJOR_VERSION < 3
+    PyObject* list = PyList_New(0);
+    if (arr.type == Variant::ElementType::FLOAT || arr.type == Variant::ElementType::DOUBLE) {
+        for (auto& v: val.get_double_array()) {
+            PyObject* element = PyFloat_FromDouble(v);
+            PyList_Append(list, element);
+            Py_DECREF(element);
+        }
+    } else {
+        for (auto& v: val.get_long_array()) {
+            PyObject* element = PyLong_FromLongLong(v);
+            PyList_Append(list, element);
+            Py_DECREF(element);
+        }
+    }
+    return list;
+#else
+    static char empty[1];
+    const char* format;
+    switch (arr.type) {
+    case Variant::ElementType::INT8:   format = "b"; break;
+    case Variant::ElementType::UINT8:  format = "B"; break;
+    case Variant::ElementType::INT16:  format = "h"; break;
+    case Variant::ElementType::UINT16: format = "H"; break;
+    case Variant::ElementType::INT32:  format = "i"; break;
+    case Variant::ElementType::UINT32: format = "I"; break;
+    case Variant::ElementType::INT64:  format = "q"; break;
+    case Variant::ElementType::UINT64: format = "Q"; break;
+    case Variant::ElementType::FLOAT:  format = "f"; break;
+    case Variant::ElementType::DOUBLE: format = "d"; break;
+    default:                           return nullptr;
+    }
+
+    // Shape and strides are copied by memoryview, format must be static
+    Py_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.buf      = (arr.data != nullptr ? const_cast<void*>(arr.data) : empty);
+    buf.itemsize = arr.itemsize();
+    buf.len      = arr.count * buf.itemsize;
+    buf.readonly = 1;
+    buf.ndim     = 1;
+    buf.format   = const_cast<char*>(format);
+    return PyMemoryView_FromBuffer(&buf);
+#endif
+}
+
+/**
+ * Release memoryviews created for the evaluation.
+ *
+ * Python code might hold on to the memoryview after evaluation, but record
+ * memory can change at any time after that. Releasing the view makes any
+ * further access raise an exception. When the view has been exported,
+ * ie. numpy.asarray(VAL), it can't be released and the export will
+ * observe record changes.
+ */
+static void releaseViews(std::vector<PyObject*>& views)
+{
+#if PY_MAJOR_VERSION >= 3
+    for (auto view: views) {
+        PyObject* r = PyObject_CallMethod(view, const_cast<char*>("release"), nullptr);
+        if (r == nullptr) {
+            PyErr_Clear();
+        }
+        Py_XDECREF(r);
+        Py_DECREF(view);
+    }
+#endif
+    views.clear();
+}
+
+#if PY_MAJOR_VERSION < 3
+// Python 2 has no TimeoutError, pydev module provides one
+static PyObject* timeoutError = nullptr;
+#endif
+
+/**
+ * Exception injected by interrupt().
+ */
+static PyObject* timeoutException()
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyExc_TimeoutError;
+#else
+    return timeoutError;
+#endif
+}
+
+/**
+ * Check whether pending Python exception should become TimeoutError,
+ * which also covers socket.timeout since Python 3.10.
+ */
+static bool isTimeout()
+{
+    return PyErr_ExceptionMatches(timeoutException());
+}
+
+PyWrapper::Session::Session()
+{
+    gil = new PyGIL;
+}
+
+PyWrapper::Session::Session(bool wait)
+    : gil(nullptr)
+{
+    bool claimed = false;
+    if (wait || PyGIL::available(claimed)) {
+        gil = new PyGIL(claimed);
+    }
+}
+
+PyWrapper::Session::~Session()
+{
+    delete reinterpret_cast<PyGIL*>(gil);
+}
+
 PyWrapper::ByteCode::ByteCode()
     : code(nullptr)
+    , locals(nullptr)
 {
 }
 
-PyWrapper::ByteCode::ByteCode(void* c)
+PyWrapper::ByteCode::ByteCode(void* c, void* l)
+    : code(c)
+    , locals(l)
 {
-    code = c;
 }
 
 PyWrapper::ByteCode::~ByteCode()
@@ -46,16 +480,227 @@ PyWrapper::ByteCode::~ByteCode()
 PyWrapper::ByteCode::ByteCode(ByteCode&& o)
 {
     code = o.code;
+    locals = o.locals;
+    keys = std::move(o.keys);
     o.code = nullptr;
+    o.locals = nullptr;
+    o.keys.clear();
 }
 
 PyWrapper::ByteCode& PyWrapper::ByteCode::operator=(ByteCode&& o)
 {
     code = o.code;
+    locals = o.locals;
+    keys = std::move(o.keys);
     o.code = nullptr;
+    o.locals = nullptr;
+    o.keys.clear();
     return *this;
 }
 
+/**
+ * Find parameter, or create it when create is set. Caller must hold ParamsLock.
+ */
+static IoIntrParam* findParam(const char* name, size_t size, bool create)
+{
+    auto it = params.find(NameKey{name, size});
+    if (it != params.end()) {
+        return it->second;
+    }
+    if (!create) {
+        return nullptr;
+    }
+    IoIntrParam* param = new IoIntrParam;
+    param->name.assign(name, size);
+    params[NameKey{param->name.data(), param->name.size()}] = param;
+    return param;
+}
+
+static const char* handleName = "pydev.iointr_handle";
+
+/**
+ * Get UTF-8 characters of parameter name, they are owned by the name object.
+ *
+ * @return false with Python exception set when obj is not a string
+ */
+static bool paramName(PyObject* obj, const char*& name, Py_ssize_t& size)
+{
+#if PY_MAJOR_VERSION < 3
+    if (!PyString_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "Parameter name is not a string");
+        return false;
+    }
+    name = PyString_AS_STRING(obj);
+    size = PyString_GET_SIZE(obj);
+#else
+    if (!PyUnicode_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "Parameter name is not a unicode");
+        return false;
+    }
+    // UTF-8 is cached in string object, ASCII strings are used as they are
+    name = PyUnicode_AsUTF8AndSize(obj, &size);
+    if (name == nullptr) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+/**
+ * Resolve parameter from a name or a handle.
+ *
+ * @param param Set to found parameter, nullptr when not registered
+ * @return false with Python exception set on invalid argument
+ */
+static bool toParam(PyObject* obj, bool create, IoIntrParam*& param)
+{
+    param = nullptr;
+    if (PyCapsule_CheckExact(obj)) {
+        param = reinterpret_cast<IoIntrParam*>(PyCapsule_GetPointer(obj, handleName));
+        return (param != nullptr);
+    }
+
+    const char* name;
+    Py_ssize_t size;
+    if (!paramName(obj, name, size)) {
+        return false;
+    }
+
+    ParamsLock lock;
+    param = findParam(name, size, create);
+    return true;
+}
+
+/**
+ * Convert pushed value for value callbacks. Buffers are copied once into
+ * memory owned by the value, so records can read them without the GIL
+ * and the pushed object can be modified right after the push.
+ */
+static PyWrapper::IoIntrValue nativeValue(PyObject* value)
+{
+    Variant native;
+    if (!PyWrapper::convert(value, native)) {
+        return nullptr;
+    }
+    if (native.type == Variant::Type::ARRAY) {
+        native = Variant(native.get_array().clone());
+    }
+    return std::make_shared<const Variant>(std::move(native));
+}
+
+/**
+ * Invoke callbacks of parameter, value callbacks only when native value
+ * is given.
+ */
+static void notify(IoIntrParam* param, const PyWrapper::IoIntrValue* native)
+{
+    if (native != nullptr) {
+        for (auto vcb = param->valueCallbacks.load(std::memory_order_acquire); vcb != nullptr; vcb = vcb->next) {
+            vcb->callback(*native);
+        }
+    }
+    for (auto cb = param->callbacks.load(std::memory_order_acquire); cb != nullptr; cb = cb->next) {
+        cb->callback();
+    }
+}
+
+/**
+ * Convert value pushed in interpreter index when parameter has value
+ * callbacks. Sub-interpreters don't convert values, records reading them
+ * run Python.
+ *
+ * @return false when callbacks need no native value
+ */
+static bool pushedValue(IoIntrParam* param, PyObject* value, unsigned index, PyWrapper::IoIntrValue& native)
+{
+    if (index == 0 && param->valueCallbacks.load(std::memory_order_acquire) != nullptr) {
+        native = nativeValue(value);
+        return true;
+    }
+    return false;
+}
+
+static PyObject* toPyObject(const Variant& val, std::vector<PyObject*>& views);
+
+/**
+ * Convert natively pushed value to Python object for the cache.
+ *
+ * Cached objects may outlive any evaluation, arrays are therefore copied
+ * into bytes and exposed through a read-only memoryview of it.
+ */
+static PyObject* toCachedObject(const Variant& val)
+{
+#if PY_MAJOR_VERSION >= 3
+    if (val.type == Variant::Type::ARRAY) {
+        PyObject* view = toMemoryView(val);
+        if (view == nullptr) {
+            return nullptr;
+        }
+        PyObject* format = PyObject_GetAttrString(view, "format");
+        PyObject* bytes = PyObject_CallMethod(view, const_cast<char*>("tobytes"), nullptr);
+        PyObject* item = nullptr;
+        if (format != nullptr && bytes != nullptr) {
+            PyObject* raw = PyMemoryView_FromObject(bytes);
+            if (raw != nullptr) {
+                item = PyObject_CallMethod(raw, const_cast<char*>("cast"), const_cast<char*>("O"), format);
+                Py_DECREF(raw);
+            }
+        }
+        Py_XDECREF(bytes);
+        Py_XDECREF(format);
+        Py_DECREF(view);
+        return item;
+    }
+#endif
+    // Python 2 arrays are lists
+    std::vector<PyObject*> views;
+    return toPyObject(val, views);
+}
+
+/**
+ * Return cached value of main interpreter, converting value pushed
+ * natively since the last Python push first.
+ *
+ * Must be called with ParamsLock held, lock is released on return.
+ */
+static PyObject* cachedValue(IoIntrParam* param, ParamsLock& lock)
+{
+    auto& values = param->values;
+    if (param->pushed) {
+        PyWrapper::IoIntrValue pushed = param->pushed;
+        uint64_t generation = param->generation;
+        lock.unlock();
+
+        PyObject* value = toCachedObject(*pushed);
+        if (value == nullptr) {
+            PyErr_Clear();
+            Py_RETURN_NONE;
+        }
+        PyObject* old = nullptr;
+        lock.lock();
+        if (param->generation == generation) {
+            if (values.empty()) {
+                values.resize(1, nullptr);
+            }
+            old = values[0];
+            Py_INCREF(value);
+            values[0] = value;
+            param->pushed.reset();
+        }
+        lock.unlock();
+        Py_XDECREF(old);
+        return value;
+    }
+
+    PyObject* cached = (values.empty() ? nullptr : values[0]);
+    Py_XINCREF(cached);
+    lock.unlock();
+    if (cached != nullptr) {
+        return cached;
+    }
+    Py_RETURN_NONE;
+}
+
 /**
  * Function for caching parameter value or notifying record of new value.
  *
@@ -68,63 +713,212 @@ PyWrapper::ByteCode& PyWrapper::ByteCode::operator=(ByteCode&& o)
  * 2) Record(s) associated with that parameter name will then process and
  *    invoke this function with a single argument, in which case the cached
  *    parameter value is returned.
+ *
+ * Parameter can be given by name or by handle from pydev.iointr_handle().
  */
 static PyObject* pydev_iointr(PyObject* self, PyObject* args)
 {
-    PyObject* param;
+    PyObject* name;
     PyObject* value = nullptr;
-    if (!PyArg_UnpackTuple(args, "pydev.iointr", 1, 2, &param, &value)) {
+    if (!PyArg_UnpackTuple(args, "pydev.iointr", 1, 2, &name, &value)) {
         PyErr_Clear();
         Py_RETURN_FALSE;
     }
-#if PY_MAJOR_VERSION < 3
-    if (!PyString_Check(param)) {
-        PyErr_SetString(PyExc_TypeError, "Parameter name is not a string");
-        Py_RETURN_NONE;
-    }
-    std::string name = PyString_AsString(param);
-#else /* PY_MAJOR_VERSION < 3 */
-    PyObject* tmp = nullptr;
-    if (!PyUnicode_Check(param)){
-        PyErr_SetString(PyExc_TypeError, "Parameter name is not a unicode");
-        Py_RETURN_NONE;
-    }
-    tmp = PyUnicode_AsASCIIString(param);
-    if(!tmp){
-        PyErr_SetString(PyExc_TypeError, "Unicode could not be converted to ASCII");
-        Py_RETURN_NONE;
+
+    IoIntrParam* param;
+    if (!toParam(name, false, param)) {
+        return nullptr;
     }
-    if(!PyBytes_Check(tmp)){
-        PyErr_SetString(PyExc_TypeError, "PyUnicode as ASCII did not return expected bytes object!");
+    if (param == nullptr) {
+        // No record is interested in this parameter
+        if (value) {
+            Py_RETURN_TRUE;
+        }
         Py_RETURN_NONE;
     }
-    std::string name = PyBytes_AsString(tmp);
-    Py_XDECREF(tmp);
-#endif /* PY_MAJOR_VERSION < 3 */
 
-    auto it = params.find(name);
+    unsigned index = (interpreter ? interpreter->index : 0);
+    ParamsLock lock;
+    auto& values = param->values;
     if (value) {
-        if (it != params.end()) {
-            if (it->second.second) {
-                Py_DecRef(it->second.second);
-            }
-            Py_IncRef(value);
-            it->second.second = value;
+        if (values.size() <= index) {
+            values.resize(index + 1, nullptr);
+        }
+        // Old value is released outside of the lock, its destructor
+        // may run arbitrary Python code
+        PyObject* old = values[index];
+        Py_IncRef(value);
+        values[index] = value;
+        param->generation++;
+        PyWrapper::IoIntrValue stale;
+        if (index == 0) {
+            stale.swap(param->pushed);
+        }
+        lock.unlock();
 
-            it->second.first();
+        Py_XDECREF(old);
+        numIointrPushes.fetch_add(1, std::memory_order_relaxed);
+        PyWrapper::IoIntrValue native;
+        bool converted = pushedValue(param, value, index, native);
+        {
+            // Callbacks take dbScanLock, which scan threads processing
+            // records inline hold while taking the GIL
+            PyUnlock unlock;
+            notify(param, (converted ? &native : nullptr));
         }
         Py_RETURN_TRUE;
     }
 
-    if (it != params.end() && it->second.second != nullptr) {
-        Py_IncRef(it->second.second);
-        return it->second.second;
+    if (index == 0) {
+        return cachedValue(param, lock);
+    }
+    PyObject* cached = nullptr;
+    if (values.size() > index) {
+        cached = values[index];
+        Py_XINCREF(cached);
+    }
+    lock.unlock();
+
+    if (cached != nullptr) {
+        return cached;
     }
     Py_RETURN_NONE;
 }
 
+/**
+ * Push values of several parameters at once.
+ *
+ * Argument is a dict or a sequence of (param, value) pairs, parameters
+ * are given by name or handle. All values are cached under a single lock
+ * before any record is notified, so records see a consistent set of
+ * values. Each affected parameter is notified only once, even when it
+ * appears several times, the last value wins.
+ */
+static PyObject* pydev_iointr_many(PyObject* self, PyObject* args)
+{
+    PyObject* arg;
+    if (!PyArg_UnpackTuple(args, "pydev.iointr_many", 1, 1, &arg)) {
+        return nullptr;
+    }
+    PyObject* items = (PyDict_Check(arg) ? PyDict_Items(arg) : PySequence_Fast(arg, "pydev.iointr_many() argument must be a dict or a sequence of pairs"));
+    if (items == nullptr) {
+        return nullptr;
+    }
+
+    struct Update {
+        IoIntrParam* param;
+        const char* name;
+        Py_ssize_t size;
+        PyObject* value;
+    };
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(items);
+    std::vector<Update> updates(count);
+    for (Py_ssize_t i = 0; i < count; i++) {
+        PyObject* item = PySequence_Fast_GET_ITEM(items, i);
+        if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+            PyErr_SetString(PyExc_TypeError, "pydev.iointr_many() items must be (param, value) pairs");
+            Py_DECREF(items);
+            return nullptr;
+        }
+        PyObject* name = PyTuple_GET_ITEM(item, 0);
+        Update& update = updates[i];
+        update.param = nullptr;
+        update.value = PyTuple_GET_ITEM(item, 1);
+        if (PyCapsule_CheckExact(name)) {
+            update.param = reinterpret_cast<IoIntrParam*>(PyCapsule_GetPointer(name, handleName));
+            if (update.param == nullptr) {
+                Py_DECREF(items);
+                return nullptr;
+            }
+        } else if (!paramName(name, update.name, update.size)) {
+            Py_DECREF(items);
+            return nullptr;
+        }
+    }
+
+    // Items keep names and values alive until records are notified
+    unsigned index = (interpreter ? interpreter->index : 0);
+    std::vector<PyObject*> old;
+    std::vector<PyWrapper::IoIntrValue> stale;
+    std::vector<std::pair<IoIntrParam*, PyObject*>> changed;
+    std::unordered_map<IoIntrParam*, size_t> seen;
+    old.reserve(count);
+    changed.reserve(count);
+    ParamsLock lock;
+    for (auto& update: updates) {
+        IoIntrParam* param = (update.param ? update.param : findParam(update.name, update.size, false));
+        if (param == nullptr) {
+            // No record is interested in this parameter
+            continue;
+        }
+        auto& values = param->values;
+        if (values.size() <= index) {
+            values.resize(index + 1, nullptr);
+        }
+        old.push_back(values[index]);
+        Py_IncRef(update.value);
+        values[index] = update.value;
+        param->generation++;
+        if (index == 0 && param->pushed) {
+            stale.emplace_back(std::move(param->pushed));
+            param->pushed.reset();
+        }
+        auto it = seen.emplace(param, changed.size());
+        if (it.second) {
+            changed.emplace_back(param, update.value);
+        } else {
+            changed[it.first->second].second = update.value;
+        }
+    }
+    lock.unlock();
+
+    // Old values are released outside of the lock, their destructors
+    // may run arbitrary Python code
+    for (auto value: old) {
+        Py_XDECREF(value);
+    }
+
+    numIointrPushes.fetch_add(old.size(), std::memory_order_relaxed);
+    std::vector<std::pair<bool, PyWrapper::IoIntrValue>> natives(changed.size());
+    for (size_t i = 0; i < changed.size(); i++) {
+        natives[i].first = pushedValue(changed[i].first, changed[i].second, index, natives[i].second);
+    }
+    {
+        // Callbacks take dbScanLock, see pydev_iointr()
+        PyUnlock unlock;
+        for (size_t i = 0; i < changed.size(); i++) {
+            notify(changed[i].first, (natives[i].first ? &natives[i].second : nullptr));
+        }
+    }
+    Py_DECREF(items);
+    Py_RETURN_TRUE;
+}
+
+/**
+ * Return handle of I/O Intr parameter for pydev.iointr(), which skips
+ * decoding the name and looking it up on every call.
+ */
+static PyObject* pydev_iointr_handle(PyObject* self, PyObject* args)
+{
+    PyObject* name;
+    if (!PyArg_UnpackTuple(args, "pydev.iointr_handle", 1, 1, &name)) {
+        return nullptr;
+    }
+    if (PyCapsule_CheckExact(name)) {
+        Py_INCREF(name);
+        return name;
+    }
+    IoIntrParam* param;
+    if (!toParam(name, true, param)) {
+        return nullptr;
+    }
+    return PyCapsule_New(param, handleName, nullptr);
+}
+
 static struct PyMethodDef methods[] = {
     { "iointr", pydev_iointr, METH_VARARGS, "PyDevice interface for parameters exchange"},
+    { "iointr_many", pydev_iointr_many, METH_VARARGS, "Push values of several I/O Intr parameters at once"},
+    { "iointr_handle", pydev_iointr_handle, METH_VARARGS, "Get handle of I/O Intr parameter for faster pydev.iointr() calls"},
     /* sentinel */
     { NULL, NULL, 0, NULL }
 };
@@ -132,15 +926,31 @@ static struct PyMethodDef methods[] = {
 #if PY_MAJOR_VERSION < 3
 static void PyInit_pydev(void)
 {
-    Py_InitModule("pydev", methods);
+    PyObject* m = Py_InitModule("pydev", methods);
+    timeoutError = PyErr_NewException(const_cast<char*>("pydev.TimeoutError"), PyExc_RuntimeError, nullptr);
+    // Module steals one reference, the other one is kept for interrupt()
+    Py_INCREF(timeoutError);
+    PyModule_AddObject(m, "TimeoutError", timeoutError);
 }
 #else
+// Multi-phase initialization allows module to be imported in sub-interpreters
+static struct PyModuleDef_Slot slots[] = {
+#if PY_VERSION_HEX >= 0x030C0000
+    { Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+#ifdef Py_GIL_DISABLED
+    // Otherwise importing module re-enables GIL
+    { Py_mod_gil, Py_MOD_GIL_NOT_USED },
+#endif
+    /* sentinel */
+    { 0, NULL }
+};
 static struct PyModuleDef moddef = {
-    PyModuleDef_HEAD_INIT, "pydev", NULL, -1, methods, NULL, NULL, NULL, NULL
+    PyModuleDef_HEAD_INIT, "pydev", NULL, 0, methods, slots, NULL, NULL, NULL
 };
 static PyObject* PyInit_pydev(void)
 {
-    return PyModule_Create(&moddef);
+    return PyModuleDef_Init(&moddef);
 }
 #endif
 
@@ -157,7 +967,7 @@ bool PyWrapper::init()
     auto m = PyImport_AddModule("__main__");
     assert(m);
     globDict = PyModule_GetDict(m);
-    locDict = PyDict_New();
+    Py_INCREF(globDict);
 #else /* PY_MAJOR_VERSION < 3 */
 
 #if PY_MINOR_VERSION <= 6
@@ -165,12 +975,10 @@ bool PyWrapper::init()
 #endif
 
     globDict = PyDict_New();
-    locDict = PyDict_New();
     PyDict_SetItemString(globDict, "__builtins__", PyEval_GetBuiltins());
 #endif /* PY_MAJOR_VERSION < 3 */
 
     assert(globDict);
-    assert(locDict);
 
     // Release GIL, save thread state
     mainThread = PyEval_SaveThread();
@@ -194,50 +1002,372 @@ void PyWrapper::shutdown()
     PyEval_RestoreThread(mainThread);
     mainThread = nullptr;
 
+    stopAwait();
+
     Py_DecRef(globDict);
-    Py_DecRef(locDict);
     Py_Finalize();
 }
 
+bool PyWrapper::createInterpreter()
+{
+#if PY_VERSION_HEX >= 0x030C0000
+    if (interpreter != nullptr) {
+        return true;
+    }
+
+    PyInterpreterConfig config = {};
+    config.use_main_obmalloc = 0;
+    config.allow_fork = 0;
+    config.allow_exec = 0;
+    config.allow_threads = 1;
+    config.allow_daemon_threads = 0;
+    config.check_multi_interp_extensions = 1;
+    config.gil = PyInterpreterConfig_OWN_GIL;
+
+    // Creating interpreter with its own GIL releases the main GIL and
+    // leaves the new interpreter's GIL locked
+    PyGILState_STATE state = PyGILState_Ensure();
+    PyThreadState* mainState = PyThreadState_Get();
+    PyThreadState* tstate = nullptr;
+    PyStatus status = Py_NewInterpreterFromConfig(&tstate, &config);
+    if (PyStatus_Exception(status) || tstate == nullptr) {
+        PyThreadState_Swap(mainState);
+        PyErr_Clear();
+        PyGILState_Release(state);
+        return false;
+    }
+
+    PyObject* dict = PyDict_New();
+    PyDict_SetItemString(dict, "__builtins__", PyEval_GetBuiltins());
+    PyObject* r = PyRun_String("import pydev, builtins\nbuiltins.pydev = pydev\n", Py_file_input, dict, dict);
+    if (r == nullptr) {
+        PyErr_Print();
+        PyErr_Clear();
+    }
+    Py_XDECREF(r);
+
+    interpreter = new Interpreter{numInterpreters++, PyEval_SaveThread(), dict, 0};
+
+    PyEval_RestoreThread(mainState);
+    PyGILState_Release(state);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void PyWrapper::destroyInterpreter()
+{
+#if PY_VERSION_HEX >= 0x030C0000
+    if (interpreter == nullptr) {
+        return;
+    }
+
+    PyEval_RestoreThread(interpreter->tstate);
+
+    std::vector<PyObject*> cached;
+    {
+        ParamsLock lock;
+        for (auto& param: params) {
+            auto& values = param.second->values;
+            if (values.size() > interpreter->index && values[interpreter->index] != nullptr) {
+                cached.push_back(values[interpreter->index]);
+                values[interpreter->index] = nullptr;
+            }
+        }
+    }
+    for (auto value: cached) {
+        Py_DecRef(value);
+    }
+    Py_DecRef(interpreter->globDict);
+    Py_EndInterpreter(interpreter->tstate);
+
+    delete interpreter;
+    interpreter = nullptr;
+#endif
+}
+
+PyWrapper::ThreadId PyWrapper::currentThread()
+{
+    ThreadId thread;
+    thread.ident = PyThread_get_thread_ident();
+    thread.interp = nullptr;
+#if PY_VERSION_HEX >= 0x030C0000
+    if (interpreter != nullptr) {
+        thread.interp = PyThreadState_GetInterpreter(interpreter->tstate);
+    }
+#endif
+    return thread;
+}
+
+bool PyWrapper::interrupt(const ThreadId& thread, const std::function<bool()>& check)
+{
+#if PY_VERSION_HEX >= 0x030C0000
+    if (thread.interp != nullptr) {
+        // Temporarily attach to sub-interpreter, which takes its GIL
+        PyThreadState* tstate = PyThreadState_New(reinterpret_cast<PyInterpreterState*>(thread.interp));
+        PyEval_RestoreThread(tstate);
+        bool interrupted = (check() && PyThreadState_SetAsyncExc(thread.ident, timeoutException()) > 0);
+        PyThreadState_Clear(tstate);
+        PyThreadState_DeleteCurrent();
+        return interrupted;
+    }
+#endif
+    PyGIL gil;
+    return (check() && PyThreadState_SetAsyncExc(thread.ident, timeoutException()) > 0);
+}
+
+void PyWrapper::clearInterrupt()
+{
+    PyGIL gil;
+    PyThreadState_SetAsyncExc(PyThread_get_thread_ident(), nullptr);
+}
+
 void PyWrapper::registerIoIntr(const std::string& name, const Callback& cb)
 {
-    params[name].first = cb;
-    params[name].second = nullptr;
+    ParamsLock lock;
+    IoIntrParam* param = findParam(name.data(), name.size(), true);
+    param->callbacks.store(new IoIntrCallback{cb, param->callbacks.load()}, std::memory_order_release);
 }
 
-bool PyWrapper::convert(void* in_, Variant& out)
+void PyWrapper::registerIoIntrValue(const std::string& name, const ValueCallback& cb)
 {
-    PyObject* in = reinterpret_cast<PyObject*>(in_);
+    ParamsLock lock;
+    IoIntrParam* param = findParam(name.data(), name.size(), true);
+    param->valueCallbacks.store(new IoIntrValueCallback{cb, param->valueCallbacks.load()}, std::memory_order_release);
+}
 
-    if (in == Py_None) {
-        out = Variant();
-        return true;
+void PyWrapper::pushIoIntr(const std::string& name, const IoIntrValue& value)
+{
+    if (!value) {
+        return;
     }
-#if PY_MAJOR_VERSION < 3
-    if (PyString_Check(in)) {
-        const char* o = PyString_AsString(in);
-        if (o == nullptr && PyErr_Occurred()) {
-            PyErr_Clear();
+    ParamsLock lock;
+    IoIntrParam* param = findParam(name.data(), name.size(), false);
+    if (param == nullptr) {
+        // No record is interested in this parameter
+        return;
+    }
+    // Previous value is released outside of the lock, it may be a large array
+    IoIntrValue stale = value;
+    stale.swap(param->pushed);
+    param->generation++;
+    lock.unlock();
+
+    numIointrPushes.fetch_add(1, std::memory_order_relaxed);
+    notify(param, &value);
+}
+
+/**
+ * Determine native element type from buffer format string.
+ *
+ * Only single element formats with native byte order are supported,
+ * element size is taken from buffer since format letters like 'l' depend
+ * on the byte order prefix.
+ */
+static bool toElementType(const char* format, Py_ssize_t itemsize, Variant::ElementType& type)
+{
+    const uint16_t probe = 1;
+    const bool littleEndian = (*reinterpret_cast<const char*>(&probe) == 1);
+
+    if (format == nullptr) {
+        format = "B";
+    }
+    if (format[0] == '@' || format[0] == '=') {
+        format++;
+    } else if (format[0] == '<' || format[0] == '>' || format[0] == '!') {
+        if ((format[0] == '<') != littleEndian) {
             return false;
         }
-        out = Variant(o);
+        format++;
+    }
+    if (format[0] == '\0' || format[1] != '\0') {
+        return false;
+    }
+
+    if (strchr("fd", format[0])) {
+        if      (itemsize == 4) type = Variant::ElementType::FLOAT;
+        else if (itemsize == 8) type = Variant::ElementType::DOUBLE;
+        else return false;
+    } else if (strchr("bhilqn", format[0])) {
+        if      (itemsize == 1) type = Variant::ElementType::INT8;
+        else if (itemsize == 2) type = Variant::ElementType::INT16;
+        else if (itemsize == 4) type = Variant::ElementType::INT32;
+        else if (itemsize == 8) type = Variant::ElementType::INT64;
+        else return false;
+    } else if (strchr("BHILQN?", format[0])) {
+        if      (itemsize == 1) type = Variant::ElementType::UINT8;
+        else if (itemsize == 2) type = Variant::ElementType::UINT16;
+        else if (itemsize == 4) type = Variant::ElementType::UINT32;
+        else if (itemsize == 8) type = Variant::ElementType::UINT64;
+        else return false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Wrap object exporting buffer interface into native array.
+ *
+ * Elements are not copied, Variant holds the Python buffer until the
+ * last copy of the array is destroyed. This allows record to copy
+ * numpy.ndarray, array.array or bytes straight into its own buffer.
+ */
+static bool convertBuffer(PyObject* in, Variant& out)
+{
+    Py_buffer* view = new Py_buffer;
+    if (PyObject_GetBuffer(in, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+        PyErr_Clear();
+        delete view;
+        return false;
+    }
+
+    Variant::ElementType type;
+    if (view->itemsize <= 0 || !toElementType(view->format, view->itemsize, type)) {
+        PyBuffer_Release(view);
+        delete view;
+        return false;
+    }
+
+    std::shared_ptr<const void> owner(view, [](Py_buffer* view) {
+        if (Py_IsInitialized()) {
+            PyGIL gil;
+            PyBuffer_Release(view);
+        }
+        delete view;
+    });
+    size_t count = view->len / view->itemsize;
+    out = Variant(Variant::Array{type, view->buf, count, owner});
+    return true;
+}
+
+/**
+ * Copy characters of str or unicode object as UTF-8.
+ *
+ * On Python 3 UTF-8 is cached in the string object and ASCII strings are
+ * used as they are, characters are copied straight into out without any
+ * temporary Python object.
+ *
+ * @return false with Python exception cleared when string can't be encoded
+ */
+static bool toString(PyObject* obj, std::string& out)
+{
+    const char* data;
+    Py_ssize_t size;
+#if PY_MAJOR_VERSION < 3
+    if (PyString_Check(obj)) {
+        data = PyString_AS_STRING(obj);
+        size = PyString_GET_SIZE(obj);
+        out.assign(data, size);
         return true;
     }
+    PyObject* tmp = PyUnicode_AsUTF8String(obj);
+    if (tmp == nullptr) {
+        PyErr_Clear();
+        return false;
+    }
+    out.assign(PyString_AS_STRING(tmp), PyString_GET_SIZE(tmp));
+    Py_DECREF(tmp);
+#else
+    data = PyUnicode_AsUTF8AndSize(obj, &size);
+    if (data == nullptr) {
+        PyErr_Clear();
+        return false;
+    }
+    out.assign(data, size);
 #endif
-    if (PyUnicode_Check(in)) {
-        PyObject* tmp = PyUnicode_AsASCIIString(in);
-        if (tmp == nullptr) {
-            PyErr_Clear();
-            return false;
+    return true;
+}
+
+/**
+ * Convert elements of list, tuple or other sequence to a vector of same typed values.
+ */
+static bool convertSequence(PyObject* seq, Variant& out)
+{
+    std::vector<double> vd;
+    std::vector<long long int> vl;
+    std::vector<std::string> vs;
+    Variant::Type t = Variant::Type::NONE;
+
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        PyObject* el = PySequence_Fast_GET_ITEM(seq, i);
+#if PY_MAJOR_VERSION < 3
+        if (PyInt_Check(el) && (t == Variant::Type::NONE || t == Variant::Type::VECTOR_LONG)) {
+            long long val = PyInt_AsLong(el);
+            if (val == 1 && PyErr_Occurred()) {
+                PyErr_Clear();
+                return false;
+            }
+            vl.push_back(val);
+            t = Variant::Type::VECTOR_LONG;
         }
-        const char* o = PyBytes_AsString(tmp);
-        if (o == nullptr && PyErr_Occurred()) {
-            Py_XDECREF(tmp);
-            PyErr_Clear();
+#endif
+        if (PyLong_Check(el) && (t == Variant::Type::NONE || t == Variant::Type::VECTOR_LONG)) {
+            long val = PyLong_AsLong(el);
+            if (val == -1 && PyErr_Occurred()) {
+                PyErr_Clear();
+                return false;
+            }
+            vl.push_back(val);
+            t = Variant::Type::VECTOR_LONG;
+        }
+        if (PyBool_Check(el) && (t == Variant::Type::NONE || t == Variant::Type::VECTOR_LONG)) {
+            long val = (PyObject_IsTrue(el) ? 1 : 0);
+            vl.push_back(val);
+            t = Variant::Type::VECTOR_LONG;
+        }
+        if (PyFloat_Check(el) && (t == Variant::Type::NONE || t == Variant::Type::VECTOR_DOUBLE)) {
+            double val = PyFloat_AsDouble(el);
+            if (val == -1.0 && PyErr_Occurred()) {
+                PyErr_Clear();
+                return false;
+            }
+            vd.push_back(val);
+            t = Variant::Type::VECTOR_DOUBLE;
+        }
+#if PY_MAJOR_VERSION < 3
+        if ((PyString_Check(el) || PyUnicode_Check(el)) && (t == Variant::Type::NONE || t == Variant::Type::VECTOR_STRING)) {
+#else
+        if (PyUnicode_Check(el) && (t == Variant::Type::NONE || t == Variant::Type::VECTOR_STRING)) {
+#endif
+            vs.emplace_back();
+            if (!toString(el, vs.back())) {
+                return false;
+            }
+            t = Variant::Type::VECTOR_STRING;
+        }
+    }
+
+    if (t == Variant::Type::VECTOR_LONG) {
+        out = Variant(std::move(vl));
+    } else if (t == Variant::Type::VECTOR_STRING) {
+        out = Variant(std::move(vs));
+    } else {
+        out = Variant(std::move(vd));
+    }
+
+    return true;
+}
+
+bool PyWrapper::convert(void* in_, Variant& out)
+{
+    PyObject* in = reinterpret_cast<PyObject*>(in_);
+
+    if (in == Py_None) {
+        out = Variant();
+        return true;
+    }
+#if PY_MAJOR_VERSION < 3
+    if (PyString_Check(in) || PyUnicode_Check(in)) {
+#else
+    if (PyUnicode_Check(in)) {
+#endif
+        std::string o;
+        if (!toString(in, o)) {
             return false;
         }
-        out = Variant(std::string(o));
-        Py_XDECREF(tmp);
+        out = Variant(std::move(o));
         return true;
     }
     if (PyBool_Check(in)) {
@@ -274,89 +1404,45 @@ bool PyWrapper::convert(void* in_, Variant& out)
         return true;
     }
 
-    if (PyList_Check(in)) {
-        std::vector<double> vd;
-        std::vector<long long int> vl;
-        std::vector<std::string> vs;
-        Variant::Type t = Variant::Type::NONE;
-
-        for (Py_ssize_t i = 0; i < PyList_Size(in); i++) {
-            PyObject* el = PyList_GetItem(in, i);
-#if PY_MAJOR_VERSION < 3
-            if (PyInt_Check(el) && (t == Variant::Type::NONE || t == Variant::Type::VECTOR_LONG)) {
-                long long val = PyInt_AsLong(el);
-                if (val == 1 && PyErr_Occurred()) {
-                    PyErr_Clear();
-                    return false;
-                }
-                vl.push_back(val);
-                t = Variant::Type::VECTOR_LONG;
-            }
-#endif
-            if (PyLong_Check(el) && (t == Variant::Type::NONE || t == Variant::Type::VECTOR_LONG)) {
-                long val = PyLong_AsLong(el);
-                if (val == -1 && PyErr_Occurred()) {
-                    PyErr_Clear();
-                    return false;
-                }
-                vl.push_back(val);
-                t = Variant::Type::VECTOR_LONG;
-            }
-            if (PyBool_Check(el) && (t == Variant::Type::NONE || t == Variant::Type::VECTOR_LONG)) {
-                long val = (PyObject_IsTrue(el) ? 1 : 0);
-                vl.push_back(val);
-                t = Variant::Type::VECTOR_LONG;
-            }
-            if (PyFloat_Check(el) && (t == Variant::Type::NONE || t == Variant::Type::VECTOR_DOUBLE)) {
-                double val = PyFloat_AsDouble(el);
-                if (val == -1.0 && PyErr_Occurred()) {
-                    PyErr_Clear();
-                    return false;
-                }
-                vd.push_back(val);
-                t = Variant::Type::VECTOR_DOUBLE;
-            }
-#if PY_MAJOR_VERSION < 3
-            if (PyString_Check(el) && (t == Variant::Type::NONE || t == Variant::Type::VECTOR_STRING)) {
-                const char *cval = PyString_AsString(el);
-#else
-            if (PyUnicode_Check(el) && (t == Variant::Type::NONE || t == Variant::Type::VECTOR_STRING)) {
-                const char *cval = PyBytes_AsString(PyUnicode_AsASCIIString(el));
-#endif
-                if (!cval) {
-                    PyErr_Clear();
-                    return false;
-                }
-                vs.push_back(cval);
-                t = Variant::Type::VECTOR_STRING;
-            }
+    if (PyObject_CheckBuffer(in)) {
+        if (convertBuffer(in, out)) {
+            return true;
         }
+    }
 
-        if (t == Variant::Type::VECTOR_LONG) {
-            out = Variant(vl);
-        } else if (t == Variant::Type::VECTOR_STRING) {
-            out = Variant(vs);
-        } else {
-            out = Variant(vd);
+    if (PySequence_Check(in)) {
+        PyObject* seq = PySequence_Fast(in, "Not a sequence");
+        if (seq == nullptr) {
+            PyErr_Clear();
+            return false;
         }
-
-        return true;
+        bool converted;
+#ifdef Py_GIL_DISABLED
+        // Items are borrowed, prevent other threads modifying the list
+        Py_BEGIN_CRITICAL_SECTION(seq);
+        converted = convertSequence(seq, out);
+        Py_END_CRITICAL_SECTION();
+#else
+        converted = convertSequence(seq, out);
+#endif
+        Py_DECREF(seq);
+        return converted;
     }
 
     // We don't support this type
     return false;
 }
 
-PyWrapper::ByteCode PyWrapper::compile(const std::string& code, bool debug)
+PyWrapper::ByteCode PyWrapper::compile(const std::string& code, bool debug, const std::string& name)
 {
     PyGIL gil;
 
-    PyObject* bytecode = Py_CompileString(code.c_str(), "", Py_eval_input);
+    PyObject* bytecode = Py_CompileString(code.c_str(), name.c_str(), Py_eval_input);
     if (bytecode == NULL) {
         // Ignore error, try with Py_file_input which works for 'import xxx' etc.
         PyErr_Clear();
 
-        bytecode = Py_CompileString((code+"\n").c_str(), "", Py_file_input);
+        bytecode = Py_CompileString((code+"\n").c_str(), name.c_str(), Py_file_input);
         if (bytecode == NULL) {
             if (debug) {
                 PyErr_Print();
@@ -365,73 +1451,508 @@ PyWrapper::ByteCode PyWrapper::compile(const std::string& code, bool debug)
             throw SyntaxError("Failed to compile '" + code + "', syntax error");
         }
     }
-    return ByteCode(bytecode);
+    return ByteCode(bytecode, PyDict_New());
 }
 
-Variant PyWrapper::eval(const PyWrapper::ByteCode& bytecode, const std::map<std::string, Variant>& args, bool debug)
+PyWrapper::ByteCode PyWrapper::compile(const std::string& code, const std::vector<std::string>& params, bool debug, const std::string& name)
 {
-    PyGIL gil;
+    {
+        PyGIL gil;
 
-    for (auto& keyval: args) {
-        PyObject* item = nullptr;
-        if (keyval.second.type == Variant::Type::BOOL) {
-            item = (keyval.second.get_bool() == true ? Py_True : Py_False);
-        } else if (keyval.second.type == Variant::Type::LONG) {
-            item = PyLong_FromLongLong(keyval.second.get_long());
-        } else if (keyval.second.type == Variant::Type::UNSIGNED) {
-            item = PyLong_FromUnsignedLongLong(keyval.second.get_unsigned());
-        } else if (keyval.second.type == Variant::Type::DOUBLE) {
-            item = PyFloat_FromDouble(keyval.second.get_double());
-        } else if (keyval.second.type == Variant::Type::STRING) {
+        // Only a valid expression on its own is wrapped, parenthesis would
+        // otherwise make something like '1) + (2' compile
+        PyObject* expr = Py_CompileString(code.c_str(), name.c_str(), Py_eval_input);
+        Py_XDECREF(expr);
+
+        // Expression becomes a body of function with params as arguments,
+        // newlines keep trailing comments from swallowing the parenthesis.
+        std::string source = "def pydevFunction(" + Util::join(params, ", ") + "):\n";
+        source += "    return (\n" + code + "\n)\n";
+
+        PyObject* def = (expr != nullptr ? Py_CompileString(source.c_str(), name.c_str(), Py_file_input) : nullptr);
+        if (def != nullptr) {
+            PyObject* ns = PyDict_New();
 #if PY_MAJOR_VERSION < 3
-            item = PyString_FromString(keyval.second.get_string().c_str());
+            PyObject* r = PyEval_EvalCode(reinterpret_cast<PyCodeObject*>(def), globals(), ns);
 #else
-            item = PyUnicode_FromString(keyval.second.get_string().c_str());
-#endif
-        } else if (keyval.second.type == Variant::Type::VECTOR_LONG) {
-            item = PyList_New(0);
-            auto vals = keyval.second.get_long_array();
-            for (auto& val: vals) {
-                PyObject* element = PyLong_FromLongLong(val);
-                PyList_Append(item, element);
-                Py_DECREF(element);
-            }
-        } else if (keyval.second.type == Variant::Type::VECTOR_UNSIGNED) {
-            item = PyList_New(0);
-            auto vals = keyval.second.get_unsigned_array();
-            for (auto& val: vals) {
-                PyObject* element = PyLong_FromUnsignedLongLong(val);
-                PyList_Append(item, element);
-                Py_DECREF(element);
-            }
-        } else if (keyval.second.type == Variant::Type::VECTOR_DOUBLE) {
-            item = PyList_New(0);
-            auto vals = keyval.second.get_double_array();
-            for (auto& val: vals) {
-                PyObject* element = PyFloat_FromDouble(val);
-                PyList_Append(item, element);
-                Py_DECREF(element);
+            PyObject* r = PyEval_EvalCode(def, globals(), ns);
+#endif
+            Py_XDECREF(r);
+            Py_DECREF(def);
+
+            PyObject* function = PyDict_GetItemString(ns, "pydevFunction");
+            if (function != nullptr) {
+                Py_INCREF(function);
+                Py_DECREF(ns);
+
+                ByteCode bytecode(function, nullptr);
+                for (auto& param: params) {
+                    bytecode.keys.emplace_back(param, nullptr);
+                }
+                return bytecode;
             }
-        } else if (keyval.second.type == Variant::Type::VECTOR_STRING) {
-            item = PyList_New(0);
-            auto vals = keyval.second.get_string_array();
-            for (auto& val: vals) {
+            Py_DECREF(ns);
+        }
+        PyErr_Clear();
+    }
+
+    // Not an expression, ie. 'import xxx', run in record's namespace
+    return compile(code, debug, name);
+}
+
+/**
+ * Convert Variant to a new reference of Python object.
+ *
+ * Memoryviews created for arrays are also added to views, they must be
+ * released once Python code completes.
+ */
+static PyObject* toPyObject(const Variant& val, std::vector<PyObject*>& views)
+{
+    PyObject* item = nullptr;
+    if (val.type == Variant::Type::BOOL) {
+        item = (val.get_bool() == true ? Py_True : Py_False);
+        Py_INCREF(item);
+    } else if (val.type == Variant::Type::LONG) {
+        item = PyLong_FromLongLong(val.get_long());
+    } else if (val.type == Variant::Type::UNSIGNED) {
+        item = PyLong_FromUnsignedLongLong(val.get_unsigned());
+    } else if (val.type == Variant::Type::DOUBLE) {
+        item = PyFloat_FromDouble(val.get_double());
+    } else if (val.type == Variant::Type::STRING) {
+        const char* data;
+        size_t size;
+        val.try_get(data, size);
+#if PY_MAJOR_VERSION < 3
+        item = PyString_FromStringAndSize(data, size);
+#else
+        item = PyUnicode_FromStringAndSize(data, size);
+#endif
+    } else if (val.type == Variant::Type::VECTOR_LONG) {
+        item = PyList_New(0);
+        auto vals = val.get_long_array();
+        for (auto& v: vals) {
+            PyObject* element = PyLong_FromLongLong(v);
+            PyList_Append(item, element);
+            Py_DECREF(element);
+        }
+    } else if (val.type == Variant::Type::VECTOR_UNSIGNED) {
+        item = PyList_New(0);
+        auto vals = val.get_unsigned_array();
+        for (auto& v: vals) {
+            PyObject* element = PyLong_FromUnsignedLongLong(v);
+            PyList_Append(item, element);
+            Py_DECREF(element);
+        }
+    } else if (val.type == Variant::Type::VECTOR_DOUBLE) {
+        item = PyList_New(0);
+        auto vals = val.get_double_array();
+        for (auto& v: vals) {
+            PyObject* element = PyFloat_FromDouble(v);
+            PyList_Append(item, element);
+            Py_DECREF(element);
+        }
+    } else if (val.type == Variant::Type::VECTOR_STRING) {
+        item = PyList_New(0);
+        for (auto& v: val.get_string_vector()) {
+#if PY_MAJOR_VERSION < 3
+            PyObject* element = PyString_FromStringAndSize(v.data(), v.size());
+#else
+            PyObject* element = PyUnicode_FromStringAndSize(v.data(), v.size());
+#endif
+            PyList_Append(item, element);
+            Py_DECREF(element);
+        }
+    } else if (val.type == Variant::Type::ARRAY) {
+        item = toMemoryView(val);
+#if PY_MAJOR_VERSION >= 3
+        if (item != nullptr) {
+            Py_INCREF(item);
+            views.push_back(item);
+        }
+#endif
+    }
+    return item;
+}
+
+/**
+ * Return interned Python string for argument name at given position.
+ *
+ * Records pass the same arguments in the same order every time, so
+ * the cached key is normally reused without touching Python.
+ */
+static PyObject* internKey(std::vector<std::pair<std::string, void*>>& keys, size_t i, const std::string& name)
+{
+    if (i < keys.size() && keys[i].first == name) {
+        return reinterpret_cast<PyObject*>(keys[i].second);
+    }
+
 #if PY_MAJOR_VERSION < 3
-                PyObject* element = PyString_FromString(val.c_str());
+    PyObject* key = PyString_InternFromString(name.c_str());
+#else
+    PyObject* key = PyUnicode_InternFromString(name.c_str());
+#endif
+    if (key == nullptr) {
+        return nullptr;
+    }
+    if (i < keys.size()) {
+        Py_XDECREF(reinterpret_cast<PyObject*>(keys[i].second));
+        keys[i] = std::make_pair(name, key);
+    } else {
+        keys.emplace_back(name, key);
+    }
+    return key;
+}
+
+/**
+ * Move names assigned by record statements from record's namespace to the
+ * shared globals, ie. '@b=VAL' in one record and '@b' in another. Only the
+ * first nargs keys are arguments of the current evaluation.
+ */
+static void publishAssigned(PyObject* locals, const std::vector<std::pair<std::string, void*>>& keys, size_t nargs)
+{
+    // Statements executed before an exception are published as well
+    PyObject *type, *error, *traceback;
+    PyErr_Fetch(&type, &error, &traceback);
+
+    std::vector<PyObject*> assigned;
+    PyObject* key;
+    PyObject* value;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(locals, &pos, &key, &value)) {
+        bool arg = false;
+        for (size_t i = 0; i < nargs && !arg; i++) {
+            arg = (keys[i].second == key);
+        }
+        if (!arg) {
+            assigned.push_back(key);
+        }
+    }
+    for (auto name: assigned) {
+        Py_INCREF(name);
+        PyDict_SetItem(globals(), name, PyDict_GetItem(locals, name));
+        PyDict_DelItem(locals, name);
+        Py_DECREF(name);
+    }
+    PyErr_Restore(type, error, traceback);
+}
+
+#if PY_MAJOR_VERSION >= 3
+/**
+ * Python side of the asyncio loop. Loop runs in a daemon thread, each
+ * awaitable is wrapped into a coroutine that reports its outcome back
+ * to done(value, exception).
+ */
+static const char* asyncLoopCode = R"(
+import asyncio
+import selectors
+import threading
+
+def start(busy):
+    # Loop thread counts as GIL user except while waiting for events
+    class Selector(selectors.DefaultSelector):
+        def select(self, timeout=None):
+            busy(False)
+            try:
+                return super().select(timeout)
+            finally:
+                busy(True)
+
+    loop = asyncio.SelectorEventLoop(Selector())
+
+    def main():
+        busy(True)
+        try:
+            loop.run_forever()
+        finally:
+            busy(False)
+
+    thread = threading.Thread(target=main, name='pydevAsyncio')
+    thread.daemon = True
+    thread.start()
+
+    async def run(aw, timeout, done):
+        try:
+            if timeout > 0:
+                r = await asyncio.wait_for(aw, timeout)
+            else:
+                r = await aw
+        except asyncio.TimeoutError:
+            done(None, TimeoutError('Awaitable timed out'))
+        except BaseException as e:
+            done(None, e)
+        else:
+            done(r, None)
+
+    def schedule(aw, timeout, done):
+        asyncio.run_coroutine_threadsafe(run(aw, timeout, done), loop)
+
+    def stop():
+        loop.call_soon_threadsafe(loop.stop)
+        thread.join(1.0)
+
+    return schedule, stop
+)";
+
+static std::mutex asyncMutex;
+static PyObject* asyncSchedule = nullptr;   // schedule(awaitable, timeout, done) of running loop
+static PyObject* asyncStop = nullptr;
+static const char* awaiterName = "pydev.awaiter";
+
+/**
+ * busy(flag) passed to the loop, accounts loop thread in gilUsers while
+ * it runs callbacks so that inline processing doesn't wait for it.
+ */
+static PyObject* loopBusy(PyObject* /*self*/, PyObject* flag)
+{
+    if (PyObject_IsTrue(flag)) {
+        gilUsers++;
+    } else {
+        gilUsers--;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef loopBusyDef = { "busy", loopBusy, METH_O, nullptr };
+
+/**
+ * Start asyncio loop thread on first use, return its schedule function.
+ * Called with GIL of main interpreter held.
+ */
+static PyObject* asyncLoop()
+{
+    // Starting the loop releases the GIL, lock is taken without holding
+    // the GIL so that the starting thread can get it back
+    std::unique_lock<std::mutex> lock(asyncMutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        Py_BEGIN_ALLOW_THREADS
+        lock.lock();
+        Py_END_ALLOW_THREADS
+    }
+    if (asyncSchedule != nullptr) {
+        return asyncSchedule;
+    }
+
+    PyObject* ns = PyDict_New();
+    PyDict_SetItemString(ns, "__builtins__", PyEval_GetBuiltins());
+    PyObject* r = PyRun_String(asyncLoopCode, Py_file_input, ns, ns);
+    PyObject* start = (r != nullptr ? PyDict_GetItemString(ns, "start") : nullptr);
+    PyObject* busy = (start != nullptr ? PyCFunction_New(&loopBusyDef, nullptr) : nullptr);
+    PyObject* fns = (busy != nullptr ? PyObject_CallFunctionObjArgs(start, busy, nullptr) : nullptr);
+    Py_XDECREF(busy);
+    if (fns != nullptr && PyTuple_Check(fns) && PyTuple_GET_SIZE(fns) == 2) {
+        asyncSchedule = PyTuple_GET_ITEM(fns, 0);
+        asyncStop = PyTuple_GET_ITEM(fns, 1);
+        Py_INCREF(asyncSchedule);
+        Py_INCREF(asyncStop);
+    } else {
+        printf("PyDevice: failed to start asyncio loop\n");
+        PyErr_Print();
+    }
+    Py_XDECREF(fns);
+    Py_XDECREF(r);
+    Py_DECREF(ns);
+    return asyncSchedule;
+}
+
+/**
+ * done(value, exception) passed to the loop, self is capsule of awaiter.
+ */
+struct AwaitDone {
+    static PyObject* call(PyObject* self, PyObject* args)
+    {
+        auto awaiter = reinterpret_cast<PyWrapper::Awaiter*>(PyCapsule_GetPointer(self, awaiterName));
+        PyObject* value;
+        PyObject* error;
+        if (awaiter == nullptr || !PyArg_UnpackTuple(args, "done", 2, 2, &value, &error)) {
+            return nullptr;
+        }
+        PyWrapper::completeAwait(*awaiter, value, error);
+        Py_RETURN_NONE;
+    }
+};
+
+static PyMethodDef awaitDoneDef = { "done", AwaitDone::call, METH_VARARGS, nullptr };
+#endif // PY_MAJOR_VERSION >= 3
+
+/**
+ * Check whether object returned by Python code should be awaited.
+ */
+static bool isAwaitable(PyObject* obj, PyWrapper::Awaiter* awaiter)
+{
+#if PY_MAJOR_VERSION >= 3
+    // Loop runs in the main interpreter
+    PyTypeObject* type = Py_TYPE(obj);
+    return (awaiter != nullptr && (interpreter == nullptr || interpreter->index == 0) &&
+            type->tp_as_async != nullptr && type->tp_as_async->am_await != nullptr);
+#else
+    return false;
+#endif
+}
+
+bool PyWrapper::scheduleAwait(void* awaitable, Awaiter& awaiter, bool debug, Timing* timing, std::vector<void*>& views)
+{
+#if PY_MAJOR_VERSION >= 3
+    PyObject* schedule = asyncLoop();
+    if (schedule == nullptr) {
+        return false;
+    }
+    PyObject* capsule = PyCapsule_New(&awaiter, awaiterName, nullptr);
+    PyObject* done = (capsule != nullptr ? PyCFunction_New(&awaitDoneDef, capsule) : nullptr);
+    Py_XDECREF(capsule);
+    if (done == nullptr) {
+        PyErr_Clear();
+        return false;
+    }
+
+    // Loop thread may complete awaitable before schedule() returns
+    awaiter.debug = debug;
+    awaiter.timing = timing;
+    awaiter.value = Variant();
+    awaiter.error = nullptr;
+    awaiter.views.swap(views);
+    awaiter.state.store(Awaiter::SCHEDULED, std::memory_order_release);
+    PyObject* r = PyObject_CallFunction(schedule, const_cast<char*>("OdO"), reinterpret_cast<PyObject*>(awaitable), awaiter.timeout, done);
+    Py_DECREF(done);
+    if (r == nullptr) {
+        if (debug) {
+            PyErr_Print();
+        }
+        PyErr_Clear();
+        awaiter.views.swap(views);
+        awaiter.state.store(Awaiter::IDLE, std::memory_order_release);
+        return false;
+    }
+    Py_DECREF(r);
+    return true;
 #else
-                PyObject* element = PyUnicode_FromString(val.c_str());
+    return false;
+#endif
+}
+
+void PyWrapper::completeAwait(Awaiter& awaiter, void* value_, void* error_)
+{
+    auto value = reinterpret_cast<PyObject*>(value_);
+    auto error = reinterpret_cast<PyObject*>(error_);
+    if (awaiter.timing) {
+        awaiter.timing->evalEnd = clockNs();
+    }
+    if (error != Py_None) {
+        numExceptions.fetch_add(1, std::memory_order_relaxed);
+        bool timeout = false;
+#if PY_MAJOR_VERSION >= 3
+        timeout = PyErr_GivenExceptionMatches(error, PyExc_TimeoutError);
+        if (awaiter.debug) {
+            PyObject* type = PyExceptionInstance_Class(error);
+            Py_INCREF(type);
+            Py_INCREF(error);
+            PyErr_Restore(type, error, PyException_GetTraceback(error));
+            PyErr_Print();
+        }
 #endif
-                PyList_Append(item, element);
-                Py_DECREF(element);
+        awaiter.error = (timeout ? std::make_exception_ptr(TimeoutError()) : std::make_exception_ptr(EvalError("Failed to evaluate Python code")));
+    } else {
+        Variant val;
+        if (convert(value, val)) {
+            // Result is destroyed by the record without the GIL, possibly
+            // under dbScanLock, it must not keep the Python buffer alive
+            if (val.type == Variant::Type::ARRAY) {
+                val = Variant(val.get_array().clone());
             }
+            awaiter.value = std::move(val);
+        } else {
+            if (awaiter.debug) {
+                PyErr_Print();
+            }
+            PyErr_Clear();
+            awaiter.error = std::make_exception_ptr(Variant::ConvertError("Failed to convert Python return value - unsupported type"));
+        }
+    }
+
+    std::vector<PyObject*> views;
+    for (auto view: awaiter.views) {
+        views.push_back(reinterpret_cast<PyObject*>(view));
+    }
+    awaiter.views.clear();
+    releaseViews(views);
+
+    // Caller still in call() invokes done from detach()
+    int expected = Awaiter::SCHEDULED;
+    if (!awaiter.state.compare_exchange_strong(expected, Awaiter::READY, std::memory_order_acq_rel)) {
+        awaiter.state.store(Awaiter::READY, std::memory_order_release);
+        if (awaiter.done) {
+            awaiter.done();
+        }
+    }
+}
+
+bool PyWrapper::Awaiter::detach()
+{
+    int expected = SCHEDULED;
+    if (state.compare_exchange_strong(expected, DETACHED, std::memory_order_acq_rel)) {
+        return true;
+    }
+    if (expected == IDLE) {
+        return false;
+    }
+    // Awaitable completed before caller let go of it
+    if (done) {
+        done();
+    }
+    return true;
+}
+
+void PyWrapper::stopAwait()
+{
+#if PY_MAJOR_VERSION >= 3
+    // Pending awaitables are abandoned, their records stay active
+    if (asyncStop != nullptr) {
+        PyObject* r = PyObject_CallObject(asyncStop, nullptr);
+        if (r == nullptr) {
+            PyErr_Clear();
         }
+        Py_XDECREF(r);
+        Py_CLEAR(asyncStop);
+        Py_CLEAR(asyncSchedule);
+    }
+#endif
+}
+
+Variant PyWrapper::Awaiter::result()
+{
+    Variant val = std::move(value);
+    value = Variant();
+    std::exception_ptr e = error;
+    error = nullptr;
+    state.store(IDLE, std::memory_order_release);
+    if (e) {
+        std::rethrow_exception(e);
+    }
+    return val;
+}
+
+Variant PyWrapper::eval(const PyWrapper::ByteCode& bytecode, const std::map<std::string, Variant>& args, bool debug, Timing* timing, Awaiter* awaiter)
+{
+    PyGIL gil;
+
+    auto locals = reinterpret_cast<PyObject*>(bytecode.locals);
+    std::vector<PyObject*> views;
+    size_t argIndex = 0;
+    for (auto& keyval: args) {
+        PyObject* item = toPyObject(keyval.second, views);
         if (item == nullptr) {
+            PyErr_Clear();
+            releaseViews(views);
             throw ArgumentError("Failed to convert argument "+keyval.first);
         }
-        PyDict_SetItemString(globDict, keyval.first.c_str(), item);
-        if (item != Py_True && item != Py_False) {
-            Py_XDECREF(item);
+        PyObject* key = internKey(bytecode.keys, argIndex++, keyval.first);
+        if (key == nullptr || locals == nullptr) {
+            PyErr_Clear();
+            Py_DECREF(item);
+            releaseViews(views);
+            throw ArgumentError("Failed to bind argument "+keyval.first);
         }
+        PyDict_SetItem(locals, key, item);
+        Py_DECREF(item);
     }
 
 #if PY_MAJOR_VERSION < 3
@@ -441,21 +1962,156 @@ Variant PyWrapper::eval(const PyWrapper::ByteCode& bytecode, const std::map<std:
 #endif
     if (code == nullptr)
     {
+        releaseViews(views);
         throw EvalError("Missing compiled code");
     }
 
-    PyObject *r = PyEval_EvalCode(code, globDict, locDict);
+    numEvals.fetch_add(1, std::memory_order_relaxed);
+    if (timing) {
+        timing->evalStart = clockNs();
+    }
+    PyObject *r = PyEval_EvalCode(code, globals(), locals);
+    if (timing) {
+        timing->evalEnd = clockNs();
+    }
+    if (locals != globals()) {
+        publishAssigned(locals, bytecode.keys, argIndex);
+    }
+    if (r == nullptr) {
+        numExceptions.fetch_add(1, std::memory_order_relaxed);
+        bool timeout = isTimeout();
+        if (debug) {
+            PyErr_Print();
+        }
+        PyErr_Clear();
+        releaseViews(views);
+        if (timeout) {
+            throw TimeoutError();
+        }
+        throw EvalError("Failed to evaluate Python code");
+    }
+
+    if (isAwaitable(r, awaiter)) {
+        // Views are released by the awaiter once awaitable completes
+        std::vector<void*> pending(views.begin(), views.end());
+        bool scheduled = scheduleAwait(r, *awaiter, debug, timing, pending);
+        Py_DecRef(r);
+        if (!scheduled) {
+            releaseViews(views);
+            throw EvalError("Failed to schedule awaitable on asyncio loop");
+        }
+        return Variant();
+    }
+
+    Variant val;
+    bool converted = convert(r, val);
+    Py_DecRef(r);
+    releaseViews(views);
+
+    if (!converted) {
+        if (debug) {
+            PyErr_Print();
+        }
+        PyErr_Clear();
+        throw Variant::ConvertError("Failed to convert Python return value - unsupported type");
+    }
+    return val;
+}
+
+Variant PyWrapper::call(const PyWrapper::ByteCode& bytecode, const std::map<std::string, Variant>& args, bool debug, Timing* timing, Awaiter* awaiter)
+{
+    PyGIL gil;
+
+    auto function = reinterpret_cast<PyObject*>(bytecode.code);
+    if (function == nullptr || !PyFunction_Check(function)) {
+        return eval(bytecode, args, debug, timing, awaiter);
+    }
+    if (args.size() != bytecode.keys.size()) {
+        throw ArgumentError("Arguments don't match compiled function");
+    }
+
+    // Slot in front of arguments allows vectorcall to prepend self
+    // without copying. Records with many fields use heap.
+    PyObject* stack[16];
+    std::vector<PyObject*> heap;
+    PyObject** argv = stack;
+    if (args.size() + 1 > sizeof(stack)/sizeof(stack[0])) {
+        heap.resize(args.size() + 1);
+        argv = heap.data();
+    }
+
+    std::vector<PyObject*> views;
+    size_t nargs = 0;
+    for (auto& keyval: args) {
+        PyObject* item = nullptr;
+        if (keyval.first == bytecode.keys[nargs].first) {
+            item = toPyObject(keyval.second, views);
+        }
+        if (item == nullptr) {
+            PyErr_Clear();
+            for (size_t i = 1; i <= nargs; i++) {
+                Py_DECREF(argv[i]);
+            }
+            releaseViews(views);
+            throw ArgumentError("Failed to convert argument "+keyval.first);
+        }
+        argv[++nargs] = item;
+    }
+
+    numEvals.fetch_add(1, std::memory_order_relaxed);
+    if (timing) {
+        timing->evalStart = clockNs();
+    }
+#if PY_VERSION_HEX >= 0x03090000
+    PyObject* r = PyObject_Vectorcall(function, argv + 1, nargs | PY_VECTORCALL_ARGUMENTS_OFFSET, nullptr);
+#elif PY_VERSION_HEX >= 0x03080000
+    PyObject* r = _PyObject_Vectorcall(function, argv + 1, nargs | PY_VECTORCALL_ARGUMENTS_OFFSET, nullptr);
+#else
+    PyObject* tuple = PyTuple_New(nargs);
+    for (size_t i = 0; i < nargs; i++) {
+        Py_INCREF(argv[i + 1]);
+        PyTuple_SET_ITEM(tuple, i, argv[i + 1]);
+    }
+    PyObject* r = PyObject_CallObject(function, tuple);
+    Py_DECREF(tuple);
+#endif
+    if (timing) {
+        timing->evalEnd = clockNs();
+    }
+    for (size_t i = 1; i <= nargs; i++) {
+        Py_DECREF(argv[i]);
+    }
+
     if (r == nullptr) {
+        numExceptions.fetch_add(1, std::memory_order_relaxed);
+        bool timeout = isTimeout();
         if (debug) {
             PyErr_Print();
         }
         PyErr_Clear();
+        releaseViews(views);
+        if (timeout) {
+            throw TimeoutError();
+        }
         throw EvalError("Failed to evaluate Python code");
     }
 
+    if (isAwaitable(r, awaiter)) {
+        // Views are released by the awaiter once awaitable completes
+        std::vector<void*> pending(views.begin(), views.end());
+        bool scheduled = scheduleAwait(r, *awaiter, debug, timing, pending);
+        Py_DecRef(r);
+        if (!scheduled) {
+            releaseViews(views);
+            throw EvalError("Failed to schedule awaitable on asyncio loop");
+        }
+        return Variant();
+    }
+
     Variant val;
     bool converted = convert(r, val);
     Py_DecRef(r);
+    releaseViews(views);
 
     if (!converted) {
         if (debug) {
@@ -470,13 +2126,22 @@ Variant PyWrapper::eval(const PyWrapper::ByteCode& bytecode, const std::map<std:
 Variant PyWrapper::exec(const std::string &code, const std::map<std::string, Variant> &args, bool debug)
 {
     auto bytecode = compile(code, true);
+
+    // Run in the shared namespace, ie. imports from IOC shell are global
+    {
+        PyGIL gil;
+        Py_XDECREF(reinterpret_cast<PyObject*>(bytecode.locals));
+        Py_INCREF(globals());
+        bytecode.locals = globals();
+    }
+
     try {
         auto r = eval(bytecode, args, true);
         destroy(std::move(bytecode));
         return r;
     } catch (...) {
         destroy(std::move(bytecode));
-        throw std::current_exception();
+        throw;
     }
 }
 
@@ -484,5 +2149,24 @@ void PyWrapper::destroy(PyWrapper::ByteCode&& bytecode)
 {
     PyGIL gil;
     Py_XDECREF(reinterpret_cast<PyObject *>(bytecode.code));
+    Py_XDECREF(reinterpret_cast<PyObject *>(bytecode.locals));
+    for (auto& key: bytecode.keys) {
+        Py_XDECREF(reinterpret_cast<PyObject *>(key.second));
+    }
     bytecode.code = nullptr;
+    bytecode.locals = nullptr;
+    bytecode.keys.clear();
+}
+
+PyWrapper::Counters PyWrapper::counters()
+{
+    Counters c;
+    c.evals = numEvals.load(std::memory_order_relaxed);
+    c.exceptions = numExceptions.load(std::memory_order_relaxed);
+    c.iointrPushes = numIointrPushes.load(std::memory_order_relaxed);
+    c.gilAcquired = gilAcquired.load(std::memory_order_relaxed);
+    c.gilWaitNs = gilWaitNs.load(std::memory_order_relaxed);
+    c.gilHoldNs = gilHoldNs.load(std::memory_order_relaxed);
+    c.heapBlocks = heapBlocks.load(std::memory_order_relaxed);
+    return c;
 }
@@ -8,9 +8,13 @@
 
 #include "variant.h"
 
+#include <atomic>
+#include <cstdint>
+#include <exception>
 #include <functional>
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 class PyWrapper {
@@ -43,6 +47,16 @@ class PyWrapper {
                 }
         };
 
+        /**
+         * @brief Python code raised TimeoutError, ie. interrupted by interrupt().
+         */
+        class TimeoutError : public EvalError
+        {
+            public:
+                TimeoutError(const std::string& reason="Python code timed out")
+                : EvalError(reason) {}
+        };
+
         class ArgumentError : public std::exception
         {
             private:
@@ -57,11 +71,23 @@ class PyWrapper {
                 }
         };
 
+        /**
+         * @brief Compiled Python code with its own namespace.
+         *
+         * Arguments are bound into a namespace owned by the bytecode,
+         * names not found there are looked up in the shared globals.
+         * Names assigned by the code are moved to the shared globals
+         * after each evaluation, so other records can read them.
+         * Names of arguments are converted to interned Python strings
+         * once and reused on every evaluation.
+         */
         struct ByteCode
         {
             private:
                 void* code;
-                ByteCode(void*);
+                void* locals;
+                mutable std::vector<std::pair<std::string, void*>> keys;
+                ByteCode(void* code, void* locals);
                 ByteCode(ByteCode &) = delete;
                 ByteCode &operator=(const ByteCode &) = delete;
                 friend class PyWrapper;
@@ -71,15 +97,225 @@ class PyWrapper {
                 ByteCode(ByteCode&&);
                 ByteCode& operator=(ByteCode&&);
                 ~ByteCode();
+                explicit operator bool() const { return code != nullptr; }
+        };
+        /**
+         * @brief Hold the GIL across several PyWrapper calls.
+         *
+         * PyWrapper functions lock the GIL on their own. While a session
+         * is open in the same thread, they only re-enter the lock which
+         * avoids handing the GIL over to other threads in between.
+         * Python may still switch threads while executing Python code.
+         */
+        class Session
+        {
+            private:
+                void* gil;
+                Session(const Session&) = delete;
+                Session& operator=(const Session&) = delete;
+
+            public:
+                Session();
+
+                /**
+                 * @brief Open session only when GIL is readily available.
+                 *
+                 * With wait=false the GIL is only taken when no other
+                 * PyDevice thread holds or waits for it, or when calling
+                 * thread holds it already. Sub-interpreter threads never
+                 * get the session this way.
+                 *
+                 * @param wait Block until GIL is available, like Session()
+                 */
+                explicit Session(bool wait);
+                ~Session();
+
+                /**
+                 * @brief Check whether session holds the GIL.
+                 */
+                explicit operator bool() const { return gil != nullptr; }
+        };
+
+        /**
+         * @brief Identifies thread executing Python code, see interrupt().
+         */
+        struct ThreadId {
+            unsigned long ident;    // Python thread identifier
+            void* interp;           // Thread's sub-interpreter, nullptr for main
         };
+
+        /**
+         * @brief Timestamps of Python code execution, steady clock ns.
+         */
+        struct Timing {
+            int64_t evalStart;      // Arguments converted, Python code starts
+            int64_t evalEnd;        // Python code returned, result not converted yet
+        };
+
+        /**
+         * @brief Cumulative runtime counters since init().
+         */
+        struct Counters {
+            uint64_t evals;         // Calls to eval() and call()
+            uint64_t exceptions;    // Evaluations that raised an exception
+            uint64_t iointrPushes;  // Values pushed with pydev.iointr()
+            uint64_t gilAcquired;   // Outermost GIL acquisitions by PyWrapper
+            uint64_t gilWaitNs;     // Time spent waiting for GIL
+            uint64_t gilHoldNs;     // Time GIL was held by PyWrapper
+            int64_t heapBlocks;     // Memory blocks allocated by Python, -1 when unknown
+        };
+
         using Callback = std::function<void()>;
-    private:
+
+        /**
+         * @brief Completion of awaitable returned by Python code, see call().
+         *
+         * Embedded in record context. When code evaluated in the main
+         * interpreter returns a coroutine or other awaitable, call()
+         * schedules it on PyDevice asyncio loop and returns right away,
+         * so the worker is free for other records. Loop thread converts
+         * the result once awaitable completes and done is invoked, record
+         * then takes the result with result().
+         */
+        class Awaiter
+        {
+            private:
+                enum State { IDLE, SCHEDULED, DETACHED, READY };
+                std::atomic<int> state{IDLE};
+                bool debug{false};
+                Timing* timing{nullptr};
+                Variant value;
+                std::exception_ptr error;
+                std::vector<void*> views;   // Memoryviews of arguments, released on completion
+                Awaiter(const Awaiter&) = delete;
+                Awaiter& operator=(const Awaiter&) = delete;
+                friend class PyWrapper;
+
+            public:
+                Callback done;              // Invoked from loop thread once result is ready
+                double timeout{0.0};        // Awaitable is cancelled after this many seconds, 0 for unlimited
+
+                Awaiter() {}
+
+                /**
+                 * @brief Check whether last call() scheduled awaitable, hand it over to the loop.
+                 *
+                 * Must be called by the thread that called call() right
+                 * after it returns. done is never invoked before, so the
+                 * caller can't race with record completion. When true is
+                 * returned, caller must not touch the record any more.
+                 */
+                bool detach();
+
+                /**
+                 * @brief Check whether awaitable was scheduled and its result not taken yet.
+                 */
+                bool pending() const { return state.load(std::memory_order_acquire) != IDLE; }
+
+                /**
+                 * @brief Take result of completed awaitable.
+                 *
+                 * Only called after done was invoked. Exceptions are the
+                 * same as thrown by call() for code that completes
+                 * directly, ie. TimeoutError when awaitable timed out.
+                 */
+                Variant result();
+        };
+
+        /**
+         * @brief Value pushed with pydev.iointr(), converted when it was pushed.
+         *
+         * Arrays are copied into memory owned by the value, which never
+         * references Python objects. nullptr when the value could not be
+         * converted.
+         */
+        using IoIntrValue = std::shared_ptr<const Variant>;
+        using ValueCallback = std::function<void(const IoIntrValue& value)>;
+
+        /**
+         * @brief Convert Python object to Variant, GIL must be held.
+         *
+         * @param in PyObject to convert
+         * @return false when object type is not supported
+         */
         static bool convert(void* in, Variant& out);
-    public:
+
         static bool init();
         static void shutdown();
+
+        /**
+         * @brief Invoke callback whenever Python pushes new value of parameter.
+         *
+         * Callbacks registered for the same parameter are all invoked,
+         * in no particular order, from the thread calling pydev.iointr().
+         * The GIL is released while callbacks run.
+         */
         static void registerIoIntr(const std::string& name, const Callback& cb);
 
+        /**
+         * @brief Invoke callback with converted value whenever main interpreter pushes new value of parameter.
+         *
+         * Value is converted once per push and shared by all value
+         * callbacks of the parameter, values of parameters without value
+         * callbacks are never converted. Value callbacks are invoked
+         * before the other callbacks of the same push.
+         */
+        static void registerIoIntrValue(const std::string& name, const ValueCallback& cb);
+
+        /**
+         * @brief Push new value of parameter from native code, without taking the GIL.
+         *
+         * Value callbacks get the value as is and the other callbacks are
+         * invoked like for pydev.iointr() pushes. Main interpreter converts
+         * value to Python object only when pydev.iointr() reads it, other
+         * interpreters don't see it. Values of parameters no record or
+         * Python code has asked for are dropped.
+         *
+         * @param name Parameter name
+         * @param value New value, arrays must own their memory
+         */
+        static void pushIoIntr(const std::string& name, const IoIntrValue& value);
+
+        /**
+         * @brief Create sub-interpreter with its own GIL for calling thread.
+         *
+         * All PyWrapper functions invoked from this thread afterwards run
+         * in the sub-interpreter. Code compiled in one interpreter must not
+         * be used in another one. Requires Python 3.12 or later.
+         *
+         * @return true when sub-interpreter is bound to calling thread
+         */
+        static bool createInterpreter();
+
+        /**
+         * @brief Destroy sub-interpreter bound to calling thread, if any.
+         */
+        static void destroyInterpreter();
+
+        /**
+         * @brief Get identifier of the calling thread for interrupt().
+         */
+        static ThreadId currentThread();
+
+        /**
+         * @brief Raise TimeoutError in Python code running in another thread.
+         *
+         * Exception is raised asynchronously the next time the thread
+         * executes Python bytecode; blocking C calls are not interrupted.
+         * The check runs with the target interpreter's GIL held, and
+         * thread is only interrupted when the check returns true.
+         *
+         * @param thread Thread to be interrupted
+         * @param check Confirms thread still executes the code to be interrupted
+         * @return true when exception was scheduled
+         */
+        static bool interrupt(const ThreadId& thread, const std::function<bool()>& check);
+
+        /**
+         * @brief Cancel exception from interrupt() not yet raised in calling thread.
+         */
+        static void clearInterrupt();
+
         /**
          * @brief Compile Python code into bytecode
          * 
@@ -90,23 +326,69 @@ class PyWrapper {
          * 
          * @param code Python code to be compiled
          * @param debug Prints errors to the EPICS console.
+         * @param name File name of the code object, ie. owning record name,
+         *             shows up in tracebacks and profiles
          * @return ByteCode Compiled bytecode, must be destroyed after not used any more.
          */
-        static ByteCode compile(const std::string &code, bool debug);
+        static ByteCode compile(const std::string &code, bool debug, const std::string& name = "");
+
+        /**
+         * @brief Compile Python expression into a function
+         *
+         * Expression becomes the body of a Python function that takes params
+         * as positional arguments, which avoids any dictionary access when
+         * the function is called. Code that is not an expression, ie.
+         * 'import xxx', is compiled like with compile() above.
+         * This function runs under locked GIL environment.
+         *
+         * @param code Python code to be compiled
+         * @param params Names of function parameters, in the order of call() args
+         * @param debug Prints errors to the EPICS console.
+         * @param name File name of the code object, ie. owning record name
+         * @return ByteCode Compiled function, must be destroyed after not used any more.
+         */
+        static ByteCode compile(const std::string &code, const std::vector<std::string>& params, bool debug, const std::string& name = "");
 
         /**
          * @brief Evaluate previously compiled bytecode and return result.
          * 
          * Evaluating previously compiled bytecode will run the code and
-         * optionally return the result.
+         * optionally return the result. Arguments are bound in the bytecode's
+         * own namespace, which leaves shared globals intact. Names assigned
+         * by the code are also kept in that namespace.
          * This function runs under locked GIL environment.
          * 
          * @param bytecode Previously compiled bytecode
          * @param args Optional arguments passed to Python code, aka functions etc.
          * @param debug Prints errors to the EPICS console.
+         * @param timing Optional timestamps of code execution, set when code was evaluated
+         * @param awaiter Schedules returned awaitable on asyncio loop, see call()
          * @return Variant 
          */
-        static Variant eval(const ByteCode& bytecode, const std::map<std::string, Variant> &args, bool debug);
+        static Variant eval(const ByteCode& bytecode, const std::map<std::string, Variant> &args, bool debug, Timing* timing = nullptr, Awaiter* awaiter = nullptr);
+
+        /**
+         * @brief Call function compiled with params and return result.
+         *
+         * Arguments are passed positionally with a single vectorcall,
+         * args keys must match the params used at compile time.
+         * Bytecode compiled from statements is passed to eval().
+         * This function runs under locked GIL environment.
+         *
+         * With awaiter given, coroutine or other awaitable returned by
+         * code running in the main interpreter is scheduled on asyncio
+         * loop running in its own thread, which is started on first use.
+         * Function then returns empty Variant and awaiter.detach() returns
+         * true, array arguments stay valid until the awaitable completes.
+         *
+         * @param bytecode Function compiled with compile(code, params, debug)
+         * @param args Arguments in the same order as params
+         * @param debug Prints errors to the EPICS console.
+         * @param timing Optional timestamps of code execution, set when code was evaluated
+         * @param awaiter Schedules returned awaitable on asyncio loop instead of converting it
+         * @return Variant Value returned from Python code, if any.
+         */
+        static Variant call(const ByteCode& bytecode, const std::map<std::string, Variant> &args, bool debug, Timing* timing = nullptr, Awaiter* awaiter = nullptr);
 
         /**
          * @brief Execute (compile and eval) given Python code
@@ -114,6 +396,8 @@ class PyWrapper {
          * This is a convenience function that combines compiling Python
          * code and immediately evaluating it. This is useful when the code
          * is only specified once, for example when invoked from EPICS shell.
+         * Unlike eval(), the code runs in the shared global namespace so
+         * that imports and variables become visible to all records.
          * 
          * @param code Python code to be executed
          * @param args Optional arguments to the Python function
@@ -149,6 +433,20 @@ class PyWrapper {
          * @param bytecode Previously compiled bytecode, may be empty object.
          */
         static void destroy(ByteCode&& bytecode);
+
+        /**
+         * @brief Get runtime counters without taking the GIL.
+         *
+         * Heap size is sampled at most once a second when a thread
+         * releases the GIL, it is only as fresh as the last release.
+         */
+        static Counters counters();
+
+    private:
+        friend struct AwaitDone;
+        static bool scheduleAwait(void* awaitable, Awaiter& awaiter, bool debug, Timing* timing, std::vector<void*>& views);
+        static void completeAwait(Awaiter& awaiter, void* value, void* error);
+        static void stopAwait();
 };
 
 #endif // PYWRAPPER_H
@@ -0,0 +1,283 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#include "ringchannel.h"
+#include "pydevring.h"
+#include "pywrapper.h"
+#include "variant.h"
+
+#include <epicsThread.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+static int64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Convert message to native value, array and string values are copied
+ * out of the ring.
+ *
+ * Writers are other processes and may still modify the message, so its
+ * header is copied first and nothing past size bytes is read.
+ *
+ * @param size Message size checked by pydev_ring_peek()
+ * @param param Set to parameter name
+ * @return nullptr when message is malformed
+ */
+static PyWrapper::IoIntrValue toValue(const pydev_ring_msg* ptr, uint32_t size, std::string& param)
+{
+    pydev_ring_msg msg;
+    memcpy(&msg, ptr, sizeof(msg));
+    uint64_t len = (msg.type == PYDEV_RING_STRING ? msg.count :
+                    msg.type == PYDEV_RING_ARRAY ? (uint64_t)msg.count * pydev_ring_itemsize(msg.elem_type) : 8);
+    if (msg.name_len == 0 || sizeof(pydev_ring_msg) + pydev_ring_align(msg.name_len) + len > size) {
+        return nullptr;
+    }
+
+    param.assign(pydev_ring_msg_name(ptr), msg.name_len);
+    const void* value = reinterpret_cast<const uint8_t*>(ptr + 1) + pydev_ring_align(msg.name_len);
+    switch (msg.type) {
+        case PYDEV_RING_DOUBLE:
+        {
+            double v;
+            memcpy(&v, value, sizeof(v));
+            return std::make_shared<const Variant>(v);
+        }
+        case PYDEV_RING_INT64:
+        {
+            int64_t v;
+            memcpy(&v, value, sizeof(v));
+            return std::make_shared<const Variant>(static_cast<long long>(v));
+        }
+        case PYDEV_RING_STRING:
+            return std::make_shared<const Variant>(std::string(static_cast<const char*>(value), msg.count));
+        case PYDEV_RING_ARRAY:
+        {
+            if (pydev_ring_itemsize(msg.elem_type) == 0) {
+                return nullptr;
+            }
+            // Ring element types follow Variant::ElementType order
+            Variant::Array arr{static_cast<Variant::ElementType>(msg.elem_type), value, msg.count, nullptr};
+            return std::make_shared<const Variant>(arr.clone());
+        }
+        default:
+            return nullptr;
+    }
+}
+
+class RingDrain : public epicsThreadRunable {
+    public:
+        std::string name;
+        pydev_ring_header* ring;
+        pydev_ring_reader reader;
+        size_t mapSize;
+        double poll;
+        epicsThread thread;
+        std::atomic<bool> running{true};
+        std::atomic<uint64_t> received{0};
+        std::atomic<uint64_t> malformed{0};
+        std::atomic<bool> corrupt{false};
+        std::atomic<int64_t> stalledSince{0};
+
+        RingDrain(const std::string& name_, pydev_ring_header* ring_, size_t mapSize_, double poll_)
+        : name(name_)
+        , ring(ring_)
+        , mapSize(mapSize_)
+        , poll(poll_)
+        , thread(*this, ("pydevRing:" + name_).c_str(), epicsThreadGetStackSize(epicsThreadStackSmall), epicsThreadPriorityHigh)
+        {
+            pydev_ring_reader_init(&reader, ring);
+            thread.start();
+        }
+
+        ~RingDrain()
+        {
+            running = false;
+            thread.exitWait();
+#ifndef _WIN32
+            munmap(ring, mapSize);
+#endif
+        }
+
+        /**
+         * Drain messages in batches. Only the last value of each parameter
+         * in a batch is pushed, records can't process faster than that
+         * anyway, batch size bounds the latency of the first message.
+         *
+         * Draining stops for good once a message with invalid size is
+         * found, there's no telling where the next one starts. A reserved
+         * message that doesn't get published is tracked as a stall.
+         */
+        void run() override
+        {
+            const size_t maxBatch = 1024;
+            std::vector<std::pair<std::string, PyWrapper::IoIntrValue>> batch;
+            std::unordered_map<std::string, size_t> seen;
+            std::string param;
+            batch.reserve(maxBatch);
+
+            while (running) {
+                size_t n = 0;
+                const pydev_ring_msg* msg;
+                while (n < maxBatch && (msg = pydev_ring_peek(&reader)) != nullptr) {
+                    auto value = toValue(msg, reader.len, param);
+                    pydev_ring_release(&reader, msg);
+                    n++;
+                    if (!value) {
+                        malformed.fetch_add(1, std::memory_order_relaxed);
+                        continue;
+                    }
+                    auto it = seen.emplace(param, batch.size());
+                    if (it.second) {
+                        batch.emplace_back(param, std::move(value));
+                    } else {
+                        batch[it.first->second].second = std::move(value);
+                    }
+                }
+                if (reader.corrupt && !corrupt) {
+                    corrupt = true;
+                    printf("PyDevice: ring '%s' is corrupt at position %llu, stopped draining\n",
+                           name.c_str(), (unsigned long long)reader.head);
+                }
+                if (n == 0) {
+                    if (corrupt) {
+                        break;
+                    }
+                    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+                    if (tail == reader.head) {
+                        stalledSince = 0;
+                    } else if (stalledSince == 0) {
+                        stalledSince = now();
+                    }
+                    epicsThreadSleep(poll);
+                    continue;
+                }
+                stalledSince = 0;
+
+                received.fetch_add(n, std::memory_order_relaxed);
+                for (auto& entry: batch) {
+                    PyWrapper::pushIoIntr(entry.first, entry.second);
+                }
+                batch.clear();
+                seen.clear();
+            }
+        }
+};
+
+static std::mutex g_mutex;
+static std::vector<std::unique_ptr<RingDrain>> g_rings;
+
+bool RingChannel::open(const std::string& name, size_t size, double poll)
+{
+#ifdef _WIN32
+    printf("PyDevice: shared memory rings are not supported on this platform\n");
+    return false;
+#else
+    std::lock_guard<std::mutex> lock(g_mutex);
+    for (auto& drain: g_rings) {
+        if (drain->name == name) {
+            printf("PyDevice: ring '%s' already open\n", name.c_str());
+            return false;
+        }
+    }
+
+    uint64_t dataSize = 64;
+    while (dataSize < size) {
+        dataSize <<= 1;
+    }
+
+    std::string path = "/" + name;
+    int fd = shm_open(path.c_str(), O_RDWR | O_CREAT, 0660);
+    if (fd < 0) {
+        printf("PyDevice: failed to open shared memory '%s': %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    // Attach existing ring as is, writers may still have it mapped
+    struct stat st;
+    bool attach = false;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(pydev_ring_header)) {
+        void* mem = mmap(nullptr, sizeof(pydev_ring_header), PROT_READ, MAP_SHARED, fd, 0);
+        if (mem != MAP_FAILED) {
+            auto header = static_cast<pydev_ring_header*>(mem);
+            if (pydev_ring_valid(header) && static_cast<uint64_t>(st.st_size) >= PYDEV_RING_DATA + header->size) {
+                attach = true;
+                dataSize = header->size;
+            }
+            munmap(mem, sizeof(pydev_ring_header));
+        }
+    }
+
+    size_t mapSize = PYDEV_RING_DATA + dataSize;
+    if (!attach && (ftruncate(fd, 0) != 0 || ftruncate(fd, mapSize) != 0)) {
+        printf("PyDevice: failed to resize shared memory '%s': %s\n", path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+    void* mem = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        printf("PyDevice: failed to map shared memory '%s': %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto ring = static_cast<pydev_ring_header*>(mem);
+    if (!attach) {
+        pydev_ring_init(ring, dataSize);
+    }
+    g_rings.emplace_back(new RingDrain(name, ring, mapSize, poll));
+    return true;
+#endif
+}
+
+void RingChannel::report()
+{
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (g_rings.empty()) {
+        printf("No rings open\n");
+    }
+    for (auto& drain: g_rings) {
+        auto ring = drain->ring;
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        printf("Ring '%s', %llu bytes, %llu used, %llu received, %llu dropped, %llu malformed\n", drain->name.c_str(),
+               (unsigned long long)drain->reader.size, (unsigned long long)(tail - head), (unsigned long long)drain->received.load(),
+               (unsigned long long)__atomic_load_n(&ring->dropped, __ATOMIC_RELAXED), (unsigned long long)drain->malformed.load());
+        // Writers publish within microseconds, a longer stall means one died
+        // between reserving and publishing a message. Either way the shared
+        // memory object must be removed, restarted IOC would attach it as is
+        int64_t since = drain->stalledSince;
+        if (drain->corrupt) {
+            printf("    corrupt, not draining any more\n");
+        } else if (since != 0 && now() - since > 1000000000) {
+            printf("    stalled for %.0f s waiting for message at position %llu\n",
+                   (now() - since) * 1e-9, (unsigned long long)head);
+        }
+    }
+}
+
+void RingChannel::shutdown()
+{
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_rings.clear();
+}
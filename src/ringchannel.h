@@ -0,0 +1,46 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#ifndef RINGCHANNEL_H
+#define RINGCHANNEL_H
+
+#include <string>
+
+/**
+ * @brief Shared memory rings through which external processes push I/O Intr values.
+ *
+ * Each ring is drained by its own native thread, which converts messages
+ * to native values and passes them to PyWrapper::pushIoIntr(). Records
+ * reading those parameters complete without running Python and the GIL
+ * is never taken by the drain thread. Protocol is described in pydevring.h.
+ */
+class RingChannel {
+    public:
+        /**
+         * @brief Create or attach shared memory ring and start draining it.
+         *
+         * Existing ring with a valid header is attached as is, so writers
+         * can keep it mapped while IOC restarts, otherwise the shared
+         * memory object is (re)sized and initialized.
+         *
+         * @param name Shared memory object name, without leading slash
+         * @param size Bytes in data area, rounded up to power of two
+         * @param poll Seconds to sleep when ring is empty
+         * @return false when ring could not be created or is already open
+         */
+        static bool open(const std::string& name, size_t size, double poll);
+
+        /**
+         * @brief Print state and counters of all rings.
+         */
+        static void report();
+
+        /**
+         * @brief Stop all drain threads and unmap rings.
+         */
+        static void shutdown();
+};
+
+#endif // RINGCHANNEL_H
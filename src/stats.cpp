@@ -0,0 +1,191 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#include "stats.h"
+
+#include <dbCommon.h>
+#include <epicsString.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+static Histogram<uint64_t> g_stages[RecordStats::NUM_STAGES];
+
+// Records are registered at init and never removed, like the records
+static std::mutex g_mutex;
+static std::vector<RecordStats*> g_records;
+
+static const char* stageNames[RecordStats::NUM_STAGES] = {
+    "queue", "gil", "marshal", "eval", "convert", "callback", "total"
+};
+
+RecordStats::RecordStats()
+    : type("")
+    , queued(0)
+    , began(0)
+    , ended(0)
+{
+    timing.evalStart = timing.evalEnd = 0;
+}
+
+void RecordStats::init(dbCommon* rec, const char* type_)
+{
+    name = rec->name;
+    type = type_;
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_records.push_back(this);
+}
+
+void RecordStats::add(Stage s, int64_t ns)
+{
+    stages[s].add(ns);
+    g_stages[s].add(ns);
+}
+
+void RecordStats::begin(const TaskNode& task)
+{
+    began = now();
+    queued = task.queued;
+    ended = 0;
+    timing.evalStart = timing.evalEnd = 0;
+    add(QUEUE, task.started - task.queued);
+    add(GIL, task.gilWait);
+}
+
+void RecordStats::end()
+{
+    ended = now();
+    if (timing.evalStart != 0) {
+        add(MARSHAL, timing.evalStart - began);
+        add(EVAL, timing.evalEnd - timing.evalStart);
+        add(CONVERT, ended - timing.evalEnd);
+    }
+}
+
+void RecordStats::complete()
+{
+    // Failed records don't get here through end()
+    if (ended != 0) {
+        int64_t t = now();
+        add(CALLBACK, t - ended);
+        add(TOTAL, t - queued);
+        ended = 0;
+    }
+}
+
+const char* RecordStats::stageName(Stage s)
+{
+    return (s < NUM_STAGES ? stageNames[s] : "");
+}
+
+RecordStats::Stage RecordStats::findStage(const std::string& name)
+{
+    for (unsigned s = 0; s < NUM_STAGES; s++) {
+        if (epicsStrCaseCmp(name.c_str(), stageNames[s]) == 0) {
+            return static_cast<Stage>(s);
+        }
+    }
+    return NUM_STAGES;
+}
+
+template<typename T>
+static void printStage(const char* label, const Histogram<T>& h)
+{
+    printf("%-30s %-10llu %-9.1f %-9.1f %-9.1f %-9.1f %.1f\n", label, (unsigned long long)h.count(),
+           h.mean() * 1e-3, h.percentile(50) * 1e-3, h.percentile(90) * 1e-3, h.percentile(99) * 1e-3, h.max() * 1e-3);
+}
+
+static void printHeader(const char* first)
+{
+    printf("%-30s %-10s %-9s %-9s %-9s %-9s %s\n", first, "count", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+}
+
+void RecordStats::print(unsigned topN, Stage sortBy)
+{
+    printHeader("Stage");
+    for (unsigned s = 0; s < NUM_STAGES; s++) {
+        printStage(stageNames[s], g_stages[s]);
+    }
+
+    std::vector<RecordStats*> records;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        records = g_records;
+    }
+    if (topN == 0 || records.empty()) {
+        return;
+    }
+
+    std::vector<std::pair<int64_t, RecordStats*>> sorted;
+    for (auto rec: records) {
+        sorted.emplace_back(rec->stages[sortBy].percentile(99), rec);
+    }
+    topN = std::min<size_t>(topN, sorted.size());
+    std::partial_sort(sorted.begin(), sorted.begin() + topN, sorted.end(),
+                      [](const std::pair<int64_t, RecordStats*>& a, const std::pair<int64_t, RecordStats*>& b) {
+                          return a.first > b.first;
+                      });
+
+    printf("\nTop %u records by p99 %s time\n", topN, stageNames[sortBy]);
+    printHeader("Record");
+    for (unsigned i = 0; i < topN; i++) {
+        printStage(sorted[i].second->name.c_str(), sorted[i].second->stages[sortBy]);
+    }
+}
+
+void RecordStats::report(const char* type, int level)
+{
+    std::vector<RecordStats*> records;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        for (auto rec: g_records) {
+            if (strcmp(rec->type, type) == 0) {
+                records.push_back(rec);
+            }
+        }
+    }
+    if (records.empty()) {
+        return;
+    }
+
+    Histogram<uint64_t> stages[NUM_STAGES];
+    for (auto rec: records) {
+        for (unsigned s = 0; s < NUM_STAGES; s++) {
+            stages[s].merge(rec->stages[s]);
+        }
+    }
+    printf("    %zu %s records\n", records.size(), type);
+    printf("    ");
+    printHeader("Stage");
+    for (unsigned s = 0; s < NUM_STAGES; s++) {
+        printf("    ");
+        printStage(stageNames[s], stages[s]);
+    }
+
+    if (level > 0) {
+        printf("    ");
+        printHeader("Record total");
+        for (auto rec: records) {
+            printf("    ");
+            printStage(rec->name.c_str(), rec->stages[TOTAL]);
+        }
+    }
+}
+
+void RecordStats::reset()
+{
+    for (auto& h: g_stages) {
+        h.reset();
+    }
+    std::lock_guard<std::mutex> lock(g_mutex);
+    for (auto rec: g_records) {
+        for (auto& h: rec->stages) {
+            h.reset();
+        }
+    }
+}
@@ -0,0 +1,223 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "pywrapper.h"
+#include "taskqueue.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+struct dbCommon;
+
+/**
+ * @brief Lock-free histogram of durations with power of 2 buckets.
+ *
+ * Bucket i counts durations in [2^(i+6), 2^(i+7)) ns, first bucket also
+ * counts anything shorter and the last one anything longer. Percentiles
+ * are reported as the upper bound of their bucket, which is accurate
+ * within factor of 2. Counter type lets per-record histograms use less
+ * memory than global ones.
+ */
+template<typename T>
+class Histogram {
+    public:
+        static const unsigned NUM_BUCKETS = 32;
+        static const unsigned MIN_SHIFT = 6;
+
+        Histogram()
+        {
+            reset();
+        }
+
+        void add(int64_t ns)
+        {
+            buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+            total.fetch_add(ns > 0 ? ns : 0, std::memory_order_relaxed);
+            int64_t prev = maximum.load(std::memory_order_relaxed);
+            while (ns > prev && !maximum.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+        }
+
+        template<typename U>
+        void merge(const Histogram<U>& other)
+        {
+            for (unsigned i = 0; i < NUM_BUCKETS; i++) {
+                buckets[i].fetch_add(other.buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+            total.fetch_add(other.total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            int64_t ns = other.maximum.load(std::memory_order_relaxed);
+            int64_t prev = maximum.load(std::memory_order_relaxed);
+            while (ns > prev && !maximum.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+        }
+
+        void reset()
+        {
+            for (auto& b: buckets) {
+                b.store(0, std::memory_order_relaxed);
+            }
+            total.store(0, std::memory_order_relaxed);
+            maximum.store(0, std::memory_order_relaxed);
+        }
+
+        uint64_t count() const
+        {
+            uint64_t n = 0;
+            for (auto& b: buckets) {
+                n += b.load(std::memory_order_relaxed);
+            }
+            return n;
+        }
+
+        int64_t mean() const
+        {
+            uint64_t n = count();
+            return (n > 0 ? total.load(std::memory_order_relaxed) / n : 0);
+        }
+
+        int64_t max() const
+        {
+            return maximum.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Upper bound of duration in ns not exceeded by pct percent of samples.
+         */
+        int64_t percentile(double pct) const
+        {
+            uint64_t n = count();
+            if (n == 0) {
+                return 0;
+            }
+            uint64_t target = static_cast<uint64_t>(n * pct / 100.0 + 0.5);
+            uint64_t seen = 0;
+            for (unsigned i = 0; i < NUM_BUCKETS - 1; i++) {
+                seen += buckets[i].load(std::memory_order_relaxed);
+                if (seen >= target && seen > 0) {
+                    int64_t upper = int64_t(1) << (i + MIN_SHIFT + 1);
+                    return (upper < max() ? upper : max());
+                }
+            }
+            return max();
+        }
+
+    private:
+        template<typename U> friend class Histogram;
+
+        std::atomic<T> buckets[NUM_BUCKETS];
+        std::atomic<uint64_t> total;        // Sum of all samples, ns
+        std::atomic<int64_t> maximum;
+
+        static unsigned bucket(int64_t ns)
+        {
+            if (ns < (int64_t(1) << (MIN_SHIFT + 1))) {
+                return 0;
+            }
+#ifdef __GNUC__
+            unsigned log2 = 63 - __builtin_clzll(static_cast<unsigned long long>(ns));
+#else
+            unsigned log2 = 0;
+            while ((ns >> log2) > 1) {
+                log2++;
+            }
+#endif
+            unsigned i = log2 - MIN_SHIFT;
+            return (i < NUM_BUCKETS ? i : NUM_BUCKETS - 1);
+        }
+};
+
+/**
+ * @brief Time spent in each stage of processing one record.
+ *
+ * Device support calls begin() right before collecting record fields,
+ * end() after the result has been stored into the record and complete()
+ * when the record completes, either in the callback or right after it
+ * has been run inline. Scheduler timestamps come from the record's task.
+ * Samples are added to record's own and to global histograms.
+ */
+class RecordStats {
+    public:
+        enum Stage {
+            QUEUE,      // Waiting in AsyncExec queue
+            GIL,        // Waiting for GIL before running the task
+            MARSHAL,    // Collecting record fields and converting them to Python
+            EVAL,       // Executing Python code
+            CONVERT,    // Converting Python result and storing it into record
+            CALLBACK,   // Callback hop back to the record completion
+            TOTAL,      // From scheduling to completion
+            NUM_STAGES
+        };
+
+        PyWrapper::Timing timing;
+
+        RecordStats();
+        RecordStats(const RecordStats&) = delete;
+        RecordStats& operator=(const RecordStats&) = delete;
+
+        /**
+         * @brief Register record for reports.
+         *
+         * @param rec Record owning these statistics
+         * @param type Record type name, same as given to report()
+         */
+        void init(dbCommon* rec, const char* type);
+
+        void begin(const TaskNode& task);
+        void end();
+        void complete();
+
+        const Histogram<uint32_t>& stage(Stage s) const
+        {
+            return stages[s];
+        }
+
+        static const char* stageName(Stage s);
+
+        /**
+         * @brief Find stage by case insensitive name.
+         *
+         * @return NUM_STAGES when not found
+         */
+        static Stage findStage(const std::string& name);
+
+        static int64_t now()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        /**
+         * @brief Print global per-stage latencies and records with the
+         *        highest 99th percentile of selected stage.
+         */
+        static void print(unsigned topN, Stage sortBy);
+
+        /**
+         * @brief Print statistics of records of one type, for dset report().
+         *
+         * @param type Record type name
+         * @param level 0 prints summary, higher levels print every record
+         */
+        static void report(const char* type, int level);
+
+        /**
+         * @brief Clear global and all per-record histograms.
+         */
+        static void reset();
+
+    private:
+        std::string name;
+        const char* type;
+        int64_t queued;
+        int64_t began;
+        int64_t ended;
+        Histogram<uint32_t> stages[NUM_STAGES];
+
+        void add(Stage s, int64_t ns);
+};
+
+#endif // STATS_H
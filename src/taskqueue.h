@@ -0,0 +1,260 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#ifndef TASKQUEUE_H
+#define TASKQUEUE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+/**
+ * @brief Intrusive queue node, embedded in the object being scheduled.
+ *
+ * Node can be linked in at most one queue at a time, it must not be
+ * enqueued again before it has been dequeued. Record's PACT guarantees
+ * that for device support.
+ */
+struct TaskNode {
+    void (*func)(void* arg);
+    void* arg;
+    std::atomic<TaskNode*> next;
+    int64_t queued;             // Set by scheduler when enqueued, ns
+    int64_t deadline;           // Set by scheduler, ns
+    int64_t started;            // Set by worker when task starts running, ns
+    int64_t gilWait;            // Time worker waited for GIL before running task, ns
+    int64_t budget;             // Max execution time set by scheduler, ns, 0 for unlimited
+    std::atomic<int64_t> cost;  // Moving average of execution time, ns
+
+    TaskNode() : func(nullptr), arg(nullptr), next(nullptr), queued(0), deadline(0), started(0), gilWait(0), budget(0), cost(0) {}
+    TaskNode(const TaskNode&) = delete;
+    TaskNode& operator=(const TaskNode&) = delete;
+
+    /**
+     * @brief Set function to be invoked with obj when task runs.
+     *
+     * Usage: node.bind<aiRecord, processRecordCb>(rec);
+     */
+    template<typename T, void (*Fn)(T*)>
+    void bind(T* obj)
+    {
+        func = [](void* ptr) { Fn(static_cast<T*>(ptr)); };
+        arg = obj;
+    }
+
+    void run()
+    {
+        func(arg);
+    }
+};
+
+/**
+ * @brief Lets consumers sleep until producers signal new work.
+ *
+ * Consumer announces intention to wait, re-checks its condition and only
+ * then blocks. Producer that published work in between bumps the epoch
+ * so the consumer doesn't block. Producers only touch the mutex when
+ * somebody is waiting.
+ */
+class EventCount {
+    private:
+        std::atomic<uint32_t> epoch{0};
+        std::atomic<uint32_t> waiters{0};
+        std::mutex mutex;
+        std::condition_variable cond;
+
+    public:
+        uint32_t prepareWait()
+        {
+            waiters.fetch_add(1, std::memory_order_seq_cst);
+            return epoch.load(std::memory_order_seq_cst);
+        }
+
+        void cancelWait()
+        {
+            waiters.fetch_sub(1, std::memory_order_seq_cst);
+        }
+
+        void commitWait(uint32_t key)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (epoch.load(std::memory_order_seq_cst) == key) {
+                cond.wait(lock);
+            }
+            lock.unlock();
+            waiters.fetch_sub(1, std::memory_order_seq_cst);
+        }
+
+        void notifyOne()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiters.load(std::memory_order_seq_cst) != 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                epoch.fetch_add(1, std::memory_order_seq_cst);
+                cond.notify_one();
+            }
+        }
+
+        void notifyAll()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiters.load(std::memory_order_seq_cst) != 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                epoch.fetch_add(1, std::memory_order_seq_cst);
+                cond.notify_all();
+            }
+        }
+};
+
+/**
+ * @brief FIFO queue of intrusive nodes, lock-free for producers, single consumer at a time.
+ *
+ * Enqueue never allocates or blocks, it's a single atomic exchange, so
+ * scan threads and I/O Intr callbacks never contend on a lock. Several
+ * threads may consume, but they serialize on a spin flag that is held
+ * while unlinking the head node, a handful of instructions; consumers
+ * are worker threads that are about to take the GIL anyway. Idle
+ * consumers park on an EventCount instead of polling.
+ *
+ * Based on Dmitry Vyukov's intrusive MPSC node-based queue.
+ */
+class TaskQueue {
+    private:
+        TaskNode stub;
+        std::atomic<TaskNode*> tail;    // Producers push here
+        TaskNode* head;                 // Guarded by consumer flag
+        std::atomic_flag consumer = ATOMIC_FLAG_INIT;
+        EventCount own;
+        EventCount* event;
+
+        void lock()
+        {
+            while (consumer.test_and_set(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+        }
+
+        void unlock()
+        {
+            consumer.clear(std::memory_order_release);
+        }
+
+        void push(TaskNode* node)
+        {
+            node->next.store(nullptr, std::memory_order_relaxed);
+            TaskNode* prev = tail.exchange(node, std::memory_order_acq_rel);
+            prev->next.store(node, std::memory_order_release);
+        }
+
+        TaskNode* pop()
+        {
+            TaskNode* node = head;
+            TaskNode* next = node->next.load(std::memory_order_acquire);
+            if (node == &stub) {
+                if (next == nullptr) {
+                    return nullptr;
+                }
+                head = node = next;
+                next = next->next.load(std::memory_order_acquire);
+            }
+            if (next != nullptr) {
+                head = next;
+                return node;
+            }
+            if (node != tail.load(std::memory_order_acquire)) {
+                // Producer is half-way through push, it notifies when done
+                return nullptr;
+            }
+            push(&stub);
+            next = node->next.load(std::memory_order_acquire);
+            if (next != nullptr) {
+                head = next;
+                return node;
+            }
+            return nullptr;
+        }
+
+    public:
+        /**
+         * @param shared Wake consumers through event shared by several
+         *               queues, dequeue() must not be used then
+         */
+        explicit TaskQueue(EventCount* shared = nullptr)
+        : tail(&stub)
+        , head(&stub)
+        , event(shared ? shared : &own)
+        {}
+        TaskQueue(const TaskQueue&) = delete;
+        TaskQueue& operator=(const TaskQueue&) = delete;
+
+        void enqueue(TaskNode* node)
+        {
+            push(node);
+            event->notifyOne();
+        }
+
+        TaskNode* tryDequeue()
+        {
+            lock();
+            TaskNode* node = pop();
+            unlock();
+            return node;
+        }
+
+        /**
+         * @brief Get scheduler timestamps of the oldest node without removing it.
+         *
+         * @return false when queue is empty
+         */
+        bool peek(int64_t& queued, int64_t& deadline)
+        {
+            lock();
+            TaskNode* node = head;
+            if (node == &stub) {
+                node = stub.next.load(std::memory_order_acquire);
+            }
+            if (node != nullptr) {
+                queued = node->queued;
+                deadline = node->deadline;
+            }
+            unlock();
+            return (node != nullptr);
+        }
+
+        /**
+         * @brief Wait for next node, or until running is cleared.
+         *
+         * Clear running before calling wakeAll() to stop consumers.
+         *
+         * @return Dequeued node or nullptr when woken without work
+         */
+        TaskNode* dequeue(const std::atomic<bool>& running)
+        {
+            TaskNode* node = tryDequeue();
+            if (node == nullptr) {
+                uint32_t key = event->prepareWait();
+                node = tryDequeue();
+                if (node != nullptr || !running) {
+                    event->cancelWait();
+                } else {
+                    event->commitWait(key);
+                    node = tryDequeue();
+                }
+            }
+            return node;
+        }
+
+        /**
+         * @brief Wake all waiting consumers, ie. on shutdown.
+         */
+        void wakeAll()
+        {
+            event->notifyAll();
+        }
+};
+
+#endif // TASKQUEUE_H
@@ -0,0 +1,107 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+/**
+ * Measure throughput of CPU bound Python code against number of workers.
+ *
+ * Every worker thread repeatedly calls its own compiled record function,
+ * like AsyncExec workers do. With regular Python the GIL serializes the
+ * workers and throughput stays flat. Free-threaded Python or per-worker
+ * sub-interpreters (pass "subinterp" argument) should scale with the
+ * number of cores.
+ *
+ * Usage: benchscaling [max workers] [seconds per step] [threads|subinterp]
+ */
+
+#include <pywrapper.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char* code = "sum(i * i for i in range(pydevN))";
+
+static unsigned long worker(bool subInterpreter, const std::atomic<bool>& start, const std::atomic<bool>& stop)
+{
+    unsigned long calls = 0;
+    if (subInterpreter && !PyWrapper::createInterpreter()) {
+        return 0;
+    }
+
+    std::map<std::string, Variant> args = {{ "pydevN", Variant(100) }};
+    auto fn = PyWrapper::compile(code, {"pydevN"}, true);
+
+    while (!start) {
+        std::this_thread::yield();
+    }
+    while (!stop) {
+        PyWrapper::call(fn, args, true);
+        calls++;
+    }
+
+    PyWrapper::destroy(std::move(fn));
+    if (subInterpreter) {
+        PyWrapper::destroyInterpreter();
+    }
+    return calls;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned maxWorkers = (argc > 1 ? strtoul(argv[1], nullptr, 10) : std::thread::hardware_concurrency());
+    double seconds      = (argc > 2 ? strtod(argv[2], nullptr) : 1.0);
+    bool subInterpreter = (argc > 3 && strcmp(argv[3], "subinterp") == 0);
+    if (maxWorkers == 0) {
+        maxWorkers = 1;
+    }
+
+    PyWrapper::init();
+    bool freeThreaded = PyWrapper::exec("not getattr(__import__('sys'), '_is_gil_enabled', lambda: True)()", true).get_bool();
+    printf("mode:    %s\n", subInterpreter ? "subinterp" : (freeThreaded ? "free-threaded" : "gil"));
+    printf("workers  calls/s      speedup\n");
+
+    double base = 0.0;
+    for (unsigned n = 1; n <= maxWorkers; n++) {
+        std::atomic<bool> start{false};
+        std::atomic<bool> stop{false};
+        std::vector<unsigned long> calls(n, 0);
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < n; i++) {
+            threads.emplace_back([&, i]() { calls[i] = worker(subInterpreter, start, stop); });
+        }
+
+        auto t0 = std::chrono::steady_clock::now();
+        start = true;
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        stop = true;
+        for (auto& thread: threads) {
+            thread.join();
+        }
+        auto t1 = std::chrono::steady_clock::now();
+
+        unsigned long total = 0;
+        for (auto c: calls) {
+            total += c;
+        }
+        if (total == 0) {
+            fprintf(stderr, "Sub-interpreters require Python 3.12+\n");
+            break;
+        }
+        double rate = total / std::chrono::duration<double>(t1 - t0).count();
+        if (n == 1) {
+            base = rate;
+        }
+        printf("%-8u %-12.0f %.2f\n", n, rate, base > 0.0 ? rate / base : 0.0);
+    }
+
+    PyWrapper::shutdown();
+    return 0;
+}
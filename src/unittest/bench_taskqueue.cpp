@@ -0,0 +1,203 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+/**
+ * Measure task queue throughput under contention.
+ *
+ * Producer threads emulate scan threads and I/O Intr callbacks, each one
+ * owns a set of records and schedules every record that is not already
+ * active. Consumer threads emulate AsyncExec workers. Intrusive TaskQueue
+ * is compared against mutex protected std::list of std::function, which
+ * AsyncExec used previously.
+ *
+ * Usage: benchtaskqueue [seconds per step] [records per producer]
+ */
+
+#include <taskqueue.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+static std::atomic<size_t> allocations{0};
+
+void* operator new(size_t size)
+{
+    allocations++;
+    void* ptr = malloc(size ? size : 1);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+struct Record {
+    TaskNode task;
+    std::atomic<bool> pact{false};
+    std::atomic<unsigned long>* processed;
+};
+
+static void process(Record* rec)
+{
+    rec->processed->fetch_add(1, std::memory_order_relaxed);
+    rec->pact.store(false, std::memory_order_release);
+}
+
+struct IntrusiveQueue {
+    TaskQueue que;
+
+    void schedule(Record* rec)
+    {
+        rec->task.bind<Record, process>(rec);
+        que.enqueue(&rec->task);
+    }
+
+    bool runOne(const std::atomic<bool>& running)
+    {
+        TaskNode* task = que.dequeue(running);
+        if (task == nullptr) {
+            return false;
+        }
+        task->run();
+        return true;
+    }
+
+    void stop()
+    {
+        que.wakeAll();
+    }
+};
+
+struct LockedQueue {
+    std::mutex mutex;
+    std::condition_variable event;
+    std::list<std::function<void()>> que;
+
+    void schedule(Record* rec)
+    {
+        std::function<void()> cb = [rec]() { process(rec); };
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            que.emplace_back(cb);
+        }
+        event.notify_one();
+    }
+
+    bool runOne(const std::atomic<bool>& running)
+    {
+        std::function<void()> cb;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (que.empty() && running) {
+                event.wait_for(lock, std::chrono::seconds(1));
+            }
+            if (que.empty()) {
+                return false;
+            }
+            cb = std::move(que.front());
+            que.pop_front();
+        }
+        cb();
+        return true;
+    }
+
+    void stop()
+    {
+        event.notify_all();
+    }
+};
+
+template<typename Queue>
+static void run(const char* name, unsigned producers, unsigned consumers, unsigned records, double seconds)
+{
+    Queue queue;
+    std::atomic<bool> running{true};
+    std::atomic<bool> producing{true};
+    std::atomic<unsigned long> processed{0};
+    std::atomic<unsigned long> scheduled{0};
+    std::vector<std::unique_ptr<Record>> recs;
+    for (unsigned i = 0; i < producers * records; i++) {
+        recs.emplace_back(new Record);
+        recs.back()->processed = &processed;
+    }
+
+    std::vector<std::thread> threads;
+    for (unsigned c = 0; c < consumers; c++) {
+        threads.emplace_back([&]() {
+            while (running) {
+                queue.runOne(running);
+            }
+        });
+    }
+
+    size_t allocs0 = allocations;
+    auto t0 = std::chrono::steady_clock::now();
+    for (unsigned p = 0; p < producers; p++) {
+        threads.emplace_back([&, p]() {
+            unsigned long n = 0;
+            while (producing) {
+                for (unsigned r = 0; r < records; r++) {
+                    Record* rec = recs[p * records + r].get();
+                    if (!rec->pact.exchange(true, std::memory_order_acquire)) {
+                        queue.schedule(rec);
+                        n++;
+                    }
+                }
+                std::this_thread::yield();
+            }
+            scheduled += n;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    producing = false;
+    for (unsigned i = consumers; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    // Let consumers drain what's left, then stop them
+    while (processed < scheduled) {
+        std::this_thread::yield();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    size_t allocs = allocations - allocs0;
+    running = false;
+    queue.stop();
+    for (unsigned i = 0; i < consumers; i++) {
+        threads[i].join();
+    }
+
+    double rate = processed / std::chrono::duration<double>(t1 - t0).count();
+    printf("%-10s %-9u %-9u %-12.0f %.2f\n", name, producers, consumers, rate,
+           double(allocs) / (scheduled ? scheduled.load() : 1));
+}
+
+int main(int argc, char* argv[])
+{
+    double seconds   = (argc > 1 ? strtod(argv[1], nullptr) : 1.0);
+    unsigned records = (argc > 2 ? strtoul(argv[2], nullptr, 10) : 100);
+
+    printf("queue      producers consumers tasks/s      allocs/task\n");
+    for (unsigned producers: {1, 4, 8}) {
+        for (unsigned consumers: {1, 4, 8}) {
+            run<LockedQueue>("locked", producers, consumers, records, seconds);
+            run<IntrusiveQueue>("intrusive", producers, consumers, records, seconds);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+/*************************************************************************\
+* PyDevice is distributed subject to a Software License Agreement found
+* in file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+/**
+ * Count heap allocations of Variant operations done on every record process.
+ *
+ * Record processing refreshes arguments for Python code, receives result
+ * from Python and copies it to the record. The steps are emulated here
+ * without Python to isolate Variant behaviour.
+ */
+
+#include <variant.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+static size_t allocations = 0;
+
+void* operator new(size_t size)
+{
+    allocations++;
+    void* ptr = malloc(size ? size : 1);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+static const size_t nelm = 1024;
+static epicsFloat64 waveform[nelm];
+static epicsFloat64 result[nelm];
+
+// Python code returned a list, converted element by element into vector
+static Variant pythonResult()
+{
+    std::vector<double> vals(nelm, 1.0);
+    return Variant(std::move(vals));
+}
+
+static void processRecord(std::map<std::string, Variant>& args)
+{
+    // FieldBinding::collect()
+    args["pydevVAL"]  = Variant::view(waveform, nelm);
+    args["pydevEGU"]  = Variant(std::string("mm"));
+    args["pydevHOPR"] = Variant(10.0);
+    args["pydevLOPR"] = Variant(-10.0);
+
+    // PyWrapper::eval() and device support
+    Variant val = pythonResult();
+    Variant::Array arr;
+    if (val.try_get(arr)) {
+        arr.copy(result, Variant::ElementType::DOUBLE, nelm);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    size_t loops = (argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000);
+    std::map<std::string, Variant> args;
+    processRecord(args); // allocate map nodes once, like FieldBinding::update()
+
+    allocations = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < loops; i++) {
+        processRecord(args);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+
+    printf("sizeof(Variant):        %zu bytes\n", sizeof(Variant));
+    printf("allocations/process:    %.2f\n", double(allocations) / loops);
+    printf("time/process:           %.0f ns\n", ns / loops);
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include <asyncexec.h>
+#include <pywrapper.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Item {
+    AsyncExec::Task task;
+    int id;
+};
+
+static std::mutex orderMutex;
+static std::vector<int> order;
+static std::atomic<bool> blocked{false};
+static std::atomic<bool> release{false};
+
+static void record(Item* item)
+{
+    std::lock_guard<std::mutex> lock(orderMutex);
+    order.push_back(item->id);
+}
+
+static void block(Item*)
+{
+    blocked = true;
+    while (!release) {
+        std::this_thread::yield();
+    }
+}
+
+static size_t numRun()
+{
+    std::lock_guard<std::mutex> lock(orderMutex);
+    return order.size();
+}
+
+struct TestAsyncExec {
+    static void mixedDeadlines()
+    {
+        // Only worker is kept busy until all tasks are queued
+        Item blocker;
+        blocker.task.bind<Item, block>(&blocker);
+        testOk1(AsyncExec::schedule(blocker.task));
+        while (!blocked) {
+            std::this_thread::yield();
+        }
+
+        AsyncExec::Options passive, fast, slow;
+        fast.period = 0.1;
+        slow.period = 10.0;
+        Item items[4];
+        const AsyncExec::Options* options[4] = { &passive, &fast, &slow, &passive };
+        for (int i = 0; i < 4; i++) {
+            items[i].id = i;
+            items[i].task.bind<Item, record>(&items[i]);
+            AsyncExec::schedule(items[i].task, *options[i]);
+        }
+        release = true;
+
+        for (int i = 0; i < 1000 && numRun() < 4; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        // Passive tasks neither overtake nor starve periodic ones
+        testOk1(order == std::vector<int>({1, 0, 3, 2}));
+    }
+};
+
+MAIN(testasyncexec)
+{
+    testPlan(2);
+
+    PyWrapper::init();
+    AsyncExec::init(1, 1, 0.001, false, true, 0.1, 0.0, 50e-6, 1.0);
+    TestAsyncExec::mixedDeadlines();
+    AsyncExec::shutdown();
+    PyWrapper::shutdown();
+
+    return testDone();
+}
@@ -0,0 +1,151 @@
+#include <pydevring.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static const uint64_t guardPattern = 0xa5a5a5a5a5a5a5a5ull;
+static const size_t guardWords = 16;
+
+struct TestPyDevRing {
+    std::vector<uint64_t> memory;
+    pydev_ring_header* ring;
+    pydev_ring_reader reader;
+
+    TestPyDevRing(uint64_t size)
+    : memory((PYDEV_RING_DATA + size) / sizeof(uint64_t) + guardWords, 0)
+    , ring(reinterpret_cast<pydev_ring_header*>(memory.data()))
+    {
+        pydev_ring_init(ring, size);
+        pydev_ring_reader_init(&reader, ring);
+        std::fill(memory.end() - guardWords, memory.end(), guardPattern);
+    }
+
+    bool guardIntact() const
+    {
+        return std::all_of(memory.end() - guardWords, memory.end(), [](uint64_t w) { return w == guardPattern; });
+    }
+
+    static void writeRead()
+    {
+        TestPyDevRing t(1024);
+        testOk1(pydev_ring_valid(t.ring));
+        testOk1(pydev_ring_peek(&t.reader) == nullptr);
+
+        double d = 1.5;
+        int32_t arr[] = {1, 2, 3};
+        testOk1(pydev_ring_write(t.ring, "param:d", PYDEV_RING_DOUBLE, 0, &d, 1) == 0);
+        testOk1(pydev_ring_write(t.ring, "param:s", PYDEV_RING_STRING, 0, "hello", 5) == 0);
+        testOk1(pydev_ring_write(t.ring, "param:a", PYDEV_RING_ARRAY, PYDEV_RING_INT32, arr, 3) == 0);
+
+        const pydev_ring_msg* msg = pydev_ring_peek(&t.reader);
+        testOk1(msg && msg->type == PYDEV_RING_DOUBLE && std::string(pydev_ring_msg_name(msg), msg->name_len) == "param:d" &&
+                *static_cast<const double*>(pydev_ring_msg_value(msg)) == 1.5);
+        pydev_ring_release(&t.reader, msg);
+
+        msg = pydev_ring_peek(&t.reader);
+        testOk1(msg && msg->type == PYDEV_RING_STRING && std::string(static_cast<const char*>(pydev_ring_msg_value(msg)), msg->count) == "hello");
+        pydev_ring_release(&t.reader, msg);
+
+        msg = pydev_ring_peek(&t.reader);
+        testOk1(msg && msg->type == PYDEV_RING_ARRAY && msg->count == 3 && static_cast<const int32_t*>(pydev_ring_msg_value(msg))[2] == 3);
+        pydev_ring_release(&t.reader, msg);
+
+        testOk1(pydev_ring_peek(&t.reader) == nullptr && t.ring->head == t.ring->tail);
+    }
+
+    static void wrap()
+    {
+        // Each message takes 40 bytes, the fourth one doesn't fit at the end
+        TestPyDevRing t(128);
+        int64_t v = 0;
+        bool ok = true;
+        for (v = 0; v < 3; v++) {
+            ok &= (pydev_ring_write(t.ring, "param:long", PYDEV_RING_INT64, 0, &v, 1) == 0);
+        }
+        testOk1(ok && pydev_ring_write(t.ring, "param:long", PYDEV_RING_INT64, 0, &v, 1) != 0);
+        testOk1(t.ring->dropped == 1);
+
+        for (int i = 0; i < 2; i++) {
+            pydev_ring_release(&t.reader, pydev_ring_peek(&t.reader));
+        }
+        testOk1(pydev_ring_write(t.ring, "param:long", PYDEV_RING_INT64, 0, &v, 1) == 0);
+        testOk1(t.ring->tail == 128 + 40);
+
+        // Padding is skipped
+        std::vector<int64_t> values;
+        const pydev_ring_msg* msg;
+        while ((msg = pydev_ring_peek(&t.reader)) != nullptr) {
+            values.push_back(*static_cast<const int64_t*>(pydev_ring_msg_value(msg)));
+            pydev_ring_release(&t.reader, msg);
+        }
+        testOk1(values == std::vector<int64_t>({2, 3}));
+    }
+
+    static void invalid()
+    {
+        TestPyDevRing t(128);
+        double d = 0;
+        testOk1(pydev_ring_write(t.ring, "", PYDEV_RING_DOUBLE, 0, &d, 1) != 0);
+        testOk1(pydev_ring_write(t.ring, "param", 99, 0, &d, 1) != 0);
+        testOk1(pydev_ring_write(t.ring, "param", PYDEV_RING_ARRAY, 42, &d, 1) != 0);
+        testOk1(pydev_ring_write(t.ring, std::string(100, 'x').c_str(), PYDEV_RING_DOUBLE, 0, &d, 1) != 0);
+
+        t.ring->magic = 0;
+        testOk1(!pydev_ring_valid(t.ring));
+    }
+
+    static void corrupt()
+    {
+        TestPyDevRing t(128);
+        double d = 1.5;
+        testOk1(pydev_ring_write(t.ring, "param:d", PYDEV_RING_DOUBLE, 0, &d, 1) == 0);
+        testOk1(pydev_ring_write(t.ring, "param:d", PYDEV_RING_DOUBLE, 0, &d, 1) == 0);
+        auto msg = reinterpret_cast<pydev_ring_msg*>(pydev_ring_data(t.ring));
+        uint32_t size = msg->size;
+
+        msg->size = size + 1;
+        testOk1(pydev_ring_peek(&t.reader) == nullptr && t.reader.corrupt);
+
+        // Stays corrupt even when size is restored, next position is unknown
+        msg->size = size;
+        testOk1(pydev_ring_peek(&t.reader) == nullptr && t.ring->head == 0);
+
+        // Message can't extend past the end of data area
+        TestPyDevRing big(128);
+        testOk1(pydev_ring_write(big.ring, "param:d", PYDEV_RING_DOUBLE, 0, &d, 1) == 0);
+        msg = reinterpret_cast<pydev_ring_msg*>(pydev_ring_data(big.ring));
+        msg->size = 1024;
+        testOk1(pydev_ring_peek(&big.reader) == nullptr && big.reader.corrupt);
+        testOk1(t.guardIntact() && big.guardIntact());
+
+        // Message can't be shorter than message header
+        TestPyDevRing small(128);
+        testOk1(pydev_ring_write(small.ring, "param:d", PYDEV_RING_DOUBLE, 0, &d, 1) == 0);
+        msg = reinterpret_cast<pydev_ring_msg*>(pydev_ring_data(small.ring));
+        msg->size = 8;
+        testOk1(pydev_ring_peek(&small.reader) == nullptr && small.reader.corrupt);
+
+        // Reader keeps its own copy of ring size
+        TestPyDevRing shrunk(128);
+        testOk1(pydev_ring_write(shrunk.ring, "param:d", PYDEV_RING_DOUBLE, 0, &d, 1) == 0);
+        shrunk.ring->size = 1ull << 40;
+        const pydev_ring_msg* ok = pydev_ring_peek(&shrunk.reader);
+        testOk1(ok != nullptr && shrunk.reader.size == 128 && shrunk.reader.len == ok->size);
+    }
+};
+
+MAIN(testpydevring)
+{
+    testPlan(30);
+
+    TestPyDevRing::writeRead();
+    TestPyDevRing::wrap();
+    TestPyDevRing::invalid();
+    TestPyDevRing::corrupt();
+
+    return testDone();
+}
@@ -1,11 +1,19 @@
+#include <Python.h>
+
 #include <util.h>
+#include <profiler.h>
 #include <pywrapper.h>
 
 #include <epicsUnitTest.h>
 #include <testMain.h>
 
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
 #include <map>
 #include <string>
+#include <thread>
 
 #define testOkExcept1(a) { \
     try { \
@@ -83,14 +91,503 @@ struct TestPyWrapper {
         testOk1(PyWrapper::exec("[1,2,3]").get_double_array() == cmpd);
         testOk1(PyWrapper::exec("[1,2,3]").get_string_array() == cmps);
     }
+
+    static void arrayArguments()
+    {
+        epicsFloat64 vd[] = {1.5, 2.5, 3.5};
+        epicsInt16 vs[] = {-1, 2, 300};
+        std::map<std::string, Variant> args = {
+            { "vd", Variant::view(vd, 3) },
+            { "vs", Variant::view(vs, 3) },
+        };
+        testOk1(PyWrapper::exec("sum(vd)", args, true).get_double() == 7.5);
+#if PY_MAJOR_VERSION >= 3
+        testOk1(PyWrapper::exec("vd.format", args, true).get_string() == "d");
+        testOk1(PyWrapper::exec("vd.readonly", args, true).get_bool() == true);
+        testOk1(PyWrapper::exec("vs.tolist()", args, true).get_long_array() == std::vector<long long int>({-1, 2, 300}));
+#else
+        // Python 2 gets arrays as lists
+        testOk1(PyWrapper::exec("isinstance(vd, list)", args, true).get_bool() == true);
+        testOk1(PyWrapper::exec("vd", args, true).get_double_array() == std::vector<double>({1.5, 2.5, 3.5}));
+        testOk1(PyWrapper::exec("vs", args, true).get_long_array() == std::vector<long long int>({-1, 2, 300}));
+#endif
+        testOk1(PyWrapper::exec("len(vs)", args, true).get_long() == 3);
+    }
+
+    static void strings()
+    {
+        // Non-ASCII characters are passed as UTF-8
+        testOk1(PyWrapper::exec("u'\\u00b0C'", true).get_string() == "\xc2\xb0" "C");
+        testOk1(PyWrapper::exec("[u'a', u'\\u00b5s']", true).get_string_vector() == std::vector<std::string>({"a", "\xc2\xb5s"}));
+        std::map<std::string, Variant> args = {{ "s", Variant("x\xc2\xb0y") }};
+        testOk1(PyWrapper::exec("s", args, true).get_string() == "x\xc2\xb0y");
+    }
+
+    static void namespaces()
+    {
+        auto first = PyWrapper::compile("pydevVAL", true);
+        auto second = PyWrapper::compile("pydevVAL", true);
+        std::map<std::string, Variant> args1 = {{ "pydevVAL", Variant(1) }};
+        std::map<std::string, Variant> args2 = {{ "pydevVAL", Variant(2) }};
+
+        testOk1(PyWrapper::eval(first, args1, true).get_long() == 1);
+        testOk1(PyWrapper::eval(second, args2, true).get_long() == 2);
+        testOk1(PyWrapper::eval(first, args1, true).get_long() == 1);
+        testOk1(PyWrapper::exec("'pydevVAL' in globals()", true).get_bool() == false);
+
+        PyWrapper::exec("shared = 42", true);
+        auto local = PyWrapper::compile("assigned = shared + pydevVAL", true);
+        PyWrapper::eval(local, args1, true);
+        testOk1(PyWrapper::exec("shared", true).get_long() == 42);
+
+        // Assignment in one record is visible to others, arguments are not
+        auto setter = PyWrapper::compile("b = pydevVAL", {"pydevVAL"}, true);
+        auto reader = PyWrapper::compile("b + assigned", {"pydevVAL"}, true);
+        PyWrapper::call(setter, args2, true);
+        testOk1(PyWrapper::call(reader, args1, true).get_long() == 45);
+        testOk1(PyWrapper::exec("'pydevVAL' in globals()", true).get_bool() == false);
+
+        PyWrapper::destroy(std::move(first));
+        PyWrapper::destroy(std::move(second));
+        PyWrapper::destroy(std::move(local));
+        PyWrapper::destroy(std::move(setter));
+        PyWrapper::destroy(std::move(reader));
+    }
+
+    static void functions()
+    {
+        std::map<std::string, Variant> args = {{ "pydevA", Variant(2) }, { "pydevB", Variant(1.5) }};
+        auto fn = PyWrapper::compile("pydevA * pydevB # comment", {"pydevA", "pydevB"}, true);
+        testOk1(PyWrapper::call(fn, args, true).get_double() == 3.0);
+        args["pydevA"] = Variant(4);
+        testOk1(PyWrapper::call(fn, args, true).get_double() == 6.0);
+        testOk1(PyWrapper::exec("'pydevA' in globals()", true).get_bool() == false);
+
+        std::map<std::string, Variant> other = {{ "pydevX", Variant(1) }, { "pydevY", Variant(1) }};
+        bool thrown = false;
+        try {
+            PyWrapper::call(fn, other, true);
+        } catch (PyWrapper::ArgumentError&) {
+            thrown = true;
+        }
+        testOk1(thrown);
+        PyWrapper::destroy(std::move(fn));
+
+        // Statements fall back to namespace evaluation
+        auto stmt = PyWrapper::compile("import math; x = pydevA", {"pydevA", "pydevB"}, true);
+        testOk1(PyWrapper::call(stmt, args, true).type == Variant::Type::NONE);
+        PyWrapper::destroy(std::move(stmt));
+
+        // Wrapping in parenthesis must not turn invalid code into an expression
+        thrown = false;
+        try {
+            PyWrapper::compile("1) + (2", {"pydevA"}, false);
+        } catch (PyWrapper::SyntaxError&) {
+            thrown = true;
+        }
+        testOk1(thrown);
+
+        epicsFloat64 vd[] = {1.0, 2.0};
+        std::map<std::string, Variant> arr = {{ "pydevVAL", Variant::view(vd, 2) }};
+        auto sum = PyWrapper::compile("sum(pydevVAL)", {"pydevVAL"}, true);
+        testOk1(PyWrapper::call(sum, arr, true).get_double() == 3.0);
+        PyWrapper::destroy(std::move(sum));
+    }
+
+    static void subInterpreters()
+    {
+        PyWrapper::exec("mainOnly = 1", true);
+
+        bool created = false;
+        long long inside = 0;
+        bool isolated = false;
+        std::thread worker([&]() {
+            created = PyWrapper::createInterpreter();
+            if (created) {
+                PyWrapper::exec("import math; value = math.factorial(5)", true);
+                inside = PyWrapper::exec("value", true).get_long();
+                isolated = !PyWrapper::exec("'mainOnly' in globals()", true).get_bool();
+                PyWrapper::destroyInterpreter();
+            }
+        });
+        worker.join();
+
+        if (!created) {
+            testSkip(3, "Sub-interpreters require Python 3.12+");
+            return;
+        }
+        testOk1(inside == 120);
+        testOk1(isolated);
+        testOk1(PyWrapper::exec("'value' in globals()", true).get_bool() == false);
+    }
+
+    static void interrupts()
+    {
+        PyWrapper::ThreadId id;
+        std::atomic<bool> started{false};
+        bool timedOut = false;
+        std::thread worker([&]() {
+            id = PyWrapper::currentThread();
+            started = true;
+            try {
+                PyWrapper::exec("while True: pass", false);
+            } catch (PyWrapper::TimeoutError&) {
+                timedOut = true;
+            } catch (...) {
+            }
+        });
+        while (!started) {
+            std::this_thread::yield();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        testOk1(PyWrapper::interrupt(id, []() { return false; }) == false);
+        testOk1(PyWrapper::interrupt(id, []() { return true; }) == true);
+        worker.join();
+        testOk1(timedOut);
+    }
+
+    static void trySession()
+    {
+        {
+            PyWrapper::Session session(false);
+            testOk1(bool(session));
+            // Re-entering GIL held by this thread doesn't wait
+            PyWrapper::Session nested(false);
+            testOk1(bool(nested));
+        }
+
+        std::atomic<bool> locked{false};
+        std::atomic<bool> release{false};
+        std::thread holder([&]() {
+            PyWrapper::Session session;
+            locked = true;
+            while (!release) {
+                std::this_thread::yield();
+            }
+        });
+        while (!locked) {
+            std::this_thread::yield();
+        }
+        {
+            PyWrapper::Session session(false);
+            testOk1(!session);
+        }
+        release = true;
+        holder.join();
+    }
+
+    static void counters()
+    {
+        auto before = PyWrapper::counters();
+        PyWrapper::exec("1 + 1", false);
+        try {
+            PyWrapper::exec("1 / 0", false);
+        } catch (...) {
+            // expected
+        }
+        auto after = PyWrapper::counters();
+        testOk1(after.evals == before.evals + 2);
+        testOk1(after.exceptions == before.exceptions + 1);
+        testOk1(after.gilAcquired > before.gilAcquired);
+    }
+
+    static void ioIntr()
+    {
+        std::atomic<int> first{0};
+        std::atomic<int> second{0};
+        PyWrapper::registerIoIntr("testParam", [&]() { first++; });
+        PyWrapper::registerIoIntr("testParam", [&]() { second++; });
+
+        PyWrapper::exec("pydev.iointr('testParam', 5)", false);
+        testOk1(first == 1 && second == 1);
+        testOk1(PyWrapper::exec("pydev.iointr('testParam')").get_long() == 5);
+
+        PyWrapper::exec("h = pydev.iointr_handle('testParam')", false);
+        PyWrapper::exec("pydev.iointr(h, 7)", false);
+        testOk1(first == 2 && second == 2);
+        testOk1(PyWrapper::exec("pydev.iointr('testParam')").get_long() == 7);
+        testOk1(PyWrapper::exec("pydev.iointr(h)").get_long() == 7);
+        testOk1(PyWrapper::exec("pydev.iointr('unknownParam') is None").get_bool());
+
+        // Callbacks run without the GIL, records processing inline take it
+        static std::atomic<bool> taken{false};
+        static std::atomic<bool> takenInCallback{false};
+        static std::thread other;
+        PyWrapper::registerIoIntr("testParamUnlocked", []() {
+            other = std::thread([]() {
+                PyWrapper::Session session;
+                taken = true;
+            });
+            for (int i = 0; i < 1000 && !taken; i++) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            takenInCallback = taken.load();
+        });
+        PyWrapper::exec("pydev.iointr('testParamUnlocked', 1)", false);
+        other.join();
+        testOk1(takenInCallback);
+    }
+
+    static void ioIntrMany()
+    {
+        std::atomic<int> a{0};
+        std::atomic<int> b{0};
+        PyWrapper::registerIoIntr("testParamA", [&]() { a++; });
+        PyWrapper::registerIoIntr("testParamB", [&]() { b++; });
+
+        testOk1(PyWrapper::exec("pydev.iointr_many({'testParamA': 1, 'testParamB': 2, 'unknownParam': 3})").get_bool());
+        testOk1(a == 1 && b == 1);
+        testOk1(PyWrapper::exec("pydev.iointr('testParamB')").get_long() == 2);
+
+        // Repeated parameter notifies once with the last value
+        PyWrapper::exec("pydev.iointr_many([('testParamA', 4), (pydev.iointr_handle('testParamA'), 5)])");
+        testOk1(a == 2 && b == 1);
+        testOk1(PyWrapper::exec("pydev.iointr('testParamA')").get_long() == 5);
+        testExcept(PyWrapper::exec("pydev.iointr_many([('testParamA',)])"));
+    }
+
+    static void ioIntrValue()
+    {
+        PyWrapper::IoIntrValue last;
+        bool valueFirst = false;
+        PyWrapper::registerIoIntrValue("testParamV", [&](const PyWrapper::IoIntrValue& value) { last = value; });
+        PyWrapper::registerIoIntr("testParamV", [&]() { valueFirst = bool(last); });
+
+        PyWrapper::exec("pydev.iointr('testParamV', 42)");
+        testOk1(valueFirst);
+        testOk1(last && last->get_long() == 42);
+
+        PyWrapper::exec("pydev.iointr_many([('testParamV', 'a'), ('testParamV', [1.5, 2.5])])");
+        testOk1(last && last->get_double_array() == std::vector<double>({1.5, 2.5}));
+
+        // Values that can't be used without Python are not converted
+        PyWrapper::exec("pydev.iointr('testParamV', object())");
+        testOk1(!last);
+
+        // Buffers are copied, later changes of the object don't affect pushed value
+        PyWrapper::exec("buf = bytearray(b'ab'); pydev.iointr('testParamV', buf); buf[0] = 0");
+        testOk1(last && last->get_array().count == 2 && static_cast<const char*>(last->get_array().data)[0] == 'a');
+    }
+
+    static void pushIoIntr()
+    {
+        PyWrapper::IoIntrValue last;
+        unsigned notified = 0;
+        PyWrapper::registerIoIntrValue("testParamN", [&](const PyWrapper::IoIntrValue& value) { last = value; });
+        PyWrapper::registerIoIntr("testParamN", [&]() { notified++; });
+
+        auto value = std::make_shared<const Variant>(3.5);
+        PyWrapper::pushIoIntr("testParamN", value);
+        testOk1(last == value && notified == 1);
+        testOk1(PyWrapper::exec("pydev.iointr('testParamN')").get_double() == 3.5);
+
+        // Python push replaces value converted from native push
+        PyWrapper::exec("pydev.iointr('testParamN', 7)");
+        testOk1(PyWrapper::exec("pydev.iointr('testParamN')").get_long() == 7);
+
+        std::vector<int16_t> data = {1, -2, 3};
+        Variant::Array arr{Variant::ElementType::INT16, data.data(), data.size(), nullptr};
+        PyWrapper::pushIoIntr("testParamN", std::make_shared<const Variant>(arr.clone()));
+        testOk1(PyWrapper::exec("list(pydev.iointr('testParamN'))").get_long_array() == std::vector<long long>({1, -2, 3}));
+
+        // Nobody asked for this parameter
+        PyWrapper::pushIoIntr("testParamUnknown", value);
+        testOk1(notified == 3 && PyWrapper::exec("pydev.iointr('testParamUnknown')").type == Variant::Type::NONE);
+    }
+
+    static bool wait(const std::atomic<unsigned>& counter, unsigned value)
+    {
+        for (int i = 0; i < 2000 && counter < value; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return (counter == value);
+    }
+
+    static void awaitables()
+    {
+#if PY_MAJOR_VERSION < 3
+        testSkip(13, "Coroutines require Python 3");
+#else
+        PyWrapper::exec("exec('import asyncio\\nasync def pydevSleep(v, t):\\n    await asyncio.sleep(t)\\n    return 1 / v')");
+        auto fn = PyWrapper::compile("pydevSleep(pydevN, pydevT)", {"pydevN", "pydevT"}, true, "Test:Await");
+        std::atomic<unsigned> done{0};
+        PyWrapper::Awaiter awaiter;
+        awaiter.done = [&]() { done++; };
+
+        std::map<std::string, Variant> args = {{ "pydevN", Variant(4) }, { "pydevT", Variant(0.01) }};
+        auto r = PyWrapper::call(fn, args, true, nullptr, &awaiter);
+        testOk1(awaiter.detach() && r.type == Variant::Type::NONE);
+        testOk1(wait(done, 1) && awaiter.result().get_double() == 0.25 && !awaiter.pending());
+
+        args["pydevN"] = Variant(0);
+        PyWrapper::call(fn, args, false, nullptr, &awaiter);
+        testOk1(awaiter.detach() && wait(done, 2));
+        testExcept(awaiter.result());
+        testOk1(!awaiter.pending());
+
+        awaiter.timeout = 0.01;
+        args["pydevN"] = Variant(1);
+        args["pydevT"] = Variant(10.0);
+        PyWrapper::call(fn, args, false, nullptr, &awaiter);
+        awaiter.detach();
+        bool timedOut = false;
+        try {
+            timedOut = wait(done, 3) && (awaiter.result(), false);
+        } catch (PyWrapper::TimeoutError&) {
+            timedOut = true;
+        }
+        testOk1(timedOut);
+        PyWrapper::destroy(std::move(fn));
+
+        // Other values are returned as usual
+        auto plain = PyWrapper::compile("pydevN * 2", {"pydevN", "pydevT"}, true, "Test:Plain");
+        testOk1(PyWrapper::call(plain, args, true, nullptr, &awaiter).get_long() == 2 && !awaiter.detach());
+        PyWrapper::destroy(std::move(plain));
+
+        // Loop thread counts as GIL user only while running coroutines
+        {
+            PyWrapper::Session session(false);
+            testOk1(bool(session));
+        }
+        PyWrapper::exec("exec('import time\\nasync def pydevSpin(t):\\n    end = time.time() + t\\n    while time.time() < end:\\n        pass\\n')");
+        auto spin = PyWrapper::compile("pydevSpin(pydevT)", {"pydevT"}, true, "Test:Spin");
+        std::map<std::string, Variant> spinArgs = {{ "pydevT", Variant(0.5) }};
+        PyWrapper::call(spin, spinArgs, true, nullptr, &awaiter);
+        awaiter.detach();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        {
+            PyWrapper::Session session(false);
+            testOk1(!session);
+        }
+        testOk1(wait(done, 4) && awaiter.result().type == Variant::Type::NONE);
+        PyWrapper::destroy(std::move(spin));
+
+        // Buffer results are copied, record destroys them without the GIL
+        PyWrapper::exec("exec('import array\\nasync def pydevArray():\\n    return array.array(\"d\", [1.5, 2.5])')");
+        auto buffer = PyWrapper::compile("pydevArray()", {}, true, "Test:Array");
+        std::map<std::string, Variant> noArgs;
+        PyWrapper::call(buffer, noArgs, true, nullptr, &awaiter);
+        awaiter.detach();
+        testOk1(wait(done, 5));
+        Variant result = awaiter.result();
+        testOk1(result.get_double_array() == std::vector<double>({1.5, 2.5}));
+        std::atomic<bool> destroyed{false};
+        std::thread releaser;
+        {
+            PyWrapper::Session session;
+            releaser = std::thread([&]() {
+                result = Variant();
+                destroyed = true;
+            });
+            for (int i = 0; i < 1000 && !destroyed; i++) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            testOk1(destroyed);
+        }
+        releaser.join();
+        PyWrapper::destroy(std::move(buffer));
+#endif
+    }
+
+    static void profiling()
+    {
+        std::map<std::string, Variant> args = {{ "pydevN", Variant(100) }};
+        auto fn = PyWrapper::compile("__import__('sys')._getframe().f_code.co_filename", {"pydevN"}, true, "Test:Rec");
+        testOk1(PyWrapper::call(fn, args, true).get_string() == "Test:Rec");
+        PyWrapper::destroy(std::move(fn));
+
+        auto loop = PyWrapper::compile("sum(range(pydevN))", {"pydevN"}, true, "Test:Loop");
+        Profiler::start();
+        for (int i = 0; i < 10; i++) {
+            PyWrapper::call(loop, args, true);
+        }
+        PyWrapper::destroy(std::move(loop));
+
+        // Recompiled record may get code object at the same address
+        auto again = PyWrapper::compile("sum(range(pydevN))", {"pydevN"}, true, "Test:Again");
+        for (int i = 0; i < 10; i++) {
+            PyWrapper::call(again, args, true);
+        }
+        Profiler::stop();
+        PyWrapper::destroy(std::move(again));
+
+        std::string path = "testpywrapper.stacks";
+        testOk1(Profiler::dump(path));
+        std::ifstream file(path);
+        std::string line;
+        bool found = false;
+        bool foundAgain = false;
+        while (std::getline(file, line)) {
+            found |= (line.find("Test:Loop;builtin:sum ") == 0);
+            foundAgain |= (line.find("Test:Again;builtin:sum ") == 0);
+        }
+        testOk1(found);
+        testOk1(foundAgain);
+        remove(path.c_str());
+    }
+
+    static void bufferReturn()
+    {
+        Variant v;
+
+#if PY_MAJOR_VERSION < 3
+        // Python 2 array.array and str don't export buffer interface
+        v = PyWrapper::exec("__import__('array').array('d', [1.5, 2.5])", true);
+        testOk1(v.get_double_array() == std::vector<double>({1.5, 2.5}));
+        testSkip(8, "array.array and bytes are buffers on Python 3 only");
+#else
+        v = PyWrapper::exec("__import__('array').array('d', [1.5, 2.5])", true);
+        testOk1(v.type == Variant::Type::ARRAY);
+        testOk1(v.get_array().type == Variant::ElementType::DOUBLE);
+        testOk1(v.get_double_array() == std::vector<double>({1.5, 2.5}));
+
+        epicsInt16 vs[4] = {0};
+        v = PyWrapper::exec("__import__('array').array('h', [-1, 2, 300])", true);
+        testOk1(v.get_array().copy(vs, Variant::ElementType::INT16, 4) == 3);
+        testOk1(vs[0] == -1 && vs[1] == 2 && vs[2] == 300 && vs[3] == 0);
+
+        epicsFloat64 vd[2];
+        testOk1(v.get_array().copy(vd, Variant::ElementType::DOUBLE, 2) == 2);
+        testOk1(vd[0] == -1.0 && vd[1] == 2.0);
+
+        v = PyWrapper::exec("b'\\x01\\x02'", true);
+        testOk1(v.get_array().type == Variant::ElementType::UINT8);
+        testOk1(v.get_long_array() == std::vector<long long int>({1, 2}));
+#endif
+
+        v = PyWrapper::exec("memoryview(bytearray(b'\\x03'))", true);
+        testOk1(v.get_long_array() == std::vector<long long int>({3}));
+
+        v = PyWrapper::exec("(1, 2, 3)", true);
+        testOk1(v.get_long_array() == std::vector<long long int>({1, 2, 3}));
+
+        v = PyWrapper::exec("range(3)", true);
+        testOk1(v.get_long_array() == std::vector<long long int>({0, 1, 2}));
+    }
 };
 
 MAIN(testpywrapper)
 {
-    testPlan(48);
+    testPlan(134);
 
     TestPyWrapper::init();
     TestPyWrapper::returnFromEval();
+    TestPyWrapper::arrayArguments();
+    TestPyWrapper::strings();
+    TestPyWrapper::namespaces();
+    TestPyWrapper::functions();
+    TestPyWrapper::subInterpreters();
+    TestPyWrapper::interrupts();
+    TestPyWrapper::trySession();
+    TestPyWrapper::counters();
+    TestPyWrapper::ioIntr();
+    TestPyWrapper::ioIntrMany();
+    TestPyWrapper::ioIntrValue();
+    TestPyWrapper::pushIoIntr();
+    TestPyWrapper::awaitables();
+    TestPyWrapper::profiling();
+    TestPyWrapper::bufferReturn();
 
     return testDone();
 }
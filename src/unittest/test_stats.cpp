@@ -0,0 +1,74 @@
+#include <stats.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+struct TestStats {
+    static void histogram()
+    {
+        Histogram<uint32_t> hist;
+        testOk1(hist.count() == 0);
+        testOk1(hist.percentile(99) == 0);
+
+        // 90 samples of 1us and 10 of 1ms
+        for (int i = 0; i < 90; i++) {
+            hist.add(1000);
+        }
+        for (int i = 0; i < 10; i++) {
+            hist.add(1000000);
+        }
+        testOk1(hist.count() == 100);
+        testOk1(hist.max() == 1000000);
+        testOk1(hist.mean() == (90 * 1000 + 10 * 1000000) / 100);
+        // Percentiles are upper bounds of their buckets
+        testOk1(hist.percentile(50) >= 1000 && hist.percentile(50) < 2000);
+        testOk1(hist.percentile(90) >= 1000 && hist.percentile(90) < 2000);
+        testOk1(hist.percentile(99) == 1000000);
+    }
+
+    static void extremes()
+    {
+        Histogram<uint32_t> hist;
+        hist.add(-5);
+        hist.add(0);
+        hist.add(int64_t(1) << 60);
+        testOk1(hist.count() == 3);
+        testOk1(hist.percentile(50) <= 128);
+        testOk1(hist.percentile(100) == (int64_t(1) << 60));
+    }
+
+    static void merge()
+    {
+        Histogram<uint32_t> a;
+        Histogram<uint32_t> b;
+        Histogram<uint64_t> sum;
+        a.add(500);
+        b.add(50000);
+        b.add(70000);
+        sum.merge(a);
+        sum.merge(b);
+        testOk1(sum.count() == 3);
+        testOk1(sum.max() == 70000);
+        sum.reset();
+        testOk1(sum.count() == 0 && sum.max() == 0);
+    }
+
+    static void stages()
+    {
+        testOk1(RecordStats::findStage("total") == RecordStats::TOTAL);
+        testOk1(RecordStats::findStage("GIL") == RecordStats::GIL);
+        testOk1(RecordStats::findStage("foo") == RecordStats::NUM_STAGES);
+    }
+};
+
+MAIN(teststats)
+{
+    testPlan(17);
+
+    TestStats::histogram();
+    TestStats::extremes();
+    TestStats::merge();
+    TestStats::stages();
+
+    return testDone();
+}
@@ -0,0 +1,141 @@
+#include <taskqueue.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+struct Item {
+    TaskNode task;
+    int id;
+    std::vector<int>* order;
+};
+
+static void record(Item* item)
+{
+    item->order->push_back(item->id);
+}
+
+struct Counter {
+    TaskNode task;
+    std::atomic<bool> queued{false};
+    std::atomic<unsigned>* count;
+};
+
+static void count(Counter* counter)
+{
+    counter->count->fetch_add(1);
+    counter->queued = false;
+}
+
+struct TestTaskQueue {
+    static void fifo()
+    {
+        TaskQueue que;
+        std::vector<int> order;
+        Item items[3];
+        for (int i = 0; i < 3; i++) {
+            items[i].id = i;
+            items[i].order = &order;
+            items[i].task.bind<Item, record>(&items[i]);
+        }
+
+        testOk1(que.tryDequeue() == nullptr);
+        que.enqueue(&items[0].task);
+        que.enqueue(&items[1].task);
+        TaskNode* task = que.tryDequeue();
+        testOk1(task == &items[0].task);
+        task->run();
+
+        // Dequeued node can be enqueued again
+        que.enqueue(&items[2].task);
+        que.enqueue(&items[0].task);
+        while ((task = que.tryDequeue()) != nullptr) {
+            task->run();
+        }
+        testOk1(order == std::vector<int>({0, 1, 2, 0}));
+    }
+
+    static void wakeAll()
+    {
+        TaskQueue que;
+        std::atomic<bool> running{true};
+        TaskNode dummy;
+        TaskNode* task = &dummy;
+        std::thread consumer([&]() {
+            task = que.dequeue(running);
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        running = false;
+        que.wakeAll();
+        consumer.join();
+        testOk1(task == nullptr);
+    }
+
+    static void contention()
+    {
+        TaskQueue que;
+        std::atomic<bool> running{true};
+        std::atomic<unsigned> processed{0};
+        const unsigned numCounters = 16;
+        const unsigned perProducer = 10000;
+        Counter counters[2][numCounters];
+
+        std::vector<std::thread> consumers;
+        for (int i = 0; i < 3; i++) {
+            consumers.emplace_back([&]() {
+                while (running) {
+                    TaskNode* task = que.dequeue(running);
+                    if (task) {
+                        task->run();
+                    }
+                }
+            });
+        }
+
+        std::vector<std::thread> producers;
+        for (int p = 0; p < 2; p++) {
+            producers.emplace_back([&, p]() {
+                unsigned scheduled = 0;
+                while (scheduled < perProducer) {
+                    for (auto& counter: counters[p]) {
+                        if (scheduled < perProducer && !counter.queued.exchange(true)) {
+                            counter.count = &processed;
+                            counter.task.bind<Counter, count>(&counter);
+                            que.enqueue(&counter.task);
+                            scheduled++;
+                        }
+                    }
+                    std::this_thread::yield();
+                }
+            });
+        }
+        for (auto& producer: producers) {
+            producer.join();
+        }
+        while (processed < 2 * perProducer) {
+            std::this_thread::yield();
+        }
+        running = false;
+        que.wakeAll();
+        for (auto& consumer: consumers) {
+            consumer.join();
+        }
+        testOk1(processed == 2 * perProducer);
+        testOk1(que.tryDequeue() == nullptr);
+    }
+};
+
+MAIN(testtaskqueue)
+{
+    testPlan(6);
+
+    TestTaskQueue::fifo();
+    TestTaskQueue::wakeAll();
+    TestTaskQueue::contention();
+
+    return testDone();
+}
@@ -23,6 +23,26 @@ struct TestEscape {
     }
 };
 
+struct TestBindMacros {
+    static void supportedOnly()
+    {
+        std::vector<std::string> bound;
+        testOk1(Util::bindMacros("VAL + HOPR", {"VAL"}, bound) == "pydevVAL + HOPR");
+        testOk1(bound.size() == 1 && bound[0] == "VAL");
+        testOk1(Util::bindMacros("print('Hello')", {"VAL"}, bound) == "print('Hello')");
+        testOk1(bound.empty());
+    }
+
+    static void repeated()
+    {
+        std::vector<std::string> bound;
+        testOk1(Util::bindMacros("VAL*VAL+%NAME%", {"VAL", "NAME"}, bound) == "pydevVAL*pydevVAL+pydevNAME");
+        testOk1(bound.size() == 2);
+        testOk1(Util::bindMacros("f(A, B, A)", {"A", "B", "C"}, bound) == "f(pydevA, pydevB, pydevA)");
+        testOk1(bound.size() == 2);
+    }
+};
+
 struct TestJoin {
     static void simple()
     {
@@ -107,7 +127,7 @@ struct TestReplace {
 
 MAIN(testutil)
 {
-    testPlan(53);
+    testPlan(61);
     TestReplace::basic();
     TestReplace::multipleInstances();
     TestReplace::singleChar();
@@ -119,5 +139,8 @@ MAIN(testutil)
 
     TestJoin::simple();
 
+    TestBindMacros::supportedOnly();
+    TestBindMacros::repeated();
+
     return testDone();
 }
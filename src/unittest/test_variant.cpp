@@ -0,0 +1,113 @@
+#include <variant.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include <string>
+#include <vector>
+
+struct TestVariant {
+    static void moveSemantics()
+    {
+        std::vector<double> vals = {1.5, 2.5, 3.5};
+        const double* data = vals.data();
+
+        Variant v(std::move(vals));
+        Variant::Array arr;
+        testOk1(v.try_get(arr) && arr.data == data);
+
+        Variant w(std::move(v));
+        testOk1(w.try_get(arr) && arr.data == data);
+        testOk1(w.get_double_array() == std::vector<double>({1.5, 2.5, 3.5}));
+
+        Variant c = w;
+        testOk1(c.try_get(arr) && arr.data != data);
+
+        c = Variant("text");
+        testOk1(c.type == Variant::Type::STRING && c.get_string() == "text");
+        c = w;
+        testOk1(c.type == Variant::Type::VECTOR_DOUBLE && c.get_double_array().size() == 3);
+    }
+
+    static void nativeArrays()
+    {
+        epicsInt16 vals[] = {-1, 2, 300};
+        Variant v(vals, 3);
+        testOk1(v.type == Variant::Type::ARRAY);
+        testOk1(v.get_array().type == Variant::ElementType::INT16);
+        testOk1(v.get_array().data != vals);
+        testOk1(v.get_long_array() == std::vector<long long int>({-1, 2, 300}));
+
+        std::vector<epicsFloat32> floats = {0.5f, 1.5f};
+        const epicsFloat32* data = floats.data();
+        Variant f = Variant::adopt(std::move(floats));
+        testOk1(f.get_array().type == Variant::ElementType::FLOAT);
+        testOk1(f.get_array().data == data);
+
+        epicsFloat64 out[2];
+        testOk1(f.get_array().copy(out, Variant::ElementType::DOUBLE, 2) == 2);
+        testOk1(out[0] == 0.5 && out[1] == 1.5);
+
+        epicsUInt32 external[] = {7, 8};
+        auto clone = Variant::view(external, 2).get_array().clone();
+        external[0] = 0;
+        testOk1(clone.data != external && clone.owner);
+        testOk1(Variant(clone).get_long_array() == std::vector<long long int>({7, 8}));
+    }
+
+    static void tryGet()
+    {
+        double d = 0;
+        int64_t l = 0;
+        std::string s;
+        Variant::Array arr;
+
+        testOk1(Variant(3).try_get(d) && d == 3.0);
+        testOk1(Variant("42").try_get(l) && l == 42);
+        testOk1(!Variant("forty two").try_get(l) && l == 42);
+        testOk1(!Variant(std::vector<double>()).try_get(d));
+        testOk1(Variant(true).try_get(s) && s == "True");
+        testOk1(!Variant(1.0).try_get(arr));
+
+        bool thrown = false;
+        try {
+            Variant("forty two").get_long();
+        } catch (Variant::ConvertError&) {
+            thrown = true;
+        }
+        testOk1(thrown);
+    }
+
+    static void fixedStrings()
+    {
+        char buf[6];
+        testOk1(Variant("abc").copy_string(buf, sizeof(buf)) == 3 && std::string(buf) == "abc");
+        testOk1(Variant("abcdefgh").copy_string(buf, sizeof(buf)) == 5 && std::string(buf) == "abcde");
+        // Two byte degree sign doesn't fit, it's dropped as a whole
+        testOk1(Variant("abcd\xc2\xb0").copy_string(buf, sizeof(buf)) == 4 && std::string(buf) == "abcd");
+        testOk1(Variant(12).copy_string(buf, sizeof(buf)) == 2 && std::string(buf) == "12");
+
+        const char* data = nullptr;
+        size_t size = 0;
+        testOk1(Variant("text").try_get(data, size) && size == 4);
+        testOk1(!Variant(1.0).try_get(data, size));
+
+        char arr[3][4];
+        Variant strs(std::vector<std::string>({"a", "bcdef"}));
+        testOk1(strs.copy_strings(arr[0], sizeof(arr[0]), 3) == 2);
+        testOk1(std::string(arr[0]) == "a" && std::string(arr[1]) == "bcd");
+        testOk1(strs.get_string_vector().size() == 2 && strs.get_string_vector()[1] == "bcdef");
+    }
+};
+
+MAIN(testvariant)
+{
+    testPlan(32);
+
+    TestVariant::moveSemantics();
+    TestVariant::nativeArrays();
+    TestVariant::tryGet();
+    TestVariant::fixedStrings();
+
+    return testDone();
+}
@@ -5,6 +5,7 @@
 
 #include "util.h"
 #include <envDefs.h>
+#include <algorithm>
 #include <cctype>
 #include <stdexcept>
 
@@ -79,6 +80,25 @@ std::string replaceMacro(const std::string& text, const std::string& search, con
     return out;
 }
 
+std::string bindMacros(const std::string& text, const std::vector<std::string>& supported, std::vector<std::string>& bound)
+{
+    std::string code = text;
+    bound.clear();
+
+    for (auto& macro: getMacros(text)) {
+        if (std::find(supported.begin(), supported.end(), macro) == supported.end()) {
+            continue;
+        }
+        if (std::find(bound.begin(), bound.end(), macro) != bound.end()) {
+            continue;
+        }
+        code = replaceMacro(code, macro, "pydev" + macro);
+        bound.push_back(macro);
+    }
+
+    return code;
+}
+
 std::string replace(const std::string& text, const std::map<std::string, std::string>& fields)
 {
     std::string out = text;
@@ -14,6 +14,7 @@ namespace Util {
 
 std::vector<std::string> getMacros(const std::string& text);
 std::string replaceMacro(const std::string& text, const std::string& macro, const std::string& replacement);
+std::string bindMacros(const std::string& text, const std::vector<std::string>& supported, std::vector<std::string>& bound);
 std::string escape(const std::string& text);
 std::string join(const std::vector<std::string>& tokens, const std::string& glue);
 long getEnvConfig(const std::string& name, long defval);
@@ -1,137 +1,474 @@
 #include "variant.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
 #include <stdexcept>
 
+template <typename T, typename E>
+static void appendArray(std::vector<T>& out, const void* data, size_t count)
+{
+    auto vals = reinterpret_cast<const E*>(data);
+    out.insert(out.end(), vals, vals + count);
+}
+
+template <typename T>
+static std::vector<T> fromArray(const Variant::Array& arr)
+{
+    std::vector<T> out;
+    out.reserve(arr.count);
+    switch (arr.type) {
+    case Variant::ElementType::INT8:   appendArray<T, epicsInt8>   (out, arr.data, arr.count); break;
+    case Variant::ElementType::UINT8:  appendArray<T, epicsUInt8>  (out, arr.data, arr.count); break;
+    case Variant::ElementType::INT16:  appendArray<T, epicsInt16>  (out, arr.data, arr.count); break;
+    case Variant::ElementType::UINT16: appendArray<T, epicsUInt16> (out, arr.data, arr.count); break;
+    case Variant::ElementType::INT32:  appendArray<T, epicsInt32>  (out, arr.data, arr.count); break;
+    case Variant::ElementType::UINT32: appendArray<T, epicsUInt32> (out, arr.data, arr.count); break;
+    case Variant::ElementType::INT64:  appendArray<T, epicsInt64>  (out, arr.data, arr.count); break;
+    case Variant::ElementType::UINT64: appendArray<T, epicsUInt64> (out, arr.data, arr.count); break;
+    case Variant::ElementType::FLOAT:  appendArray<T, epicsFloat32>(out, arr.data, arr.count); break;
+    case Variant::ElementType::DOUBLE: appendArray<T, epicsFloat64>(out, arr.data, arr.count); break;
+    }
+    return out;
+}
+
+template <typename S, typename D>
+static void copyElements(const void* src, void* dst, size_t count)
+{
+    auto from = reinterpret_cast<const S*>(src);
+    std::copy(from, from + count, reinterpret_cast<D*>(dst));
+}
+
+template <typename S>
+static void copyElements(const void* src, void* dst, Variant::ElementType dstType, size_t count)
+{
+    switch (dstType) {
+    case Variant::ElementType::INT8:   copyElements<S, epicsInt8>   (src, dst, count); break;
+    case Variant::ElementType::UINT8:  copyElements<S, epicsUInt8>  (src, dst, count); break;
+    case Variant::ElementType::INT16:  copyElements<S, epicsInt16>  (src, dst, count); break;
+    case Variant::ElementType::UINT16: copyElements<S, epicsUInt16> (src, dst, count); break;
+    case Variant::ElementType::INT32:  copyElements<S, epicsInt32>  (src, dst, count); break;
+    case Variant::ElementType::UINT32: copyElements<S, epicsUInt32> (src, dst, count); break;
+    case Variant::ElementType::INT64:  copyElements<S, epicsInt64>  (src, dst, count); break;
+    case Variant::ElementType::UINT64: copyElements<S, epicsUInt64> (src, dst, count); break;
+    case Variant::ElementType::FLOAT:  copyElements<S, epicsFloat32>(src, dst, count); break;
+    case Variant::ElementType::DOUBLE: copyElements<S, epicsFloat64>(src, dst, count); break;
+    }
+}
+
+size_t Variant::Array::copy(void* dst, ElementType dstType, size_t max) const
+{
+    size_t n = std::min(count, max);
+    if (n == 0) {
+        return 0;
+    }
+    if (dstType == type) {
+        memcpy(dst, data, n * itemsize());
+        return n;
+    }
+    switch (type) {
+    case ElementType::INT8:   copyElements<epicsInt8>   (data, dst, dstType, n); break;
+    case ElementType::UINT8:  copyElements<epicsUInt8>  (data, dst, dstType, n); break;
+    case ElementType::INT16:  copyElements<epicsInt16>  (data, dst, dstType, n); break;
+    case ElementType::UINT16: copyElements<epicsUInt16> (data, dst, dstType, n); break;
+    case ElementType::INT32:  copyElements<epicsInt32>  (data, dst, dstType, n); break;
+    case ElementType::UINT32: copyElements<epicsUInt32> (data, dst, dstType, n); break;
+    case ElementType::INT64:  copyElements<epicsInt64>  (data, dst, dstType, n); break;
+    case ElementType::UINT64: copyElements<epicsUInt64> (data, dst, dstType, n); break;
+    case ElementType::FLOAT:  copyElements<epicsFloat32>(data, dst, dstType, n); break;
+    case ElementType::DOUBLE: copyElements<epicsFloat64>(data, dst, dstType, n); break;
+    }
+    return n;
+}
+
+Variant::Array Variant::Array::clone() const
+{
+    size_t bytes = count * itemsize();
+    std::shared_ptr<void> buffer(::operator new(bytes > 0 ? bytes : 1), [](void* p) { ::operator delete(p); });
+    if (bytes > 0) {
+        memcpy(buffer.get(), data, bytes);
+    }
+    return Array{type, buffer.get(), count, buffer};
+}
+
+size_t Variant::Array::itemsize() const
+{
+    switch (type) {
+    case ElementType::INT8:   return sizeof(epicsInt8);
+    case ElementType::UINT8:  return sizeof(epicsUInt8);
+    case ElementType::INT16:  return sizeof(epicsInt16);
+    case ElementType::UINT16: return sizeof(epicsUInt16);
+    case ElementType::INT32:  return sizeof(epicsInt32);
+    case ElementType::UINT32: return sizeof(epicsUInt32);
+    case ElementType::INT64:  return sizeof(epicsInt64);
+    case ElementType::UINT64: return sizeof(epicsUInt64);
+    case ElementType::FLOAT:  return sizeof(epicsFloat32);
+    case ElementType::DOUBLE: return sizeof(epicsFloat64);
+    }
+    return 0;
+}
+
 Variant::Variant()
     : type(Type::NONE)
 {}
 
+Variant::Variant(const Variant& other)
+    : type(Type::NONE)
+{
+    assign(other);
+}
+
+Variant::Variant(Variant&& other) noexcept
+    : type(Type::NONE)
+{
+    assign(std::move(other));
+}
+
+Variant& Variant::operator=(const Variant& other)
+{
+    if (this != &other) {
+        clear();
+        assign(other);
+    }
+    return *this;
+}
+
+Variant& Variant::operator=(Variant&& other) noexcept
+{
+    if (this != &other) {
+        clear();
+        assign(std::move(other));
+    }
+    return *this;
+}
+
+Variant::~Variant()
+{
+    clear();
+}
+
 Variant::Variant(const std::string& val)
-    : s(val)
-    , type(Type::STRING)
+    : type(Type::STRING)
+    , s(val)
+{}
+
+Variant::Variant(std::string&& val)
+    : type(Type::STRING)
+    , s(std::move(val))
 {}
 
 Variant::Variant(const bool val)
-    : b(val)
-    , type(Type::BOOL)
+    : type(Type::BOOL)
+    , b(val)
 {}
 
 Variant::Variant(const double val)
-    : d(val)
-    , type(Type::DOUBLE)
+    : type(Type::DOUBLE)
+    , d(val)
 {}
 
 Variant::Variant(const long long int val)
-    : l(val)
-    , type(Type::LONG)
+    : type(Type::LONG)
+    , l(val)
 {}
 
 Variant::Variant(const unsigned long long int val)
-    : u(val)
-    , type(Type::UNSIGNED)
+    : type(Type::UNSIGNED)
+    , u(val)
 {}
 
 Variant::Variant(const std::vector<long long int>& val)
-    : vl(val)
-    , type(Type::VECTOR_LONG)
+    : type(Type::VECTOR_LONG)
+    , vl(val)
+{}
+
+Variant::Variant(std::vector<long long int>&& val)
+    : type(Type::VECTOR_LONG)
+    , vl(std::move(val))
 {}
 
 Variant::Variant(const std::vector<unsigned long long int>& val)
-    : vu(val)
-    , type(Type::VECTOR_UNSIGNED)
+    : type(Type::VECTOR_UNSIGNED)
+    , vu(val)
+{}
+
+Variant::Variant(std::vector<unsigned long long int>&& val)
+    : type(Type::VECTOR_UNSIGNED)
+    , vu(std::move(val))
 {}
 
 Variant::Variant(const std::vector<double> &val)
-    : vd(val)
-    , type(Type::VECTOR_DOUBLE)
+    : type(Type::VECTOR_DOUBLE)
+    , vd(val)
+{}
+
+Variant::Variant(std::vector<double>&& val)
+    : type(Type::VECTOR_DOUBLE)
+    , vd(std::move(val))
 {}
 
 Variant::Variant(const std::vector<std::string> &val)
-    : vs(val)
-    , type(Type::VECTOR_STRING)
+    : type(Type::VECTOR_STRING)
+    , vs(val)
 {}
 
-bool Variant::get_bool() const
+Variant::Variant(std::vector<std::string>&& val)
+    : type(Type::VECTOR_STRING)
+    , vs(std::move(val))
+{}
+
+Variant::Variant(const Array& val)
+    : type(Type::ARRAY)
+    , a(val)
+{}
+
+Variant::Variant(Array&& val)
+    : type(Type::ARRAY)
+    , a(std::move(val))
+{}
+
+void Variant::assign(const Variant& other)
+{
+    switch (other.type) {
+    case Type::NONE:            break;
+    case Type::BOOL:            b = other.b; break;
+    case Type::DOUBLE:          d = other.d; break;
+    case Type::LONG:            l = other.l; break;
+    case Type::UNSIGNED:        u = other.u; break;
+    case Type::STRING:          new (&s)  std::string(other.s); break;
+    case Type::VECTOR_LONG:     new (&vl) std::vector<long long int>(other.vl); break;
+    case Type::VECTOR_UNSIGNED: new (&vu) std::vector<unsigned long long int>(other.vu); break;
+    case Type::VECTOR_DOUBLE:   new (&vd) std::vector<double>(other.vd); break;
+    case Type::VECTOR_STRING:   new (&vs) std::vector<std::string>(other.vs); break;
+    case Type::ARRAY:           new (&a)  Array(other.a); break;
+    }
+    type = other.type;
+}
+
+void Variant::assign(Variant&& other) noexcept
+{
+    switch (other.type) {
+    case Type::NONE:            break;
+    case Type::BOOL:            b = other.b; break;
+    case Type::DOUBLE:          d = other.d; break;
+    case Type::LONG:            l = other.l; break;
+    case Type::UNSIGNED:        u = other.u; break;
+    case Type::STRING:          new (&s)  std::string(std::move(other.s)); break;
+    case Type::VECTOR_LONG:     new (&vl) std::vector<long long int>(std::move(other.vl)); break;
+    case Type::VECTOR_UNSIGNED: new (&vu) std::vector<unsigned long long int>(std::move(other.vu)); break;
+    case Type::VECTOR_DOUBLE:   new (&vd) std::vector<double>(std::move(other.vd)); break;
+    case Type::VECTOR_STRING:   new (&vs) std::vector<std::string>(std::move(other.vs)); break;
+    case Type::ARRAY:           new (&a)  Array(std::move(other.a)); break;
+    }
+    type = other.type;
+}
+
+void Variant::clear() noexcept
+{
+    typedef std::string string_t;
+    typedef std::vector<long long int> vl_t;
+    typedef std::vector<unsigned long long int> vu_t;
+    typedef std::vector<double> vd_t;
+    typedef std::vector<std::string> vs_t;
+
+    switch (type) {
+    case Type::STRING:          s.~string_t(); break;
+    case Type::VECTOR_LONG:     vl.~vl_t(); break;
+    case Type::VECTOR_UNSIGNED: vu.~vu_t(); break;
+    case Type::VECTOR_DOUBLE:   vd.~vd_t(); break;
+    case Type::VECTOR_STRING:   vs.~vs_t(); break;
+    case Type::ARRAY:           a.~Array(); break;
+    default:                    break;
+    }
+    type = Type::NONE;
+}
+
+template <typename T>
+static bool parseNumber(const std::string& str, T (*parse)(const char*, char**, int), T& out) noexcept
+{
+    char* end = nullptr;
+    errno = 0;
+    T val = parse(str.c_str(), &end, 10);
+    if (end == str.c_str() || errno != 0) {
+        return false;
+    }
+    out = val;
+    return true;
+}
+
+bool Variant::try_get(bool& out) const noexcept
 {
     if (type == Type::BOOL) {
-        return b;
+        out = b;
     } else if (type == Type::LONG) {
-        return (l != 0);
+        out = (l != 0);
     } else if (type == Type::UNSIGNED) {
-        return (u != 0);
+        out = (u != 0);
     } else if (type == Type::DOUBLE) {
-        return (d != 0.0);
+        out = (d != 0.0);
     } else {
-        throw ConvertError();
+        return false;
     }
+    return true;
 }
 
-int64_t Variant::get_long() const
+bool Variant::try_get(int64_t& out) const noexcept
 {
     if (type == Type::BOOL) {
-        return (b ? 1 : 0);
+        out = (b ? 1 : 0);
     } else if (type == Type::LONG) {
-        return l;
+        out = l;
     } else if (type == Type::UNSIGNED) {
-        return u;
+        out = u;
     } else if (type == Type::DOUBLE) {
-        return d;
+        out = d;
     } else if (type == Type::STRING) {
-        return std::stoll(s);
+        long long val;
+        if (!parseNumber<long long>(s, strtoll, val)) {
+            return false;
+        }
+        out = val;
     } else {
-        throw ConvertError();
+        return false;
     }
+    return true;
 }
 
-uint64_t Variant::get_unsigned() const
+bool Variant::try_get(uint64_t& out) const noexcept
 {
     if (type == Type::BOOL) {
-        return (b ? 1 : 0);
+        out = (b ? 1 : 0);
     } else if (type == Type::LONG) {
-        return l;
+        out = l;
     } else if (type == Type::UNSIGNED) {
-        return u;
+        out = u;
     } else if (type == Type::DOUBLE) {
-        return d;
+        out = d;
     } else if (type == Type::STRING) {
-        return std::stoull(s);
+        unsigned long long val;
+        if (!parseNumber<unsigned long long>(s, strtoull, val)) {
+            return false;
+        }
+        out = val;
     } else {
-        throw ConvertError();
+        return false;
     }
+    return true;
 }
 
-double Variant::get_double() const
+bool Variant::try_get(double& out) const noexcept
 {
     if (type == Type::BOOL) {
-        return (b ? 1.0 : 0.0);
+        out = (b ? 1.0 : 0.0);
     } else if (type == Type::LONG) {
-        return l;
+        out = l;
     } else if (type == Type::UNSIGNED) {
-        return u;
+        out = u;
     } else if (type == Type::DOUBLE) {
-        return d;
+        out = d;
     } else if (type == Type::STRING) {
-        return std::stod(s);
+        char* end = nullptr;
+        double val = strtod(s.c_str(), &end);
+        if (end == s.c_str()) {
+            return false;
+        }
+        out = val;
     } else {
-        throw ConvertError();
+        return false;
     }
+    return true;
 }
 
-std::string Variant::get_string() const
+bool Variant::try_get(std::string& out) const
 {
     if (type == Type::BOOL) {
-        return (b ? "True" : "False");
+        out = (b ? "True" : "False");
     } else if (type == Type::LONG) {
-        return std::to_string(l);
+        out = std::to_string(l);
     } else if (type == Type::UNSIGNED) {
-        return std::to_string(u);
+        out = std::to_string(u);
     } else if (type == Type::DOUBLE) {
-        return std::to_string(d);
+        out = std::to_string(d);
     } else if (type == Type::STRING) {
-        return s;
+        out = s;
     } else {
+        return false;
+    }
+    return true;
+}
+
+bool Variant::try_get(Array& out) const noexcept
+{
+    if (type == Type::ARRAY) {
+        out = a;
+    } else if (type == Type::VECTOR_LONG) {
+        static_assert(sizeof(long long int) == sizeof(epicsInt64), "Unexpected long long size");
+        out = Array{ElementType::INT64, vl.data(), vl.size()};
+    } else if (type == Type::VECTOR_UNSIGNED) {
+        out = Array{ElementType::UINT64, vu.data(), vu.size()};
+    } else if (type == Type::VECTOR_DOUBLE) {
+        out = Array{ElementType::DOUBLE, vd.data(), vd.size()};
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool Variant::try_get(const char*& data, size_t& size) const noexcept
+{
+    if (type != Type::STRING) {
+        return false;
+    }
+    data = s.data();
+    size = s.size();
+    return true;
+}
+
+bool Variant::get_bool() const
+{
+    bool val;
+    if (!try_get(val)) {
+        throw ConvertError();
+    }
+    return val;
+}
+
+int64_t Variant::get_long() const
+{
+    int64_t val;
+    if (!try_get(val)) {
+        throw ConvertError();
+    }
+    return val;
+}
+
+uint64_t Variant::get_unsigned() const
+{
+    uint64_t val;
+    if (!try_get(val)) {
+        throw ConvertError();
+    }
+    return val;
+}
+
+double Variant::get_double() const
+{
+    double val;
+    if (!try_get(val)) {
+        throw ConvertError();
+    }
+    return val;
+}
+
+std::string Variant::get_string() const
+{
+    std::string val;
+    if (!try_get(val)) {
         throw ConvertError();
     }
+    return val;
 }
 
 std::vector<long long int> Variant::get_long_array() const
@@ -156,6 +493,8 @@ std::vector<long long int> Variant::get_long_array() const
             out.push_back(std::stoll(v));
         }
         return out;
+    } else if (type == Type::ARRAY) {
+        return fromArray<long long int>(a);
     } else {
         throw ConvertError();
     }
@@ -183,6 +522,8 @@ std::vector<unsigned long long int> Variant::get_unsigned_array() const
             out.push_back(std::stoull(v));
         }
         return out;
+    } else if (type == Type::ARRAY) {
+        return fromArray<unsigned long long int>(a);
     } else {
         throw ConvertError();
     }
@@ -210,6 +551,8 @@ std::vector<double> Variant::get_double_array() const
             out.push_back(std::stod(v));
         }
         return out;
+    } else if (type == Type::ARRAY) {
+        return fromArray<double>(a);
     } else {
         throw ConvertError();
     }
@@ -237,10 +580,88 @@ std::vector<std::string> Variant::get_string_array() const
         return out;
     } else if (type == Type::VECTOR_STRING) {
         return vs;
+    } else if (type == Type::ARRAY) {
+        std::vector<std::string> out;
+        if (a.type == ElementType::FLOAT || a.type == ElementType::DOUBLE) {
+            for (auto& v: fromArray<double>(a)) {
+                out.push_back(std::to_string(v));
+            }
+        } else if (a.type == ElementType::UINT64) {
+            for (auto& v: fromArray<unsigned long long int>(a)) {
+                out.push_back(std::to_string(v));
+            }
+        } else {
+            for (auto& v: fromArray<long long int>(a)) {
+                out.push_back(std::to_string(v));
+            }
+        }
+        return out;
+    } else {
+        throw ConvertError();
+    }
+}
+
+const std::vector<std::string>& Variant::get_string_vector() const
+{
+    if (type != Type::VECTOR_STRING) {
+        throw ConvertError();
+    }
+    return vs;
+}
+
+/**
+ * Copy at most size-1 characters up to embedded NUL and terminate them,
+ * a multi-byte UTF-8 character that doesn't fit is dropped as a whole.
+ */
+static size_t copyTruncated(char* dst, size_t size, const char* src, size_t len)
+{
+    if (size == 0) {
+        return 0;
+    }
+    len = strnlen(src, len);
+    if (len > size - 1) {
+        len = size - 1;
+        // Continuation bytes look like 10xxxxxx
+        while (len > 0 && (static_cast<unsigned char>(src[len]) & 0xC0) == 0x80) {
+            len--;
+        }
+    }
+    memcpy(dst, src, len);
+    dst[len] = 0;
+    return len;
+}
+
+size_t Variant::copy_string(char* dst, size_t size) const
+{
+    if (type == Type::STRING) {
+        return copyTruncated(dst, size, s.data(), s.size());
+    }
+    std::string val = get_string();
+    return copyTruncated(dst, size, val.data(), val.size());
+}
+
+size_t Variant::copy_strings(char* dst, size_t size, size_t max) const
+{
+    if (type == Type::VECTOR_STRING) {
+        size_t n = std::min(vs.size(), max);
+        for (size_t i = 0; i < n; i++) {
+            copyTruncated(dst + i*size, size, vs[i].data(), vs[i].size());
+        }
+        return n;
+    }
+    auto vals = get_string_array();
+    size_t n = std::min(vals.size(), max);
+    for (size_t i = 0; i < n; i++) {
+        copyTruncated(dst + i*size, size, vals[i].data(), vals[i].size());
+    }
+    return n;
+}
+
+const Variant::Array& Variant::get_array() const
+{
+    if (type == Type::ARRAY) {
+        return a;
     } else {
         throw ConvertError();
     }
 }
-/*
-    std::vector<std::string> get_string_array() const;
-*/
\ No newline at end of file
@@ -8,23 +8,21 @@
 
 #include <epicsTypes.h>
 
+#include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
+/**
+ * @brief Value passed between EPICS records and Python.
+ *
+ * Only one alternative is stored at a time, selected by type. Variants
+ * are cheap to move, moving a vector or array hands over the storage
+ * without copying elements. Numeric arrays keep the native element width.
+ */
 class Variant
 {
-private:
-    std::string s;
-    bool b;
-    double d;
-    long long l;
-    unsigned long long u;
-    std::vector<long long int> vl;
-    std::vector<unsigned long long int> vu;
-    std::vector<double> vd;
-    std::vector<std::string> vs;
-
 public:
     enum class Type
     {
@@ -38,8 +36,64 @@ public:
         VECTOR_LONG,
         VECTOR_UNSIGNED,
         VECTOR_STRING,
+        ARRAY,
     } type{Type::NONE};
 
+    enum class ElementType
+    {
+        INT8,
+        UINT8,
+        INT16,
+        UINT16,
+        INT32,
+        UINT32,
+        INT64,
+        UINT64,
+        FLOAT,
+        DOUBLE,
+    };
+
+    /**
+     * @brief Contiguous array of native numeric elements.
+     *
+     * When owner is not set, array only references memory of somebody
+     * else, ie. waveform record's BPTR buffer, which must be kept valid
+     * for as long as Variant is being used. Otherwise the memory is kept
+     * alive by the owner, ie. Python object exporting buffer interface,
+     * and is released together with the last copy of the array.
+     */
+    struct Array
+    {
+        ElementType type;
+        const void* data;
+        size_t count;
+        std::shared_ptr<const void> owner;
+
+        size_t itemsize() const;
+
+        /**
+         * @brief Copy elements into native buffer in a single pass.
+         *
+         * When element types match, memory is copied as a whole, otherwise
+         * each element is converted to the destination type.
+         *
+         * @param dst Destination buffer
+         * @param dstType Element type of destination buffer
+         * @param max Maximum number of elements to copy
+         * @return Number of elements copied
+         */
+        size_t copy(void* dst, ElementType dstType, size_t max) const;
+
+        /**
+         * @brief Copy elements into new memory owned by the returned array.
+         *
+         * The copy no longer depends on the original owner, ie. it can be
+         * released without the GIL and later changes of Python object
+         * don't affect it.
+         */
+        Array clone() const;
+    };
+
     class ConvertError : public std::exception
     {
         private:
@@ -55,16 +109,29 @@ public:
     };
 
     Variant();
+    Variant(const Variant& other);
+    Variant(Variant&& other) noexcept;
+    Variant& operator=(const Variant& other);
+    Variant& operator=(Variant&& other) noexcept;
+    ~Variant();
+
     Variant(const std::string& val);
+    Variant(std::string&& val);
     Variant(const char *val) : Variant(std::string(val)) {};
     Variant(const bool val);
     Variant(const long long int val);
     Variant(const unsigned long long int val);
     Variant(const double val);
     Variant(const std::vector<long long int>& val);
+    Variant(std::vector<long long int>&& val);
     Variant(const std::vector<unsigned long long int>& val);
+    Variant(std::vector<unsigned long long int>&& val);
     Variant(const std::vector<double>& val);
+    Variant(std::vector<double>&& val);
     Variant(const std::vector<std::string>& val);
+    Variant(std::vector<std::string>&& val);
+    explicit Variant(const Array& val);
+    explicit Variant(Array&& val);
 
     // Helper c'tors for EPICS types
     Variant(const signed char val)        : Variant(static_cast<const long long int>(val)){};
@@ -77,19 +144,51 @@ public:
     Variant(const unsigned long int val)  : Variant(static_cast<const unsigned long long int>(val)){};
     Variant(const float val)              : Variant(static_cast<const double>(val)){};
 
-    Variant(const char* vals,                   size_t n) : Variant(std::vector<long long int>(vals, vals+n)) {};
-    Variant(const signed char* vals,            size_t n) : Variant(std::vector<long long int>(vals, vals+n)) {};
-    Variant(const signed short int* vals,       size_t n) : Variant(std::vector<long long int>(vals, vals+n)) {};
-    Variant(const signed int* vals,             size_t n) : Variant(std::vector<long long int>(vals, vals+n)) {};
-    Variant(const signed long int* vals,        size_t n) : Variant(std::vector<long long int>(vals, vals+n)) {};
-    Variant(const signed long long int* vals,   size_t n) : Variant(std::vector<long long int>(vals, vals+n)) {};
-    Variant(const unsigned char* vals,          size_t n) : Variant(std::vector<unsigned long long int>(vals, vals+n)) {};
-    Variant(const unsigned short int* vals,     size_t n) : Variant(std::vector<unsigned long long int>(vals, vals+n)) {};
-    Variant(const unsigned int* vals,           size_t n) : Variant(std::vector<unsigned long long int>(vals, vals+n)) {};
-    Variant(const unsigned long int* vals,      size_t n) : Variant(std::vector<unsigned long long int>(vals, vals+n)) {};
-    Variant(const unsigned long long int* vals, size_t n) : Variant(std::vector<unsigned long long int>(vals, vals+n)) {};
-    Variant(const float* vals,                  size_t n) : Variant(std::vector<double>(vals, vals+n)) {};
-    Variant(const double* vals,                 size_t n) : Variant(std::vector<double>(vals, vals+n)) {};
+    // Copy elements into owned array of the same element type
+    Variant(const epicsInt8* vals,              size_t n) : Variant(copyOf(vals, n)) {};
+    Variant(const epicsUInt8* vals,             size_t n) : Variant(copyOf(vals, n)) {};
+    Variant(const epicsInt16* vals,             size_t n) : Variant(copyOf(vals, n)) {};
+    Variant(const epicsUInt16* vals,            size_t n) : Variant(copyOf(vals, n)) {};
+    Variant(const epicsInt32* vals,             size_t n) : Variant(copyOf(vals, n)) {};
+    Variant(const epicsUInt32* vals,            size_t n) : Variant(copyOf(vals, n)) {};
+    Variant(const epicsInt64* vals,             size_t n) : Variant(copyOf(vals, n)) {};
+    Variant(const epicsUInt64* vals,            size_t n) : Variant(copyOf(vals, n)) {};
+    Variant(const epicsFloat32* vals,           size_t n) : Variant(copyOf(vals, n)) {};
+    Variant(const epicsFloat64* vals,           size_t n) : Variant(copyOf(vals, n)) {};
+
+    // Reference external memory without copying
+    static Variant view(const epicsInt8* vals,    size_t n) { return Variant(Array{ElementType::INT8,   vals, n}); };
+    static Variant view(const epicsUInt8* vals,   size_t n) { return Variant(Array{ElementType::UINT8,  vals, n}); };
+    static Variant view(const epicsInt16* vals,   size_t n) { return Variant(Array{ElementType::INT16,  vals, n}); };
+    static Variant view(const epicsUInt16* vals,  size_t n) { return Variant(Array{ElementType::UINT16, vals, n}); };
+    static Variant view(const epicsInt32* vals,   size_t n) { return Variant(Array{ElementType::INT32,  vals, n}); };
+    static Variant view(const epicsUInt32* vals,  size_t n) { return Variant(Array{ElementType::UINT32, vals, n}); };
+    static Variant view(const epicsInt64* vals,   size_t n) { return Variant(Array{ElementType::INT64,  vals, n}); };
+    static Variant view(const epicsUInt64* vals,  size_t n) { return Variant(Array{ElementType::UINT64, vals, n}); };
+    static Variant view(const epicsFloat32* vals, size_t n) { return Variant(Array{ElementType::FLOAT,  vals, n}); };
+    static Variant view(const epicsFloat64* vals, size_t n) { return Variant(Array{ElementType::DOUBLE, vals, n}); };
+
+    // Take over vector storage, elements keep their native width
+    template <typename T>
+    static Variant adopt(std::vector<T>&& vals);
+
+    /**
+     * @brief Convert value without throwing.
+     *
+     * The get_* functions below throw ConvertError on failure, try_get
+     * returns false instead and leaves out untouched.
+     *
+     * Array overload provides a view of numeric vectors and arrays,
+     * the string overload a view of string characters, views are valid
+     * as long as this Variant is not modified.
+     */
+    bool try_get(bool& out) const noexcept;
+    bool try_get(int64_t& out) const noexcept;
+    bool try_get(uint64_t& out) const noexcept;
+    bool try_get(double& out) const noexcept;
+    bool try_get(std::string& out) const;
+    bool try_get(Array& out) const noexcept;
+    bool try_get(const char*& data, size_t& size) const noexcept;
 
     bool get_bool() const;
     int64_t get_long() const;
@@ -100,6 +199,81 @@ public:
     std::vector<unsigned long long int> get_unsigned_array() const;
     std::vector<double> get_double_array() const;
     std::vector<std::string> get_string_array() const;
+    const Array& get_array() const;
+
+    /**
+     * @brief Reference string elements without copying them.
+     *
+     * Throws ConvertError unless type is VECTOR_STRING.
+     */
+    const std::vector<std::string>& get_string_vector() const;
+
+    /**
+     * @brief Copy string value into fixed-size buffer, ie. record's VAL field.
+     *
+     * Too long value is truncated at UTF-8 character boundary, buffer is
+     * always NUL terminated. Scalars are formatted like get_string().
+     *
+     * @param dst Destination buffer
+     * @param size Size of destination buffer, including NUL
+     * @return Number of characters copied, without NUL
+     */
+    size_t copy_string(char* dst, size_t size) const;
+
+    /**
+     * @brief Copy string elements into consecutive fixed-size buffers.
+     *
+     * Each element is copied like with copy_string(), values that are not
+     * strings are formatted like get_string_array().
+     *
+     * @param dst Destination buffer of max elements
+     * @param size Size of each element, including NUL
+     * @param max Maximum number of elements to copy
+     * @return Number of elements copied
+     */
+    size_t copy_strings(char* dst, size_t size, size_t max) const;
+
+private:
+    union {
+        bool b;
+        double d;
+        long long l;
+        unsigned long long u;
+        std::string s;
+        std::vector<long long int> vl;
+        std::vector<unsigned long long int> vu;
+        std::vector<double> vd;
+        std::vector<std::string> vs;
+        Array a;
+    };
+
+    template <typename T>
+    static Variant copyOf(const T* vals, size_t n)
+    {
+        return adopt(std::vector<T>(vals, vals + n));
+    }
+
+    static ElementType elementType(const epicsInt8*)    { return ElementType::INT8;   };
+    static ElementType elementType(const epicsUInt8*)   { return ElementType::UINT8;  };
+    static ElementType elementType(const epicsInt16*)   { return ElementType::INT16;  };
+    static ElementType elementType(const epicsUInt16*)  { return ElementType::UINT16; };
+    static ElementType elementType(const epicsInt32*)   { return ElementType::INT32;  };
+    static ElementType elementType(const epicsUInt32*)  { return ElementType::UINT32; };
+    static ElementType elementType(const epicsInt64*)   { return ElementType::INT64;  };
+    static ElementType elementType(const epicsUInt64*)  { return ElementType::UINT64; };
+    static ElementType elementType(const epicsFloat32*) { return ElementType::FLOAT;  };
+    static ElementType elementType(const epicsFloat64*) { return ElementType::DOUBLE; };
+
+    void assign(const Variant& other);
+    void assign(Variant&& other) noexcept;
+    void clear() noexcept;
 };
 
+template <typename T>
+Variant Variant::adopt(std::vector<T>&& vals)
+{
+    auto owner = std::make_shared<std::vector<T>>(std::move(vals));
+    return Variant(Array{elementType(owner->data()), owner->data(), owner->size(), owner});
+}
+
 #endif // VARIANT_H